@@ -17,32 +17,64 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <time.h>
 
-// Using 2.9.x FUSE API
+// Using 2.9.x FUSE low-level API
 #define FUSE_USE_VERSION 29
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #include "a1fs.h"
 #include "fs_ctx.h"
 #include "options.h"
 #include "map.h"
+#include "dir_compact.h"
+#include "dir_index.h"
+#include "nlookup.h"
 #include "util.h"
 
-//NOTE: All path arguments are absolute paths within the a1fs file system and
-// start with a '/' that corresponds to the a1fs root directory.
+//NOTE: The callbacks get inode numbers rather than paths. The kernel resolves
+// paths itself, one component at a time with lookup(), and caches the result,
+// so an operation on a file deep in the tree does not walk the tree again.
 //
-// For example, if a1fs is mounted at "~/my_csc369_repo/a1b/mnt/", the path to a
-// file at "~/my_csc369_repo/a1b/mnt/dir/file" (as seen by the OS) will be
-// passed to FUSE callbacks as "/dir/file".
+// Every inode handed to the kernel by lookup(), mkdir() or create() is counted
+// in fs->nl until the kernel forgets it. A file or directory removed while it
+// is still counted keeps its inode and blocks, with no links, until forget()
+// drops the last reference, so a file that is open when it is removed stays
+// readable and writable.
 //
-// Paths to directories (except for the root directory - "/") do not end in a
-// trailing '/'. For example, "~/my_csc369_repo/a1b/mnt/dir/" will be passed to
-// FUSE callbacks as "/dir".
+// FUSE numbers the root directory FUSE_ROOT_ID (1), while the root of a1fs is
+// inode 0, so inode numbers seen by the kernel are those of a1fs plus 1.
+//
+// Callbacks run in several threads at once. Each locks the inodes it uses
+// with nlookup_lock(), a directory before the inodes in it, and then takes
+// fs->alloc_lock around the steps that may allocate or free blocks or inodes.
+// Data is copied without it, so writes to the blocks files already have run in
+// parallel. Reads and lookups only take read locks, so those of different
+// files, or of the same one, run in parallel. An open file pins its entry in
+// fs->nl, and a file without buffered data is not looked up in fs->da, so a
+// read through a handle takes no lock shared with other files.
+
+/** How long the kernel may cache names and attributes, in seconds; the same as
+ * the high-level API uses by default. */
+#define A1FS_TIMEOUT 1.0
+
+/** Convert an inode number seen by the kernel to an a1fs inode number. */
+static a1fs_ino_t to_inum(fuse_ino_t ino)
+{
+	return (a1fs_ino_t)(ino - FUSE_ROOT_ID);
+}
+
+/** Convert an a1fs inode number to the one seen by the kernel. */
+static fuse_ino_t to_fuse_ino(a1fs_ino_t inum)
+{
+	return (fuse_ino_t) inum + FUSE_ROOT_ID;
+}
 
 
 /**
@@ -50,7 +82,7 @@
  *
  * Called when the file system is mounted. NOTE: we are not using the FUSE
  * init() callback since it doesn't support returning errors. This function must
- * be called explicitly before fuse_main().
+ * be called explicitly before the session loop is started.
  *
  * @param fs    file system context to initialize.
  * @param opts  command line options.
@@ -65,7 +97,50 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
 	if (!image) return false;
 
-	return fs_ctx_init(fs, image, size);
+	if (!fs_ctx_init(fs, image, size)) return false;
+	fs->alloc_policy = opts->alloc_policy;
+	fs->inode_placement = opts->inode_placement;
+	fs->dc.max = opts->dcache_max;
+	fs->dcache_stats = opts->dcache_stats;
+	return true;
+}
+
+/** Free the inode, with all of its blocks and buffered data. The inode must
+ * be locked for writing and fs->alloc_lock held. */
+static void free_inode(fs_ctx *fs, a1fs_ino_t inum)
+{
+	a1fs_inode *inode = get_inode_by_inumber(fs->image, inum);
+	if (S_ISDIR(inode->mode)) {
+		a1fs_group_desc *gd = get_group_desc(fs->image, get_group_of(fs->image, inum, LOOKUP_IB));
+		if (gd->g_num_dirs > 0) gd->g_num_dirs--;
+		dir_hint_set(&fs->dh, inum, 0);
+	} else {
+		// buffered data of the file is never written
+		delalloc_drop(fs, inum);
+	}
+	// free the data (or dentry) blocks and the extent blocks
+	free_dentry_blks(fs, inode);
+	free_extent_blk(fs, inode);
+	// free the inode itself
+	mask(fs, inum, LOOKUP_IB, false);
+}
+
+/** Free the inode if it was removed while the kernel still referred to it. */
+static void free_if_unlinked(void *ctx, a1fs_ino_t inum)
+{
+	fs_ctx *fs = (fs_ctx*)ctx;
+	if (is_used_bit(fs->image, inum, LOOKUP_IB) && get_inode_by_inumber(fs->image, inum)->links == 0)
+		free_inode(fs, inum);
+}
+
+/** Remove the last link to the inode. It is freed now if the kernel does not
+ * refer to it, or by forget() once it no longer does. The directory it was
+ * removed from and the inode must be locked for writing and fs->alloc_lock
+ * held. */
+static void unlink_inode(fs_ctx *fs, a1fs_ino_t inum)
+{
+	get_inode_by_inumber(fs->image, inum)->links = 0;
+	if (nlookup_count(&fs->nl, inum) == 0) free_inode(fs, inum);
 }
 
 /**
@@ -78,17 +153,178 @@ static void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
 	if (fs->image) {
+		// files removed while still open are freed for good
+		nlookup_destroy(&fs->nl, free_if_unlinked, fs);
+		// write back the data still waiting for blocks
+		delalloc_flush_all(fs);
+		if (fs->dcache_stats) {
+			uint64_t hits, misses;
+			dcache_stats(&fs->dc, &hits, &misses);
+			fprintf(stderr, "a1fs: lookup cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+			        hits, misses);
+		}
 		munmap(fs->image, fs->size);
 		fs_ctx_destroy(fs);
 	}
 }
 
 /** Get file system context. */
-static fs_ctx *get_fs(void)
+static fs_ctx *get_fs(fuse_req_t req)
+{
+	return (fs_ctx*)fuse_req_userdata(req);
+}
+
+/** State of an open file, kept in fi->fh. */
+typedef struct a1fs_file {
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** Inode of the file. */
+	a1fs_inode *inode;
+	/** Entry of the inode in fs->nl, pinned while the file is open. */
+	nlookup *n;
+	/** Extent used by the last read or write. */
+	ext_cursor cur;
+	/** Protects cur from reads through the handle at the same time; writes
+	 * hold the lock of the inode for writing. */
+	pthread_mutex_t lock;
+} a1fs_file;
+
+/** Get the handle of the open file; NULL if fi has none. */
+static a1fs_file *get_file(struct fuse_file_info *fi)
+{
+	return fi != NULL ? (a1fs_file *)(uintptr_t)fi->fh : NULL;
+}
+
+
+/**
+ * Find the buffered data of the file, whose inode is locked through n. A file
+ * known to have none is not looked up, so that reads do not take fs->da.lock.
+ *
+ * @param fs    file system context.
+ * @param inum  inode number of the file.
+ * @param n     entry of the inode in fs->nl; NULL to always look up.
+ * @return      the buffer of the file; NULL if it has none.
+ */
+static da_buf *find_buf(fs_ctx *fs, a1fs_ino_t inum, nlookup *n)
+{
+	if (n != NULL && !__atomic_load_n(&n->buffered, __ATOMIC_RELAXED)) return NULL;
+	da_buf *b = delalloc_find(fs, inum);
+	// buffers are only made with the inode locked for writing, so no other
+	// thread can make one while this one holds the lock
+	if (b == NULL && n != NULL) __atomic_store_n(&n->buffered, false, __ATOMIC_RELAXED);
+	return b;
+}
+
+/** Fill in the attributes of the inode returned by getattr(); n is its
+ * entry in fs->nl, or NULL, as in find_buf(). */
+static void fill_stat(fs_ctx *fs, a1fs_ino_t inum, nlookup *n, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	a1fs_inode *this_file = get_inode_by_inumber(fs->image, inum);
+	da_buf *b = find_buf(fs, inum, n);
+	st->st_ino = to_fuse_ino(inum);
+	st->st_mode = this_file->mode;
+	st->st_size = b != NULL ? b->size : this_file->size;
+	st->st_nlink = this_file->links;
+	// inline data and holes take no blocks; buffered data counts the blocks
+	// reserved for it
+	a1fs_blk_t num_blk = count_alloc_blks(fs->image, this_file) + (b != NULL ? b->reserved : 0);
+	st->st_blocks = (blkcnt_t) num_blk * (A1FS_BLOCK_SIZE / 512);
+	st->st_mtime = (time_t) this_file->mtime.tv_sec;
+}
+
+/**
+ * Fill in the entry that hands the inode to the kernel, counting the new
+ * reference to it. The inode must be locked, or not reachable by name yet.
+ *
+ * @param fs    file system context.
+ * @param inum  inode number of the file or directory.
+ * @param n     entry of the inode in fs->nl if it is locked; NULL otherwise.
+ * @param e     receives the entry.
+ * @return      0 on success; -ENOMEM if out of memory.
+ */
+static int make_entry(fs_ctx *fs, a1fs_ino_t inum, nlookup *n, struct fuse_entry_param *e)
 {
-	return (fs_ctx*)fuse_get_context()->private_data;
+	if (!nlookup_get(&fs->nl, inum)) return -ENOMEM;
+	memset(e, 0, sizeof(*e));
+	e->ino = to_fuse_ino(inum);
+	e->attr_timeout = A1FS_TIMEOUT;
+	e->entry_timeout = A1FS_TIMEOUT;
+	fill_stat(fs, inum, n, &e->attr);
+	return 0;
 }
 
+/**
+ * Look up a name in a directory.
+ *
+ * Called by the kernel for each component of a path it has not cached. The
+ * name is searched in its parent only, through the lookup cache.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the name is too long.
+ *   ENOENT        the name does not exist.
+ *   ENOMEM        not enough memory to count the reference.
+ *   ENOTDIR       parent is not a directory.
+ *
+ * @param req     request handle.
+ * @param parent  inode number of the directory.
+ * @param name    the name to look up.
+ */
+static void a1fs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	if (strlen(name) >= A1FS_NAME_MAX) {
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t parent_inum = to_inum(parent);
+	nlookup *pn = nlookup_lock(&fs->nl, parent_inum, false);
+	if (pn == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	struct fuse_entry_param e;
+	int err = dir_lookup(fs, parent_inum, name);
+	if (err >= 0) {
+		nlookup *n = nlookup_lock(&fs->nl, (a1fs_ino_t) err, false);
+		err = n != NULL ? make_entry(fs, (a1fs_ino_t) err, n, &e) : -ENOMEM;
+		if (n != NULL) nlookup_unlock(&fs->nl, n);
+	}
+	nlookup_unlock(&fs->nl, pn);
+	if (err < 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+/**
+ * Forget about an inode.
+ *
+ * Called when the kernel drops num references to the inode, which it got
+ * from lookup(), mkdir() or create(). An inode that was removed is freed
+ * once the kernel no longer refers to it.
+ *
+ * @param req      request handle.
+ * @param ino      inode number.
+ * @param num      number of references dropped.
+ */
+static void a1fs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long num)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	// the entry of a counted inode exists, so locking it takes no memory
+	nlookup *n = nlookup_lock(&fs->nl, inum, true);
+	if (n != NULL) {
+		if (nlookup_put(&fs->nl, inum, num) == 0) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			free_if_unlinked(fs, inum);
+			pthread_mutex_unlock(&fs->alloc_lock);
+		}
+		nlookup_unlock(&fs->nl, n);
+	}
+	fuse_reply_none(req);
+}
 
 /**
  * Get file system statistics.
@@ -101,134 +337,232 @@ static fs_ctx *get_fs(void)
  *
  * Errors: none
  *
- * @param path  path to any file in the file system. Can be ignored.
- * @param st    pointer to the struct statvfs that receives the result.
- * @return      0 on success; -errno on error.
+ * @param req  request handle.
+ * @param ino  inode number of any file in the file system. Can be ignored.
  */
-static int a1fs_statfs(const char *path, struct statvfs *st)
+static void a1fs_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-	fs_ctx *fs = get_fs();
-	(void) path;
-	memset(st, 0, sizeof(*st));
-	st->f_bsize   = A1FS_BLOCK_SIZE;
-	st->f_frsize  = A1FS_BLOCK_SIZE;
+	fs_ctx *fs = get_fs(req);
+	(void) ino;
+	struct statvfs st;
+	memset(&st, 0, sizeof(st));
+	st.f_bsize   = A1FS_BLOCK_SIZE;
+	st.f_frsize  = A1FS_BLOCK_SIZE;
 	// fill in the rest of required fields based on the information stored
 	// in the superblock
-	st->f_namemax = A1FS_NAME_MAX;
+	pthread_mutex_lock(&fs->alloc_lock);
 	// total number of blocks
-	st->f_blocks = fs->s->s_num_blocks;
+	st.f_blocks = fs->s->s_num_blocks;
 	// number of free blocks
-	st->f_bfree = fs->s->s_num_free_blocks;
-	st->f_bavail = st->f_bfree;
+	st.f_bfree = fs->s->s_num_free_blocks - fs->da.reserved;
+	st.f_bavail = st.f_bfree;
 	// total number of inodes
-	st->f_files = fs->s->s_num_inodes;
+	st.f_files = fs->s->s_num_inodes;
 	// number of free inodes
-	st->f_ffree = fs->s->s_num_free_inodes;
-	st->f_favail = st->f_ffree;
+	st.f_ffree = fs->s->s_num_free_inodes;
+	st.f_favail = st.f_ffree;
+	pthread_mutex_unlock(&fs->alloc_lock);
 	// maximun filename length
-	st->f_namemax = A1FS_NAME_MAX;
+	st.f_namemax = A1FS_NAME_MAX;
 
-	return 0;
+	fuse_reply_statfs(req, &st);
 }
 
 /**
  * Get file or directory attributes.
  *
  * Implements the lstat() system call. See "man 2 lstat" for details.
- * The following fields can be ignored: st_dev, st_ino, st_uid, st_gid, st_rdev,
+ * The following fields can be ignored: st_dev, st_uid, st_gid, st_rdev,
  *                                      st_blksize, st_atim, st_ctim.
  * All remaining fields are required.
  *
  * NOTE: the st_blocks field is measured in 512-byte units (disk sectors).
  *
- * Errors:
- *   ENAMETOOLONG  the path or one of its components is too long.
- *   ENOENT        a component of the path does not exist.
- *   ENOTDIR       a component of the path prefix is not a directory.
+ * Errors: none
  *
- * @param path  path to a file or directory.
- * @param st    pointer to the struct stat that receives the result.
- * @return      0 on success; -errno on error;
+ * @param req  request handle.
+ * @param ino  inode number of the file or directory.
+ * @param fi   unused.
  */
-static int a1fs_getattr(const char *path, struct stat *st)
+static void a1fs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
-	fs_ctx *fs = get_fs();
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	nlookup *n = nlookup_lock(&fs->nl, inum, false);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	struct stat st;
+	fill_stat(fs, inum, n, &st);
+	nlookup_unlock(&fs->nl, n);
+	fuse_reply_attr(req, &st, A1FS_TIMEOUT);
+}
 
-	memset(st, 0, sizeof(*st));
+/**
+ * Open a directory.
+ *
+ * Implements the opendir() system call. The directory is not compacted while
+ * it is open, so that the offsets readdir() returns keep pointing at the same
+ * entries.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param req  request handle.
+ * @param ino  inode number of the directory to open.
+ * @param fi   receives the inode number of the directory in fh.
+ */
+static void a1fs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	if (!dir_hint_open(&fs->dh, inum)) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	fi->fh = inum;
+	fuse_reply_open(req, fi);
+}
 
-	// lookup the inode for given path and, if it exists, fill in the
-	// required fields based on the information stored in the inode
-	int err = path_lookup(path, fs);
-	if (err < 0) {
-		return err;
-	} else {
-		a1fs_inode *this_file = get_inode_by_inumber(fs->image, err);
-		if (this_file == NULL) perror("Invalid inode!");
-		st->st_mode = this_file->mode;
-		st->st_size = this_file->size;
-		st->st_nlink = this_file->links;
-		st->st_blocks = CEIL_DIV(this_file->size, 512);
-		st->st_mtime = (time_t) this_file->mtime.tv_sec;
+/**
+ * Release an open directory.
+ *
+ * Called when the last file descriptor of a directory opened with opendir()
+ * is closed. Compacts the directory if names were removed from it while it
+ * was open and left it mostly empty.
+ *
+ * @param req  request handle.
+ * @param ino  inode number of the directory.
+ * @param fi   handle of the open directory.
+ */
+static void a1fs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)ino;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = (a1fs_ino_t) fi->fh;
+	dir_hint_release(&fs->dh, inum);
+	nlookup *n = nlookup_lock(&fs->nl, inum, true);
+	if (n != NULL) {
+		// unless it was removed in the meantime
+		a1fs_inode *dir = get_inode_by_inumber(fs->image, inum);
+		if (dir->links > 0 && S_ISDIR(dir->mode)) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			dir_compact_maybe(fs, inum);
+			pthread_mutex_unlock(&fs->alloc_lock);
+		}
+		nlookup_unlock(&fs->nl, n);
 	}
+	fuse_reply_err(req, 0);
+}
+
+/** Marks readdir() offsets that are positions of dir_index_walk() rather than
+ * of dir_iter_tell(). */
+#define READDIR_HASHED (1ull << 48)
+
+/** State of a readdir() call. */
+typedef struct readdir_ctx {
+	fuse_req_t req;
+	fs_ctx *fs;
+	/** Inode number of the directory. */
+	a1fs_ino_t dir_inum;
+	/** Buffer that receives the entries, its size and the bytes used. */
+	char *buf;
+	size_t size, len;
+	/** READDIR_HASHED for an indexed directory, 0 otherwise. */
+	uint64_t tag;
+} readdir_ctx;
+
+/** Add an entry for the name to the reply with the offset of the one after it.
+ * Return 1 if the buffer is full. */
+static int add_direntry(readdir_ctx *c, const char *name, a1fs_ino_t inum, mode_t mode, off_t next)
+{
+	// only the inode number and the type of the entry reach the kernel
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_ino = to_fuse_ino(inum);
+	st.st_mode = mode;
+	size_t len = fuse_add_direntry(c->req, c->buf + c->len, c->size - c->len, name, &st, next);
+	if (len > c->size - c->len) return 1;
+	c->len += len;
+	return 0;
+}
+
+/** Add the used entry to the reply with the position of the next one. Return
+ * 1 once the buffer is full. */
+static int readdir_entry(void *ctx, a1fs_dentry *d, uint64_t next)
+{
+	readdir_ctx *c = (readdir_ctx *)ctx;
+	// the lookups that follow, e.g. by ls -l, are cached
+	const char *name = dentry_name(c->fs->image, d);
+	mode_t mode = get_inode_by_inumber(c->fs->image, d->ino)->mode;
+	if (add_direntry(c, name, d->ino, mode, 3 + (c->tag | next)) != 0) return 1;
+	dcache_insert(&c->fs->dc, c->dir_inum, name, d->ino);
 	return 0;
 }
 
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
- * for each directory entry. See fuse.h in libfuse source code for details.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a directory.
+ * Implements the readdir() system call. Replies with as many directory
+ * entries from offset on as fit in size bytes, each with the offset of the
+ * one after it. See fuse_lowlevel.h in libfuse source code for details.
  *
  * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *
- * @param path    path to the directory.
- * @param buf     buffer that receives the result.
- * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ * @param req     request handle.
+ * @param ino     inode number of the directory.
+ * @param size    maximum number of bytes to reply with.
+ * @param offset  where to resume: 0 at the start, or an offset of an entry
+ *                returned by an earlier call.
  * @param fi      unused.
- * @return        0 on success; -errno on error.
  */
-static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *fi)
+static void a1fs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;// unused
 	(void)fi;// unused
-	fs_ctx *fs = get_fs();
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-
-	// lookup the directory inode for given path and iterate through its
-	// directory entries
-	int err = path_lookup(path, fs);
-	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, (a1fs_ino_t) err);
-	a1fs_extent *this_extent = (a1fs_extent *) jump_to(fs->image, dir_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t extent_offset = 0; extent_offset < 512; extent_offset++) {
-        if ((this_extent + extent_offset)->start == (a1fs_blk_t) -1) continue;
-		if ((this_extent + extent_offset)->start >= fs->s->s_num_blocks) continue;
-        a1fs_dentry *this_dentry;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < (this_extent + extent_offset)->count; blk_offset++) {
-            uint32_t blk_num = (this_extent + extent_offset)->start + blk_offset;
-            this_dentry = (a1fs_dentry *) jump_to(fs->image, blk_num, A1FS_BLOCK_SIZE);
-            for (uint32_t dentry_offset = 0; dentry_offset < 16; dentry_offset++ ) {
-				a1fs_ino_t inum = (this_dentry + dentry_offset)->ino;
-				if (inum == (a1fs_ino_t) -1) continue;
-				else {
-     	            err = filler(buf, (this_dentry + dentry_offset)->name, NULL, 0);
-					if (err != 0) {
-						return -ENOMEM;
-					} 
-				}
-            }
-        }
-    }
-	return 0;
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t dir_inum = to_inum(ino);
+	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+
+	readdir_ctx ctx = {req, fs, dir_inum, malloc(size), size, 0, 0};
+	nlookup *n = ctx.buf != NULL ? nlookup_lock(&fs->nl, dir_inum, false) : NULL;
+	if (n == NULL) {
+		free(ctx.buf);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	// "." and ".." are at offsets 1 and 2, the entries at their position in
+	// the directory after that; each offset returned is where the next call
+	// resumes. The parent of a directory is not recorded, and the kernel
+	// knows it anyway, so ".." gets the inode of the directory itself
+	if (offset < 1 && add_direntry(&ctx, ".", dir_inum, S_IFDIR, 1) != 0) goto reply;
+	if (offset < 2 && add_direntry(&ctx, "..", dir_inum, S_IFDIR, 2) != 0) goto reply;
+
+	uint64_t pos = offset > 2 ? offset - 3 : 0;
+	if (is_indexed(dir_ino)) {
+		// in hash order, which splitting dentry blocks does not change; an
+		// offset from before the directory got its index starts over
+		ctx.tag = READDIR_HASHED;
+		dir_index_walk(fs->image, dir_ino, pos & READDIR_HASHED ? pos & ~READDIR_HASHED : 0,
+		               readdir_entry, &ctx);
+		goto reply;
+	}
+	dir_iter it;
+	dir_iter_init(&it, dir_ino);
+	if (pos != 0 && !(pos & READDIR_HASHED)) dir_iter_seek(fs->image, &it, pos);
+	for (a1fs_dentry *this_dentry; (this_dentry = dir_iter_next(fs->image, &it)) != NULL;) {
+		if (this_dentry->ino == (a1fs_ino_t) -1) continue;
+		if (readdir_entry(&ctx, this_dentry, dir_iter_tell(&it)) != 0) break;
+	}
+
+reply:
+	nlookup_unlock(&fs->nl, n);
+	fuse_reply_buf(req, ctx.buf, ctx.len);
+	free(ctx.buf);
 }
 
 
@@ -237,131 +571,135 @@ static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  *
  * Implements the mkdir() system call.
  *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" doesn't exist.
- *   The parent directory of "path" exists and is a directory.
- *   "path" and its components are not too long.
+ * Assumptions (already verified by FUSE using lookup() calls):
+ *   "name" doesn't exist in the parent directory.
+ *   "name" is not too long.
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- * 	
- * @param path  path to the directory to create.
- * @param mode  file mode bits.
- * @return      0 on success; -errno on error.
+ *
+ * @param req     request handle.
+ * @param parent  inode number of the parent directory.
+ * @param name    name of the directory to create.
+ * @param mode    file mode bits.
  */
-static int a1fs_mkdir(const char *path, mode_t mode)
+static void a1fs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
 	mode = mode | S_IFDIR;
-	fs_ctx *fs = get_fs();
-
-    char *parent = strdup(path);
-    char *name = strdup(path);
-	char *parent_to_free = parent;
-	char *name_to_free = name;
-
-    if (parent[strlen(parent)-1] == '/') {
-        parent[strlen(parent)-1] = '\0';
-   		name[strlen(name)-1] = '\0';
-    }
+	fs_ctx *fs = get_fs(req);
 
-    name = strrchr(name, '/'); name++;
-    parent[strlen(parent) - strlen(name)] = '\0';
-
-	a1fs_ino_t inum = path_lookup(parent, fs);
-	if (fs->s->s_num_free_inodes < 1) return -ENOSPC;
+	a1fs_ino_t inum = to_inum(parent);
 	a1fs_inode *this_inode = get_inode_by_inumber(fs->image, inum);
-	a1fs_dentry *free_dentry = find_first_free_dentry(fs->image, inum);
-	a1fs_extent *free_extent;
-	if (free_dentry == NULL) {
-		if (has_n_free_blk(fs, 3, LOOKUP_DB)) {
-			int ext_offset = find_first_empty_extent_offset(fs->image, this_inode->i_ptr_extent);
-			if (ext_offset == -1) {
-				goto err;
-			} else {
-				free_extent = (a1fs_extent *) jump_to(fs->image, this_inode->i_ptr_extent, A1FS_BLOCK_SIZE);
-				free_extent += ext_offset;
-				a1fs_blk_t new_dentry_blk_num = find_first_free_blk_num(fs->image, LOOKUP_DB);
-				init_directory_blk(fs->image, new_dentry_blk_num);
-				mask(fs->image, new_dentry_blk_num, LOOKUP_DB, true);
-				free_extent->start = new_dentry_blk_num;
-				free_extent->count = 1;
-				free_dentry = (a1fs_dentry *) jump_to(fs->image, new_dentry_blk_num, A1FS_BLOCK_SIZE);
-			}
-		} else {
-			goto err;
-		}
-	} else {
-		if (!has_n_free_blk(fs, 2, LOOKUP_DB)) {
-			goto err;
-		}
+	nlookup *pn = nlookup_lock(&fs->nl, inum, true);
+	if (pn == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
 	}
-	if (!has_n_free_blk(fs, 1, LOOKUP_IB)) goto err;
-	create_new_dir_in_dentry(fs->image, free_dentry, name, mode);
+	pthread_mutex_lock(&fs->alloc_lock);
+	struct fuse_entry_param e;
+	int err = -ENOSPC;
+	if (!has_n_free_blk(fs, 1, LOOKUP_IB)) goto out;
+	// the new directory keeps its extents in its inode, and its dentries
+	// too unless the inode is too small for them; then it needs a block
+	a1fs_blk_t dir_blks = inline_capacity(fs->image) >= dentry_size(fs->image, "") ? 0 : 1;
+	a1fs_dentry *free_dentry = alloc_dentry(fs, inum, name, dir_blks);
+	if (free_dentry == NULL) goto out;
+	create_new_dir_in_dentry(fs, inum, free_dentry, mode);
+	dcache_insert(&fs->dc, inum, name, free_dentry->ino);
 	// increment link of parent inode
 	this_inode->links++;
-
-err:
-	free(parent_to_free);
-	free(name_to_free);
-
-	return 0;
+	err = make_entry(fs, free_dentry->ino, NULL, &e);
+
+out:
+	pthread_mutex_unlock(&fs->alloc_lock);
+	nlookup_unlock(&fs->nl, pn);
+	if (err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fuse_reply_entry(req, &e);
 }
 
 /**
  * Remove a directory.
  *
- * Implements the rmdir() system call.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a directory.
+ * Implements the rmdir() system call. The directory is freed once the kernel
+ * forgets it.
  *
  * Errors:
+ *   ENOENT     the name does not exist.
+ *   ENOTDIR    the name is not a directory.
  *   ENOTEMPTY  the directory is not empty.
  *
- * @param path  path to the directory to remove.
- * @return      0 on success; -errno on error.
+ * @param req     request handle.
+ * @param parent  inode number of the parent directory.
+ * @param name    name of the directory to remove.
  */
-static int a1fs_rmdir(const char *path)
+static void a1fs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = get_fs(req);
 
-	// prepare parent path and filename string
-	char *parent = strdup(path);
-    char *name = strdup(path);
-	char *parent_to_free = parent;
-	char *name_to_free = name;
-
-    if (parent[strlen(parent)-1] == '/') {
-        parent[strlen(parent)-1] = '\0';
-   		name[strlen(name)-1] = '\0';
-    }
-
-    name = strrchr(name, '/'); name++;
-    parent[strlen(parent) - strlen(name)] = '\0';
-
-	// find the inode of parent
-	a1fs_ino_t parent_inum = path_lookup(parent, fs);
+	// find the dentry of the directory to be deleted in the parent
+	a1fs_ino_t parent_inum = to_inum(parent);
 	a1fs_inode *parent_ino = get_inode_by_inumber(fs->image, parent_inum);
-	// find the dentry of file to be deleted
+	nlookup *pn = nlookup_lock(&fs->nl, parent_inum, true);
+	if (pn == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	nlookup *n = NULL;
+	int err = -ENOENT;
 	a1fs_dentry *dentry_rm = find_dentry_in_dir(fs->image, parent_ino, name);
+	if (dentry_rm == NULL) goto out;
+	a1fs_ino_t inum_rm = dentry_rm->ino;
+	err = -ENOMEM;
+	n = nlookup_lock(&fs->nl, inum_rm, true);
+	if (n == NULL) goto out;
 	// check if the dir is empty
-	a1fs_inode *ino_rm = get_inode_by_inumber(fs->image, dentry_rm->ino);
-	if (is_empty_dir(fs->image, ino_rm)) {
-		// free the dentry block of this inode
-		free_dentry_blks(fs->image, ino_rm);
-		// free the extent block of this inode
-		free_extent_blk(fs->image, ino_rm);
-		dentry_rm->ino = (a1fs_ino_t) -1;
-		parent_ino->links--;
-		free(parent_to_free);
-		free(name_to_free);
-		return 0;
-	} else {
-		free(parent_to_free);
-		free(name_to_free);
-		return -ENOTEMPTY;
-	}	
+	a1fs_inode *ino_rm = get_inode_by_inumber(fs->image, inum_rm);
+	err = -ENOTDIR;
+	if (!S_ISDIR(ino_rm->mode)) goto out;
+	err = -ENOTEMPTY;
+	if (!is_empty_dir(fs->image, ino_rm)) goto out;
+	pthread_mutex_lock(&fs->alloc_lock);
+	free_dentry(fs, parent_inum, dentry_rm);
+	dcache_insert(&fs->dc, parent_inum, name, (a1fs_ino_t) -1);
+	parent_ino->links--;
+	unlink_inode(fs, inum_rm);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	err = 0;
+
+out:
+	if (n != NULL) nlookup_unlock(&fs->nl, n);
+	nlookup_unlock(&fs->nl, pn);
+	fuse_reply_err(req, -err);
+}
+
+/** Make a handle for the file and store it in fi->fh. Return 0 on success,
+ * -ENOMEM if out of memory. */
+static int open_file(fs_ctx *fs, a1fs_ino_t inum, struct fuse_file_info *fi)
+{
+	a1fs_file *file = calloc(1, sizeof(a1fs_file));
+	if (file == NULL) return -ENOMEM;
+	file->n = nlookup_pin(&fs->nl, inum);
+	if (file->n == NULL) {
+		free(file);
+		return -ENOMEM;
+	}
+	file->ino = inum;
+	file->inode = get_inode_by_inumber(fs->image, inum);
+	pthread_mutex_init(&file->lock, NULL);
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+/** Free the handle made by open_file(). */
+static void close_file(fs_ctx *fs, a1fs_file *file)
+{
+	nlookup_unpin(&fs->nl, file->n);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
 }
 
 /**
@@ -369,275 +707,338 @@ static int a1fs_rmdir(const char *path)
  *
  * Implements the open()/creat() system call.
  *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" doesn't exist.
- *   The parent directory of "path" exists and is a directory.
- *   "path" and its components are not too long.
+ * Assumptions (already verified by FUSE using lookup() calls):
+ *   "name" doesn't exist in the parent directory.
+ *   "name" is not too long.
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *
- * @param path  path to the file to create.
- * @param mode  file mode bits.
- * @param fi    unused.
- * @return      0 on success; -errno on error.
+ * @param req     request handle.
+ * @param parent  inode number of the parent directory.
+ * @param name    name of the file to create.
+ * @param mode    file mode bits.
+ * @param fi      receives the handle of the open file in fh.
  */
-static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void a1fs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
 	assert(S_ISREG(mode));
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = get_fs(req);
 
+	a1fs_ino_t parent_inum = to_inum(parent);
+	nlookup *pn = nlookup_lock(&fs->nl, parent_inum, true);
+	if (pn == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	struct fuse_entry_param e;
 	// at least one inode
-	if (!has_n_free_blk(fs, 1, LOOKUP_IB)) return -ENOSPC;
-
-    // prepare parent path and filename string
-	char *parent = strdup(path);
-    char *name = strdup(path);
-	char *parent_to_free = parent;
-	char *name_to_free = name;
-
-    if (parent[strlen(parent)-1] == '/') {
-        parent[strlen(parent)-1] = '\0';
-   		name[strlen(name)-1] = '\0';
-    }
+	int err = -ENOSPC;
+	if (!has_n_free_blk(fs, 1, LOOKUP_IB)) goto out;
 
-    name = strrchr(name, '/'); name++;
-    parent[strlen(parent) - strlen(name)] = '\0';
-
-	// prepare parent directory to store new file
-	a1fs_ino_t parent_inum = path_lookup(parent, fs);
-	a1fs_inode *parent_ino = get_inode_by_inumber(fs->image, parent_inum);
-	a1fs_dentry *parent_dentry = find_first_free_dentry(fs->image, parent_inum);
-	// create new block of dentries
-	if (parent_dentry == NULL) {
-		a1fs_extent *parent_free_ext;
-		if (has_n_free_blk(fs, 2, LOOKUP_DB)) {
-			int free_ext_offset = find_first_empty_extent_offset(fs->image, parent_ino->i_ptr_extent);
-			// excess 512 extents
-			if (free_ext_offset == -1) {
-				goto err;
-			} else {
-				// use new extent to store new dentry block
-				parent_free_ext = (a1fs_extent *) jump_to(fs->image, parent_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-				parent_free_ext += free_ext_offset;
-				// init new dentry block
-				a1fs_blk_t new_dentry_blk_num = find_first_free_blk_num(fs->image, LOOKUP_DB);
-				init_directory_blk(fs->image, new_dentry_blk_num);
-				mask(fs->image, new_dentry_blk_num, LOOKUP_DB, true);
-				// record new dentry block
-				parent_free_ext->start = new_dentry_blk_num;
-				parent_free_ext->count = 1;
-				// refer to the newly created dentry
-				parent_dentry = (a1fs_dentry *) jump_to(fs->image, new_dentry_blk_num, A1FS_BLOCK_SIZE);
-			}
-		} else {
-			goto err;
-		}
-	} else {
-		// need 1 free data block to store extent
-		if (!has_n_free_blk(fs, 1, LOOKUP_DB)) {
-			goto err;
-		}
-	}
+	// prepare parent directory to store new file; the file starts inline
+	// and needs no blocks of its own
+	a1fs_dentry *parent_dentry = alloc_dentry(fs, parent_inum, name, 0);
+	if (parent_dentry == NULL) goto out;
 	// create new file after preparation
-	create_new_file_in_dentry(fs->image, parent_dentry, name, mode);
-
-err:
-	free(parent_to_free);
-	free(name_to_free);
-	return 0;
+	create_new_file_in_dentry(fs, parent_inum, parent_dentry, mode);
+	dcache_insert(&fs->dc, parent_inum, name, parent_dentry->ino);
+	err = open_file(fs, parent_dentry->ino, fi);
+	if (err != 0) goto out;
+	err = make_entry(fs, parent_dentry->ino, NULL, &e);
+	// the kernel never releases a file it did not get
+	if (err != 0) close_file(fs, get_file(fi));
+
+out:
+	pthread_mutex_unlock(&fs->alloc_lock);
+	nlookup_unlock(&fs->nl, pn);
+	if (err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fuse_reply_create(req, &e, fi);
 }
 
 /**
  * Remove a file.
  *
- * Implements the unlink() system call.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
+ * Implements the unlink() system call. The file is freed once the kernel
+ * forgets it, so it can still be used through the descriptors open on it.
  *
- * Errors: none
+ * Errors:
+ *   ENOENT  the name does not exist.
  *
- * @param path  path to the file to remove.
- * @return      0 on success; -errno on error.
+ * @param req     request handle.
+ * @param parent  inode number of the parent directory.
+ * @param name    name of the file to remove.
  */
-static int a1fs_unlink(const char *path)
-{
-	fs_ctx *fs = get_fs();
-
-	// prepare parent path and filename string
-	char *parent = strdup(path);
-    char *name = strdup(path);
-	char *parent_to_free = parent;
-	char *name_to_free = name;
-	// split path to parent dir and file
-    if (parent[strlen(parent)-1] == '/') {
-        parent[strlen(parent)-1] = '\0';
-   		name[strlen(name)-1] = '\0';
-    }
-    name = strrchr(name, '/'); name++;
-    parent[strlen(parent) - strlen(name)] = '\0';
-	// prepare to remove file
-	a1fs_ino_t parent_inum = path_lookup(parent, fs);
+static void a1fs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	fs_ctx *fs = get_fs(req);
+
+	// find the dentry containing the file
+	a1fs_ino_t parent_inum = to_inum(parent);
 	a1fs_inode *parent_ino = get_inode_by_inumber(fs->image, parent_inum);
-	a1fs_ino_t file_inum = path_lookup(path, fs);
-	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
-	// free dentry containing the file
+	nlookup *pn = nlookup_lock(&fs->nl, parent_inum, true);
+	if (pn == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	nlookup *n = NULL;
+	int err = -ENOENT;
 	a1fs_dentry *parent_dentry = find_dentry_in_dir(fs->image, parent_ino, name);
-	free_dentry_blks(fs->image, file_ino);
-	// free file extent
-	free_extent_blk(fs->image, file_ino);
-	// free inode
-	mask(fs->image, file_inum, LOOKUP_IB, false);
+	if (parent_dentry == NULL) goto out;
+	a1fs_ino_t file_inum = parent_dentry->ino;
+	err = -ENOMEM;
+	n = nlookup_lock(&fs->nl, file_inum, true);
+	if (n == NULL) goto out;
 	// remove from dentry
-	parent_dentry->ino = (a1fs_ino_t) -1;
-	free(parent_to_free);
-	free(name_to_free);
-	return 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	free_dentry(fs, parent_inum, parent_dentry);
+	dcache_insert(&fs->dc, parent_inum, name, (a1fs_ino_t) -1);
+	unlink_inode(fs, file_inum);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	err = 0;
+
+out:
+	if (n != NULL) nlookup_unlock(&fs->nl, n);
+	nlookup_unlock(&fs->nl, pn);
+	fuse_reply_err(req, -err);
 }
 
 
 /**
- * Change the modification time of a file or directory.
- *
- * Implements the utimensat() system call. See "man 2 utimensat" for details.
- *
- * NOTE: You only need to implement the setting of modification time (mtime).
+ * Change the size of a file.
  *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists.
+ * Implements the truncate() system call. Supports both extending and shrinking.
+ * If the file is extended, the new uninitialized range at the end must be
+ * filled with zeros.
  *
- * Errors: none
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *   ENOSPC  not enough free space in the file system.
  *
- * @param path   path to the file or directory.
- * @param times  timestamps array. See "man 2 utimensat" for details.
- * @return       0 on success; -errno on failure.
+ * @param fs         file system context; fs->alloc_lock must not be held.
+ * @param file_inum  inode number of the file, locked for writing.
+ * @param size       new file size in bytes.
+ * @return           0 on success; -errno on error.
  */
-static int a1fs_utimens(const char *path, const struct timespec times[2])
+static int truncate_file(fs_ctx *fs, a1fs_ino_t file_inum, off_t size)
 {
-	fs_ctx *fs = get_fs();
-
-	a1fs_ino_t file_inum = path_lookup(path, fs);
+	assert(size >= 0);
 	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
-
-	// set to current time if new timestemp is not specified
-	if (times == NULL) {
-		clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));	
-	} else {
-		memcpy(&file_ino->mtime, &times[1], sizeof(struct timespec));
+	if (delalloc_find(fs, file_inum) == NULL && (uint64_t) size == file_ino->size) return 0;
+
+	// give the buffered data its blocks first so that the size on disk is
+	// the real one, then set new file size, possibly "zeroing out" the
+	// uninitialized range
+	pthread_mutex_lock(&fs->alloc_lock);
+	int err = delalloc_flush(fs, file_inum);
+	uint64_t old_size = file_ino->size;
+	if (err == 0 && (uint64_t) size < old_size) {
+		err = shrink_by_amount(fs, file_ino, old_size - size);
+	} else if (err == 0 && (uint64_t) size > old_size) {
+		err = extend_by_amount(fs, file_ino, size - old_size);
 	}
-	return 0;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (err == 0 && (uint64_t) size != old_size) {
+		file_ino->size = size;
+		clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
+	}
+	return err;
 }
 
 /**
- * Change the size of a file.
+ * Change the attributes of a file or directory.
  *
- * Implements the truncate() system call. Supports both extending and shrinking.
- * If the file is extended, the new uninitialized range at the end must be
- * filled with zeros.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
+ * Implements the truncate() and utimensat() system calls, which set the size
+ * and the modification time. See "man 2 utimensat" for details. The access
+ * time is not recorded, so setting it does nothing.
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
+ *   ENOSYS  the mode or owner is to be changed.
  *
- * @param path  path to the file to set the size.
- * @param size  new file size in bytes.
- * @return      0 on success; -errno on error.
+ * @param req     request handle.
+ * @param ino     inode number of the file or directory.
+ * @param attr    the new attributes.
+ * @param to_set  FUSE_SET_ATTR_* flags of the attributes to change.
+ * @param fi      unused.
  */
-static int a1fs_truncate(const char *path, off_t size)
+static void a1fs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                         int to_set, struct fuse_file_info *fi)
 {
-	fs_ctx *fs = get_fs();
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	a1fs_inode *inode = get_inode_by_inumber(fs->image, inum);
 
-	assert(size >= 0);
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	nlookup *n = nlookup_lock(&fs->nl, inum, true);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE) {
+		int err = truncate_file(fs, inum, attr->st_size);
+		if (err != 0) {
+			nlookup_unlock(&fs->nl, n);
+			fuse_reply_err(req, -err);
+			return;
+		}
+	}
+	// set to current time if new timestemp is not specified
+	if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+		clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+	} else if (to_set & FUSE_SET_ATTR_MTIME) {
+		memcpy(&inode->mtime, &attr->st_mtim, sizeof(struct timespec));
+	}
 
-	// find inode of file
-	a1fs_ino_t file_inum = path_lookup(path, fs);
-	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
+	struct stat st;
+	fill_stat(fs, inum, n, &st);
+	nlookup_unlock(&fs->nl, n);
+	fuse_reply_attr(req, &st, A1FS_TIMEOUT);
+}
 
-	// set new file size, possibly "zeroing out" the uninitialized range
-	int size_delta = file_ino->size - size;
-	if (size_delta == 0) return 0;
-	int err;
-	a1fs_extent *last_ext = find_last_used_ext(fs->image, file_ino);
-    // this file is newly created if there is no used extent, and we have to create a new
-	if (!last_ext) {
-		last_ext = (a1fs_extent *)jump_to(fs->image, file_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-		a1fs_blk_t new_blk = find_first_free_blk_num(fs->image, LOOKUP_DB);
-		if (new_blk == (a1fs_blk_t) -1) return -ENOSPC;
-		last_ext->start = new_blk;
-		last_ext->count = 1;
-		mask(fs->image, new_blk, LOOKUP_DB, true);
-		file_ino->i_extents++;
-		if (size <= A1FS_BLOCK_SIZE) {
-			err = 0;
-		}
-	} else {
-		if (size_delta > 0) {
-			err = shrink_by_amount(fs->image, file_ino, size_delta);
+
+/** Zeros that read replies point to for holes. */
+static const char zeros[128 << 10];
+
+/** Segments of a read reply. */
+typedef struct read_reply {
+	struct fuse_bufvec *bv;
+	/** Number of segments bv has room for. */
+	size_t cap;
+} read_reply;
+
+/** Add a segment of len bytes at data, or of zeros if data is NULL, to the
+ * reply. Return 0 on success, -ENOMEM if out of memory. */
+static int add_segment(void *arg, const void *data, size_t len)
+{
+	read_reply *r = (read_reply *)arg;
+	while (len > 0) {
+		size_t n = data != NULL || len < sizeof(zeros) ? len : sizeof(zeros);
+		struct fuse_bufvec *bv = r->bv;
+		struct fuse_buf *last = bv->count > 0 ? &bv->buf[bv->count - 1] : NULL;
+		// runs next to each other in the image make one segment
+		if (data != NULL && last != NULL && (const char *)last->mem + last->size == data) {
+			last->size += n;
 		} else {
-			err = extend_by_amount(fs, file_ino, -size_delta);
+			if (bv->count == r->cap) {
+				bv = realloc(bv, sizeof(*bv) + (r->cap * 2 - 1) * sizeof(bv->buf[0]));
+				if (bv == NULL) return -ENOMEM;
+				r->bv = bv;
+				r->cap *= 2;
+			}
+			bv->buf[bv->count++] = (struct fuse_buf){
+				.size = n, .mem = (void *)(data != NULL ? data : zeros), .fd = -1 };
 		}
+		len -= n;
+		if (data != NULL) data = (const char *)data + n;
 	}
-	if (err == 0) {
-		file_ino->size = size;
-		clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
-	}
-	return err;
+	return 0;
 }
 
-
 /**
  * Read data from a file.
  *
  * Implements the pread() system call. Must return exactly the number of bytes
  * requested except on EOF (end of file). Reads from file ranges that have not
- * been written to must return ranges filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
+ * been written to must return ranges filled with zeros. The range may span
+ * many blocks and extents.
  *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
+ * Nothing is copied here: the reply is a list of segments pointing at the
+ * extents in the image, at the data still buffered and at zeros for holes,
+ * which FUSE hands to the kernel directly, spliced if it can.
  *
- * Errors: none
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *
- * @param path    path to the file to read from.
- * @param buf     pointer to the buffer that receives the data.
- * @param size    buffer size (number of bytes requested).
+ * @param req     request handle.
+ * @param ino     inode number of the file to read from.
+ * @param size    number of bytes requested.
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
- * @return        number of bytes read on success; 0 if offset is beyond EOF;
- *                -errno on error.
+ * @param fi      handle of the open file.
  */
-static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi)
+static void a1fs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
 {
-	(void)fi;	// unused
-	fs_ctx *fs = get_fs();
-
-	// find inode of file
-	a1fs_ino_t file_inum = path_lookup(path, fs);
+	fs_ctx *fs = get_fs(req);
+	a1fs_file *file = get_file(fi);
+	a1fs_ino_t file_inum = to_inum(ino);
 	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
-	
-	// beyond EOF
-	if (offset >= (off_t) file_ino->size) return 0;
 
-	// get the block to read from
-	a1fs_blk_t blk_offset = offset / A1FS_BLOCK_SIZE;
-	a1fs_blk_t byte_start = offset % A1FS_BLOCK_SIZE;
+	read_reply r = { malloc(sizeof(struct fuse_bufvec) + 7 * sizeof(struct fuse_buf)), 8 };
+	nlookup *n = NULL;
+	if (r.bv != NULL && file != NULL) {
+		n = file->n;
+		nlookup_lock_pinned(n, false);
+	} else if (r.bv != NULL) {
+		n = nlookup_lock(&fs->nl, file_inum, false);
+	}
+	if (n == NULL) {
+		free(r.bv);
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	r.bv->count = r.bv->idx = r.bv->off = 0;
+	// reads through the same handle may run at the same time, so each uses
+	// a copy of its cursor; one that finds it in use starts afresh rather
+	// than wait
+	ext_cursor cur = { .valid = false };
+	bool has_cur = file != NULL && pthread_mutex_trylock(&file->lock) == 0;
+	if (has_cur) {
+		cur = file->cur;
+		pthread_mutex_unlock(&file->lock);
+	}
 
-	// find the block to read froms
-	a1fs_blk_t blk_start = find_blk_given_offset(fs->image, file_ino, blk_offset);
-	if (blk_start == (a1fs_blk_t) -1) return 0;
-	unsigned char *blk_to_read = (unsigned char *)jump_to(fs->image, blk_start, A1FS_BLOCK_SIZE);
-	// locate the starting byte
-	blk_to_read += byte_start;
-	memset(buf, 0, size);
-	memcpy(buf, blk_to_read, size);
-	return size;
+	// beyond EOF
+	int err = 0;
+	da_buf *b = find_buf(fs, file_inum, n);
+	uint64_t file_size = b != NULL ? b->size : file_ino->size;
+	if (offset >= (off_t) file_size) goto reply;
+	if (size > file_size - offset) size = file_size - offset;
+
+	// the part of the range that is on disk
+	size_t n_disk = 0;
+	if (offset < (off_t) file_ino->size) {
+		n_disk = file_ino->size - offset < size ? file_ino->size - offset : size;
+		err = walk_file_blks(fs, file_ino, offset, n_disk, &cur, add_segment, &r);
+	}
+	// the rest is still buffered
+	if (err == 0 && n_disk < size) {
+		size_t n_buf = size - n_disk;
+		const char *data = delalloc_data(fs, file_inum, offset + n_disk, &n_buf);
+		assert(data != NULL && n_buf == size - n_disk);
+		err = add_segment(&r, data, n_buf);
+	}
+	if (has_cur && pthread_mutex_trylock(&file->lock) == 0) {
+		file->cur = cur;
+		pthread_mutex_unlock(&file->lock);
+	}
+
+reply:
+	// the data stays in place while the inode is locked
+	if (err != 0) {
+		fuse_reply_err(req, -err);
+	} else if (r.bv->count == 0) {
+		fuse_reply_buf(req, NULL, 0);
+	} else {
+		fuse_reply_data(req, r.bv, (enum fuse_buf_copy_flags) 0);
+	}
+	if (file != NULL) {
+		nlookup_unlock_pinned(n);
+	} else {
+		nlookup_unlock(&fs->nl, n);
+	}
+	free(r.bv);
 }
 
 /**
@@ -646,71 +1047,327 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * Implements the pwrite() system call. Must return exactly the number of bytes
  * requested except on error. If the offset is beyond EOF (end of file), the
  * file must be extended. If the write creates a "hole" of uninitialized data,
- * the new uninitialized range must filled with zeros. You can assume that the
- * byte range from offset to offset + size is contained within a single block.
- *
- * Assumptions (already verified by FUSE using getattr() calls):
- *   "path" exists and is a file.
+ * the new uninitialized range must filled with zeros. The range may span many
+ * blocks and extents; each extent is copied with a single memcpy().
  *
  * Errors:
  *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *
- * @param path    path to the file to write to.
+ * @param fs         file system context; fs->alloc_lock must not be held,
+ *                   it is taken only around allocations, and a write to
+ *                   blocks the file already has runs without it.
+ * @param file_inum  inode number of the file to write to, locked for
+ *                   writing.
+ * @param buf        pointer to the buffer containing the data.
+ * @param size       buffer size (number of bytes requested).
+ * @param offset     offset from the beginning of the file to write to.
+ * @param file       handle of the open file, if any.
+ * @return           0 on success; -errno on error.
+ */
+static int write_file(fs_ctx *fs, a1fs_ino_t file_inum, const char *buf, size_t size,
+                      off_t offset, a1fs_file *file)
+{
+	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
+
+	// small files keep their data in the inode until it outgrows it
+	if (is_inline(file_ino) && offset + size > inline_capacity(fs->image)) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		int err = uninline_file(fs, file_ino);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (err != 0) return err;
+	}
+
+	// a write that leaves whole blocks between it and the end of the file
+	// leaves them as a hole instead of buffering zeros for them
+	uint64_t file_end = delalloc_size(fs, file_inum, file_ino);
+	if (!is_inline(file_ino) && (uint64_t) offset / A1FS_BLOCK_SIZE > CEIL_DIV(file_end, A1FS_BLOCK_SIZE)) {
+		pthread_mutex_lock(&fs->alloc_lock);
+		int err = delalloc_flush(fs, file_inum);
+		if (err == 0) err = extend_by_amount(fs, file_ino, offset - file_ino->size);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (err != 0) return err;
+		file_ino->size = offset;
+	}
+
+	// the part of the range inside the file is written in place, holes
+	// getting blocks, and so are blocks preallocated past the end of the
+	// file unless there is buffered data in between; a file that ends in a
+	// hole has no blocks up to its end
+	uint64_t alloc_end = file_ino->size;
+	if (is_inline(file_ino)) {
+		alloc_end = inline_capacity(fs->image);
+	} else if (offset + size > file_ino->size && delalloc_find(fs, file_inum) == NULL) {
+		uint64_t blks_end = (uint64_t) count_file_blks(fs->image, file_ino) * A1FS_BLOCK_SIZE;
+		if (blks_end > alloc_end) alloc_end = blks_end;
+	}
+	size_t n = 0;
+	if ((uint64_t) offset < alloc_end) {
+		n = alloc_end - offset < size ? alloc_end - offset : size;
+		ext_cursor *cur = file != NULL ? &file->cur : NULL;
+		// holes and unwritten extents get their blocks first, so that the
+		// data is copied without fs->alloc_lock
+		if (!file_range_written(fs, file_ino, offset, n, cur)) {
+			pthread_mutex_lock(&fs->alloc_lock);
+			int err = write_file_blks(fs, file_ino, offset, NULL, n, cur);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			if (err != 0) return err;
+		}
+		write_file_blks(fs, file_ino, offset, buf, n, cur);
+		if (offset + n > file_ino->size) file_ino->size = offset + n;
+	}
+	// data past the end of the file is buffered until it is flushed
+	if (n < size) {
+		int err = delalloc_write(fs, file_inum, file_ino, buf + n, size - n, offset + n);
+		if (err != 0) return err;
+	}
+	clock_gettime(CLOCK_REALTIME, &(file_ino->mtime));
+	return 0;
+}
+
+/**
+ * Write data to a file; see write_file().
+ *
+ * @param req     request handle.
+ * @param ino     inode number of the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
- * @return        number of bytes written on success; -errno on error.
+ * @param fi      handle of the open file.
  */
-static int a1fs_write(const char *path, const char *buf, size_t size,
-                      off_t offset, struct fuse_file_info *fi)
+static void a1fs_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	a1fs_file *file = get_file(fi);
+	nlookup *n = file != NULL ? file->n : nlookup_pin(&fs->nl, inum);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	nlookup_lock_pinned(n, true);
+	int err = write_file(fs, inum, buf, size, offset, file);
+	// only writes make buffers, so readers look for one only after this
+	__atomic_store_n(&n->buffered, delalloc_find(fs, inum) != NULL, __ATOMIC_RELAXED);
+	nlookup_unlock_pinned(n);
+	if (file == NULL) nlookup_unpin(&fs->nl, n);
+	if (err != 0) {
+		fuse_reply_err(req, -err);
+		return;
+	}
+	fuse_reply_write(req, size);
+}
 
-	// find inode of file
-	a1fs_ino_t file_inum = path_lookup(path, fs);
+/** Preallocate or punch out bytes [offset, end) of the file for
+ * fallocate_file(). The inode must be locked for writing and fs->alloc_lock
+ * held. Return 0 on success, -errno on error. */
+static int change_file_space(fs_ctx *fs, a1fs_ino_t file_inum, int mode, uint64_t offset, uint64_t end)
+{
 	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, file_inum);
 
-	// compute the size to extend
-	size_t size_exted = offset + size;
+	// the extents must cover all the data of the file
+	int err = delalloc_flush(fs, file_inum);
+	if (err != 0) return err;
 
-	int err;
-	// extend this file if needed
-	if (size_exted > file_ino->size) {
-		err = a1fs_truncate(path, size_exted);
-		if (err != 0) {
-			return err;
-		}
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		punch_hole(fs, file_ino, offset, end - offset);
+		return 0;
+	}
+	// preallocated space is made of blocks
+	err = uninline_file(fs, file_ino);
+	if (err != 0) return err;
+	a1fs_blk_t first = offset / A1FS_BLOCK_SIZE;
+	err = alloc_file_range(fs, file_ino, first, CEIL_DIV(end, A1FS_BLOCK_SIZE) - first, true);
+	if (err != 0) return err;
+	// the new blocks are already there, only the tail of the old last
+	// block needs to be zeroed
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > file_ino->size) {
+		err = extend_by_amount(fs, file_ino, end - file_ino->size);
+		if (err != 0) return err;
+		file_ino->size = end;
+	}
+	return 0;
+}
+
+/**
+ * Allocate or deallocate space for a file.
+ *
+ * Implements the fallocate() system call. Preallocated blocks are kept in
+ * unwritten extents: they read as zeros without being zeroed on disk, so
+ * preallocating any amount of space only changes the extent block and the
+ * bitmap. Punching a hole frees the whole blocks in the range, which then
+ * read as zeros like any other hole in the file.
+ *
+ * Errors:
+ *   EINVAL      invalid offset or length, or FALLOC_FL_PUNCH_HOLE without
+ *               FALLOC_FL_KEEP_SIZE.
+ *   EOPNOTSUPP  mode other than 0, FALLOC_FL_KEEP_SIZE and
+ *               FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE.
+ *   ENOSPC      not enough free space in the file system.
+ *
+ * @param fs         file system context; fs->alloc_lock must not be held.
+ * @param file_inum  inode number of the file, locked for writing.
+ * @param mode       FALLOC_FL_* flags.
+ * @param offset     start of the byte range.
+ * @param length     length of the byte range.
+ * @return           0 on success; -errno on error.
+ */
+static int fallocate_file(fs_ctx *fs, a1fs_ino_t file_inum, int mode, off_t offset, off_t length)
+{
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) return -EINVAL;
+	if (offset < 0 || length <= 0) return -EINVAL;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	int err = change_file_space(fs, file_inum, mode, offset, (uint64_t) offset + length);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if (err != 0) return err;
+	clock_gettime(CLOCK_REALTIME, &(get_inode_by_inumber(fs->image, file_inum)->mtime));
+	return 0;
+}
+
+/**
+ * Allocate or deallocate space for a file; see fallocate_file().
+ *
+ * @param req     request handle.
+ * @param ino     inode number of the file.
+ * @param mode    FALLOC_FL_* flags.
+ * @param offset  start of the byte range.
+ * @param length  length of the byte range.
+ * @param fi      unused.
+ */
+static void a1fs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                           off_t length, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fs_ctx *fs = get_fs(req);
+	a1fs_ino_t inum = to_inum(ino);
+	nlookup *n = nlookup_lock(&fs->nl, inum, true);
+	if (n == NULL) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int err = fallocate_file(fs, inum, mode, offset, length);
+	nlookup_unlock(&fs->nl, n);
+	fuse_reply_err(req, -err);
+}
+
+/** Allocate blocks for and write back the buffered data of the file. */
+static int flush_file(fs_ctx *fs, a1fs_ino_t inum)
+{
+	// the data written through the handle is buffered already, so a file
+	// without a buffer needs no locks
+	if (delalloc_find(fs, inum) == NULL) return 0;
+	nlookup *n = nlookup_lock(&fs->nl, inum, true);
+	if (n == NULL) return -ENOMEM;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int err = delalloc_flush(fs, inum);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	nlookup_unlock(&fs->nl, n);
+	return err;
+}
+
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. The inode is kept in a handle for the
+ * reads and writes through the file descriptor.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param req  request handle.
+ * @param ino  inode number of the file to open.
+ * @param fi   receives the handle of the open file in fh.
+ */
+static void a1fs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int err = open_file(get_fs(req), to_inum(ino), fi);
+	if (err != 0) {
+		fuse_reply_err(req, -err);
+		return;
 	}
+	fuse_reply_open(req, fi);
+}
 
-	// find the block number to write to
-	a1fs_blk_t blk_offset = offset / A1FS_BLOCK_SIZE;
-	a1fs_blk_t byte_start = offset % A1FS_BLOCK_SIZE;
-	a1fs_blk_t blk_start = find_blk_given_offset(fs->image, file_ino, blk_offset);
-	// locate the starting byte
-	unsigned char *blk_to_write = (unsigned char *)jump_to(fs->image, blk_start, A1FS_BLOCK_SIZE);
-	blk_to_write += byte_start;
-	// write
-	memcpy(blk_to_write, buf, size);
-	return size;
+/**
+ * Flush cached data of an open file.
+ *
+ * Called on each close() of a file descriptor. Writes back the data of the
+ * file that is waiting for delayed allocation.
+ *
+ * @param req  request handle.
+ * @param ino  inode number of the file.
+ * @param fi   handle of the open file.
+ */
+static void a1fs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void)fi;// unused
+	fuse_reply_err(req, -flush_file(get_fs(req), to_inum(ino)));
 }
 
+/**
+ * Synchronize file contents.
+ *
+ * Implements the fsync() system call. The image is a memory mapped file, so
+ * it is enough to write back the data waiting for delayed allocation.
+ *
+ * @param req       request handle.
+ * @param ino       inode number of the file.
+ * @param datasync  unused.
+ * @param fi        handle of the open file.
+ */
+static void a1fs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	(void)fi;// unused
+	fuse_reply_err(req, -flush_file(get_fs(req), to_inum(ino)));
+}
 
-static struct fuse_operations a1fs_ops = {
+/**
+ * Release an open file.
+ *
+ * Called when there are no more references to an open file. Writes back the
+ * data of the file that is waiting for delayed allocation and frees the
+ * handle of the file.
+ *
+ * @param req  request handle.
+ * @param ino  inode number of the file.
+ * @param fi   handle of the open file.
+ */
+static void a1fs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs(req);
+	int err = flush_file(fs, to_inum(ino));
+	a1fs_file *file = get_file(fi);
+	if (file != NULL) close_file(fs, file);
+	fi->fh = 0;
+	fuse_reply_err(req, -err);
+}
+
+
+static struct fuse_lowlevel_ops a1fs_ops = {
 	.destroy  = a1fs_destroy,
+	.lookup   = a1fs_lookup,
+	.forget   = a1fs_forget,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
+	.setattr  = a1fs_setattr,
+	.opendir  = a1fs_opendir,
 	.readdir  = a1fs_readdir,
+	.releasedir = a1fs_releasedir,
 	.mkdir    = a1fs_mkdir,
 	.rmdir    = a1fs_rmdir,
 	.create   = a1fs_create,
+	.open     = a1fs_open,
 	.unlink   = a1fs_unlink,
-	.utimens  = a1fs_utimens,
-	.truncate = a1fs_truncate,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.fallocate = a1fs_fallocate,
+	.flush    = a1fs_flush,
+	.fsync    = a1fs_fsync,
+	.release  = a1fs_release,
 };
 
 int main(int argc, char *argv[])
@@ -725,5 +1382,32 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
+	// what fuse_main() does for the high-level API: the help of the FUSE
+	// options is printed while parsing them and mounting
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	int err = 1;
+	if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) goto out;
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	if (ch == NULL) {
+		if (opts.help) err = 0;
+		goto out;
+	}
+	struct fuse_session *se = fuse_lowlevel_new(&args, &a1fs_ops, sizeof(a1fs_ops), &fs);
+	if (se != NULL) {
+		if (fuse_daemonize(foreground) != -1 && fuse_set_signal_handlers(se) != -1) {
+			fuse_session_add_chan(se, ch);
+			// requests are handled by several threads unless -s is given
+			err = (multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se)) == -1;
+			fuse_remove_signal_handlers(se);
+			fuse_session_remove_chan(ch);
+		}
+		// calls a1fs_destroy()
+		fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+out:
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err;
 }
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <stddef.h>
 #include <sys/stat.h>
 
 
@@ -56,11 +57,11 @@ typedef struct a1fs_superblock {
 	uint32_t s_num_blocks;
 	/** Number of inodes. */
 	uint32_t s_num_inodes;
-	/** Number of inode bitmaps. */
+	/** Number of inode bitmaps in each group. */
 	uint16_t s_num_inode_bitmaps;
-	/** Number of data bitmaps in contiguous blocks. */
+	/** Number of data bitmaps in each group (but the last one). */
 	uint16_t s_num_data_bitmaps;
-	/** Number of inode tables. */
+	/** Number of inode tables in each group. */
 	uint16_t s_num_inode_tables;
 	/** Block number of the first inode bitmap. */
 	a1fs_blk_t s_inode_bitmap;
@@ -76,23 +77,145 @@ typedef struct a1fs_superblock {
 	uint32_t s_num_free_inodes;
 	/** Number of free data blocks. */
 	uint32_t s_num_free_blocks;
+	/** Number of blocks in each group; the last group also holds the rest. */
+	uint32_t s_blocks_per_group;
+	/** Number of inodes in each group. */
+	uint32_t s_inodes_per_group;
+	/** Number of allocation groups. */
+	uint32_t s_num_groups;
+	/** Block number of the group descriptor table. */
+	a1fs_blk_t s_group_desc;
+	/** Number of group descriptor table blocks. */
+	uint32_t s_num_group_desc_blocks;
+	/** Data block right after the last allocated range (next-fit cursor). */
+	a1fs_blk_t s_next_block;
+	/** Inode right after the last allocated one (next-fit cursor). */
+	a1fs_ino_t s_next_inode;
+	/** Size of an on-disk inode in bytes; a power of 2 of at least
+	 * sizeof(a1fs_inode). The bytes past the struct hold inline data. */
+	uint32_t s_inode_size;
+	/** A1FS_FEATURE_* flags chosen by mkfs. */
+	uint32_t s_features;
 
 } a1fs_superblock;
 
+/** Feature flag: names are stored in a1fs_dirent records instead of
+ * fixed-size a1fs_dentry entries. */
+#define A1FS_FEATURE_DIRENT 0x1
+
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
 
+/** Default number of blocks in an allocation group (128 MiB). */
+#define A1FS_BLOCKS_PER_GROUP 32768
+
+/**
+ * Allocation group descriptor.
+ *
+ * The image is split into groups of s_blocks_per_group blocks. Each group
+ * starts with its own slice of the inode bitmap, the data bitmap and the
+ * inode table (in group 0 they follow the superblock and the descriptor
+ * table), followed by its data blocks. Bit b of the data bitmap still tracks
+ * block b, and inode i lives in group i / s_inodes_per_group.
+ */
+typedef struct a1fs_group_desc {
+	/** Block number of the group's first inode bitmap. */
+	a1fs_blk_t g_inode_bitmap;
+	/** Block number of the group's first data bitmap. */
+	a1fs_blk_t g_data_bitmap;
+	/** Block number of the group's first inode table. */
+	a1fs_blk_t g_inode_table;
+	/** Block number of the group's first data block. */
+	a1fs_blk_t g_first_block;
+	/** Number of free inodes in the group. */
+	uint32_t g_num_free_inodes;
+	/** Number of free data blocks in the group. */
+	uint32_t g_num_free_blocks;
+	/** Number of directories in the group. */
+	uint32_t g_num_dirs;
+
+	char extra[4];
+
+} a1fs_group_desc;
+
+// A single block must fit an integral number of group descriptors
+static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_group_desc) == 0,
+              "invalid group descriptor size");
+
+
+/**
+ * Flag in a1fs_extent.count marking preallocated blocks that have never been
+ * written. Such blocks read as zeros whatever they contain on disk.
+ */
+#define A1FS_EXTENT_UNWRITTEN 0x80000000u
+
 /** Extent - a contiguous range of blocks. */
 typedef struct a1fs_extent {
+	/** Block offset within the file of the first block of the extent. */
+	a1fs_blk_t logical;
 	/** Starting block of the extent. */
 	a1fs_blk_t start;
-	/** Number of blocks in the extent. */
+	/** Number of blocks in the extent, possibly | A1FS_EXTENT_UNWRITTEN. */
 	a1fs_blk_t count;
 
 } a1fs_extent;
 
+/**
+ * Extent tree index entry - points to the extent tree block holding the
+ * extents from logical onwards.
+ */
+typedef struct a1fs_extent_idx {
+	/** Lowest block offset within the file covered by the child. */
+	a1fs_blk_t logical;
+	/** Block number of the child. */
+	a1fs_blk_t child;
+
+	char extra[4];
+
+} a1fs_extent_idx;
+
+// Index entries and extents are moved around the same way
+static_assert(sizeof(a1fs_extent_idx) == sizeof(a1fs_extent), "invalid extent index size");
+
+/**
+ * Header at the start of every block of an extent tree. A block of depth 0 is
+ * a leaf, followed by extents; any other block is followed by index entries
+ * pointing to blocks of depth one less. Entries are sorted by logical offset.
+ */
+typedef struct a1fs_extent_header {
+	/** Number of entries used in the block. */
+	uint32_t h_entries;
+	/** Height of the block above the leaves. */
+	uint32_t h_depth;
+
+	char extra[4];
+
+} a1fs_extent_header;
+
+/** Number of extents or index entries in an extent tree block. */
+#define A1FS_EXTENTS_PER_BLOCK \
+	((A1FS_BLOCK_SIZE - sizeof(a1fs_extent_header)) / sizeof(a1fs_extent))
+
+
+/**
+ * Inode flag: the file has no blocks, its data is stored in the inode itself
+ * starting at i_extents. Files start out this way and move their data to a
+ * block once it outgrows the inode; directories do too when an inode is large
+ * enough for some dentries.
+ */
+#define A1FS_INODE_INLINE 0x1
+
+/**
+ * Inode flag: the directory has a hashed index of its entries, rooted at
+ * block offset A1FS_DIR_INDEX_BLK of the directory. Directories get one when
+ * they outgrow their first dentry block.
+ */
+#define A1FS_INODE_INDEXED 0x2
+
+/** Default size of an on-disk inode. */
+#define A1FS_INODE_SIZE 64
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -109,7 +232,10 @@ typedef struct a1fs_inode {
 	 */
 	uint32_t links;
 
-	/** File size in bytes. */
+	/**
+	 * File size in bytes. For a directory, the number of bytes its names
+	 * take in their entries.
+	 */
 	uint64_t size;
 
 	/**
@@ -123,21 +249,32 @@ typedef struct a1fs_inode {
 
 	//TODO: add necessary fields
 
+	/** A1FS_INODE_* flags. */
+	uint32_t i_flags;
+
+	// With A1FS_INODE_INLINE, the data of the file takes the place of the
+	// fields below and of the rest of the on-disk inode.
+
 	/** Total number of extents. */
 	uint32_t i_extents;
-	/** Block number of an array of extents. */
-	a1fs_blk_t i_ptr_extent;
+	/**
+	 * Root of the extent tree. Its entries follow it up to the end of the
+	 * on-disk inode, so a file gets tree blocks only once it has more
+	 * extents than that; the smallest inodes have room for one.
+	 */
+	a1fs_extent_header i_root;
 
 	//NOTE: You might have to add padding (e.g. a dummy char array field) at the
 	// end of the struct in order to satisfy the assertion below. Try to keep
 	// the size of this struct minimal, but don't worry about the "wasted space"
 	// introduced by the required padding.
-	char extra[24];
+	char extra[12];
 
 } a1fs_inode;
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+static_assert(sizeof(a1fs_inode) == A1FS_INODE_SIZE, "invalid inode size");
 
 
 /** Maximum file name (path component) length. Includes the null terminator. */
@@ -156,3 +293,65 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+/**
+ * Variable-length directory entry, used instead of a1fs_dentry on images with
+ * A1FS_FEATURE_DIRENT. The records of a dentry block (or of an inline
+ * directory) follow each other and cover all of it; a record may be longer
+ * than its name needs, and the rest of it is free space. An unused record has
+ * an inode number of -1 like an unused a1fs_dentry, which is at the same
+ * offset, so code that only looks at the inode number works with both.
+ */
+typedef struct a1fs_dirent {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Length of the record in bytes, a multiple of 4. */
+	uint16_t rec_len;
+	/** Length of the name, not counting the null terminator. */
+	uint8_t name_len;
+
+	char extra[1];
+
+	/** File name. A null-terminated string. */
+	char name[];
+
+} a1fs_dirent;
+
+static_assert(offsetof(a1fs_dirent, ino) == offsetof(a1fs_dentry, ino), "invalid dirent layout");
+
+
+/**
+ * Block offset within a directory of the root of its hashed index. Dentry
+ * blocks come before it and index blocks from it on, with a hole in between,
+ * so that iterating over the dentries stops at the index.
+ */
+#define A1FS_DIR_INDEX_BLK 0x80000000u
+
+/**
+ * Header at the start of every block of a directory index, a B+tree keyed by
+ * the hash of the names like the ext4 htree. A block of depth 0 points to
+ * dentry blocks and any other block to index blocks of depth one less. Each
+ * child holds the names with hashes from its key up to the next key; hashes
+ * have the low bit clear, and a key with it set means the names with that
+ * hash continue from the previous child.
+ */
+typedef struct a1fs_dx_header {
+	/** Number of entries used in the block. */
+	uint32_t dx_entries;
+	/** Height of the block above the dentry blocks. */
+	uint32_t dx_depth;
+
+} a1fs_dx_header;
+
+/** Directory index entry. */
+typedef struct a1fs_dx_entry {
+	/** Lowest hash held by the child; 0 for the first child of a block. */
+	uint32_t dx_hash;
+	/** Block number of the child. */
+	a1fs_blk_t dx_blk;
+
+} a1fs_dx_entry;
+
+/** Number of entries in a directory index block. */
+#define A1FS_DX_PER_BLOCK \
+	((A1FS_BLOCK_SIZE - sizeof(a1fs_dx_header)) / sizeof(a1fs_dx_entry))
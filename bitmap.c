@@ -0,0 +1,137 @@
+/**
+ * CSC369 Assignment 1 - Bitmap scanning helpers implementation.
+ */
+
+#include <endian.h>
+
+#include "bitmap.h"
+#include "util.h"
+
+/** Number of 64-bit words tracked by a single bitmap block. */
+#define WORDS_PER_BITMAP_BLK (BITS_PER_BITMAP_BLK / 64)
+
+/** Return the index of the first word in words[lo, hi) not equal to skip, or hi. */
+static uint32_t skip_words_generic(const uint64_t *words, uint32_t lo,
+                                   uint32_t hi, uint64_t skip)
+{
+	while (lo < hi && words[lo] == skip) lo++;
+	return lo;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(A1FS_NO_SIMD)
+#include <immintrin.h>
+
+/** Same as skip_words_generic(), comparing four words per iteration. */
+__attribute__((target("avx2")))
+static uint32_t skip_words_avx2(const uint64_t *words, uint32_t lo,
+                                uint32_t hi, uint64_t skip)
+{
+	const __m256i pattern = _mm256_set1_epi64x((long long)skip);
+	for (; lo + 4 <= hi; lo += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(words + lo));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, pattern)) != -1) break;
+	}
+	return skip_words_generic(words, lo, hi, skip);
+}
+
+static uint32_t skip_words(const uint64_t *words, uint32_t lo, uint32_t hi,
+                           uint64_t skip)
+{
+	if (__builtin_cpu_supports("avx2")) {
+		return skip_words_avx2(words, lo, hi, skip);
+	}
+	return skip_words_generic(words, lo, hi, skip);
+}
+#else
+#define skip_words skip_words_generic
+#endif
+
+/**
+ * Find the first bit in [lo, hi) of a single bitmap block whose value differs
+ * from the corresponding bit of flip (i.e. flip is all ones when searching for
+ * a zero bit and all zeros when searching for a one bit).
+ */
+static uint32_t find_in_bitmap_blk(const uint64_t *words, uint32_t lo,
+                                   uint32_t hi, uint64_t flip)
+{
+	uint32_t w = lo / 64;
+	uint32_t w_end = CEIL_DIV(hi, 64);
+	uint64_t word = (le64toh(words[w]) ^ flip) & (~(uint64_t)0 << (lo % 64));
+	while (word == 0) {
+		w = skip_words(words, w + 1, w_end, flip);
+		if (w >= w_end) return BITMAP_NONE;
+		word = le64toh(words[w]) ^ flip;
+	}
+	uint32_t bit = w * 64 + __builtin_ctzll(word);
+	return bit < hi ? bit : BITMAP_NONE;
+}
+
+uint32_t bitmap_find(void *image, uint32_t lookup, uint32_t from, uint32_t end,
+                     bool value)
+{
+	uint64_t flip = value ? 0 : ~(uint64_t)0;
+	while (from < end) {
+		uint32_t base, num_bits;
+		const uint64_t *words = (const uint64_t *)
+			get_bitmap_blk(image, lookup, from, &base, &num_bits);
+		uint32_t hi = end - base < num_bits ? end - base : num_bits;
+		uint32_t bit = find_in_bitmap_blk(words, from - base, hi, flip);
+		if (bit != BITMAP_NONE) return base + bit;
+		from = base + num_bits;
+	}
+	return BITMAP_NONE;
+}
+
+uint32_t bitmap_find_zero_run(void *image, uint32_t lookup, uint32_t n,
+                              uint32_t from, uint32_t end)
+{
+	while (from < end && end - from >= n) {
+		uint32_t start = bitmap_find_zero(image, lookup, from, end);
+		if (start == BITMAP_NONE || end - start < n) return BITMAP_NONE;
+		// the run is long enough if there is no used bit in the next n bits
+		uint32_t used = bitmap_find_one(image, lookup, start, start + n);
+		if (used == BITMAP_NONE) return start;
+		from = used + 1;
+	}
+	return BITMAP_NONE;
+}
+
+uint32_t bitmap_find_zero_chunk(void *image, uint32_t lookup, uint32_t n,
+                                uint32_t from, uint32_t end)
+{
+	uint64_t chunk = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+	uint32_t bit = CEIL_DIV(from, n) * n;
+	while (bit < end) {
+		uint32_t base, num_bits;
+		const uint64_t *words = (const uint64_t *)
+			get_bitmap_blk(image, lookup, bit, &base, &num_bits);
+		uint32_t hi = end - base < num_bits ? end : base + num_bits;
+		for (; bit + n <= hi; bit += n) {
+			uint64_t word = le64toh(words[(bit - base) / 64]);
+			if (((word >> ((bit - base) % 64)) & chunk) == 0) return bit;
+		}
+		bit = CEIL_DIV(base + num_bits, n) * n;
+	}
+	return BITMAP_NONE;
+}
+
+void bitmap_fill(unsigned char *bitmap, uint32_t lo, uint32_t hi, bool value)
+{
+	if (lo >= hi) return;
+	uint64_t *words = (uint64_t *)bitmap;
+	uint64_t fill = value ? ~(uint64_t)0 : 0;
+	uint32_t w = lo / 64;
+	uint32_t w_last = (hi - 1) / 64;
+	uint64_t head = ~(uint64_t)0 << (lo % 64);
+	uint64_t tail = ~(uint64_t)0 >> (63 - (hi - 1) % 64);
+	if (w == w_last) {
+		head &= tail;
+	}
+	// partial first and last words keep their other bits
+	uint64_t word = le64toh(words[w]);
+	words[w] = htole64(value ? word | head : word & ~head);
+	if (w == w_last) return;
+	for (w++; w < w_last; w++) words[w] = fill;
+	word = le64toh(words[w_last]);
+	words[w_last] = htole64(value ? word | tail : word & ~tail);
+}
@@ -0,0 +1,73 @@
+/**
+ * CSC369 Assignment 1 - Bitmap scanning helpers.
+ *
+ * The data and inode bitmaps are split across bitmap blocks; each block tracks
+ * up to A1FS_BLOCK_SIZE bits stored in its first A1FS_BLOCK_SIZE / 8 bytes, and
+ * every allocation group has its own run of bitmap blocks. The
+ * functions below search a whole bitmap a 64-bit word at a time (or 256 bits
+ * at a time on CPUs with AVX2) instead of testing every bit with is_used_bit(),
+ * and set or clear ranges of bits a word at a time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Returned by the search functions when no matching bit exists. */
+#define BITMAP_NONE ((uint32_t) -1)
+
+/** Number of bits tracked by a single bitmap block. */
+#define BITS_PER_BITMAP_BLK A1FS_BLOCK_SIZE
+
+/**
+ * Find the first bit in [from, end) of the bitmap selected by lookup
+ * (LOOKUP_DB or LOOKUP_IB) that is equal to value.
+ *
+ * @return  bit index, or BITMAP_NONE if there is none.
+ */
+uint32_t bitmap_find(void *image, uint32_t lookup, uint32_t from, uint32_t end,
+                     bool value);
+
+/** Find the first unused bit in [from, end). Return BITMAP_NONE if none. */
+static inline uint32_t bitmap_find_zero(void *image, uint32_t lookup,
+                                        uint32_t from, uint32_t end)
+{
+	return bitmap_find(image, lookup, from, end, false);
+}
+
+/** Find the first used bit in [from, end). Return BITMAP_NONE if none. */
+static inline uint32_t bitmap_find_one(void *image, uint32_t lookup,
+                                       uint32_t from, uint32_t end)
+{
+	return bitmap_find(image, lookup, from, end, true);
+}
+
+/**
+ * Find the first run of n consecutive unused bits that starts in [from, end)
+ * and ends at or before end.
+ *
+ * @return  first bit of the run, or BITMAP_NONE if there is none.
+ */
+uint32_t bitmap_find_zero_run(void *image, uint32_t lookup, uint32_t n,
+                              uint32_t from, uint32_t end);
+
+/**
+ * Find the first run of n unused bits that starts at a multiple of n and lies
+ * in [from, end), e.g. the inodes of a whole unused inode table block. n must
+ * be a power of 2 no larger than 64.
+ *
+ * @return  first bit of the run, or BITMAP_NONE if there is none.
+ */
+uint32_t bitmap_find_zero_chunk(void *image, uint32_t lookup, uint32_t n,
+                                uint32_t from, uint32_t end);
+
+/**
+ * Set bits [lo, hi) of a single bitmap block to value, filling whole 64-bit
+ * words at once. Does not touch the free counters.
+ *
+ * @param bitmap  start of the bitmap block (see get_bitmap_blk()).
+ */
+void bitmap_fill(unsigned char *bitmap, uint32_t lo, uint32_t hi, bool value);
@@ -0,0 +1,133 @@
+/**
+ * CSC369 Assignment 1 - In-memory summary levels over an on-disk bitmap
+ * implementation.
+ */
+
+#include <endian.h>
+#include <stdlib.h>
+
+#include "bitmap_summary.h"
+#include "util.h"
+
+
+/** 64 bits per level word, so 6 levels cover any 32-bit bitmap. */
+#define MAX_LEVELS 6
+
+struct bitmap_summary {
+	/** Pointer to the start of the image. */
+	void *image;
+	/** Which bitmap is summarized. */
+	uint32_t lookup;
+	/** Number of bits in the bitmap. */
+	uint32_t num_bits;
+	/** Number of summary levels; the last one is a single word. */
+	int num_levels;
+	/** Number of bits in each level. */
+	uint32_t level_bits[MAX_LEVELS];
+	/** Bits of each level, level 0 first. */
+	uint64_t *level[MAX_LEVELS];
+};
+
+
+/** Read word w of the bitmap, with bits past the end of the bitmap block
+ * holding it (or past the end of the bitmap) reported as used. */
+static uint64_t read_word(const bitmap_summary *bs, uint32_t w)
+{
+	uint32_t first_bit, num_bits;
+	const uint64_t *words = (const uint64_t *)
+		get_bitmap_blk(bs->image, bs->lookup, w * 64, &first_bit, &num_bits);
+	uint64_t word = le64toh(words[(w * 64 - first_bit) / 64]);
+	uint32_t valid = first_bit + num_bits - w * 64;
+	if (valid < 64) word |= ~(uint64_t)0 << valid;
+	return word;
+}
+
+/** Set bit i of the level to value. Return true if the word holding it
+ * changed between zero and non-zero. */
+static bool set_level_bit(bitmap_summary *bs, int level, uint32_t i, bool value)
+{
+	uint64_t *word = &bs->level[level][i / 64];
+	bool was_zero = *word == 0;
+	if (value) *word |= (uint64_t)1 << (i % 64);
+	else *word &= ~((uint64_t)1 << (i % 64));
+	return was_zero != (*word == 0);
+}
+
+bitmap_summary *bitmap_summary_create(void *image, uint32_t lookup, uint32_t num_bits)
+{
+	bitmap_summary *bs = calloc(1, sizeof(bitmap_summary));
+	if (bs == NULL) return NULL;
+	bs->image = image;
+	bs->lookup = lookup;
+	bs->num_bits = num_bits;
+
+	uint32_t bits = CEIL_DIV(num_bits, 64);
+	do {
+		bs->level_bits[bs->num_levels] = bits;
+		bs->level[bs->num_levels] = calloc(CEIL_DIV(bits, 64), sizeof(uint64_t));
+		if (bs->level[bs->num_levels] == NULL) {
+			bitmap_summary_destroy(bs);
+			return NULL;
+		}
+		bs->num_levels++;
+		bits = CEIL_DIV(bits, 64);
+	} while (bs->level_bits[bs->num_levels - 1] > 64);
+
+	for (uint32_t w = 0; w < bs->level_bits[0]; w++) {
+		if (read_word(bs, w) != ~(uint64_t)0) bs->level[0][w / 64] |= (uint64_t)1 << (w % 64);
+	}
+	for (int l = 1; l < bs->num_levels; l++) {
+		for (uint32_t i = 0; i < bs->level_bits[l]; i++) {
+			if (bs->level[l - 1][i] != 0) bs->level[l][i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	}
+	return bs;
+}
+
+void bitmap_summary_destroy(bitmap_summary *bs)
+{
+	if (bs == NULL) return;
+	for (int l = 0; l < bs->num_levels; l++) free(bs->level[l]);
+	free(bs);
+}
+
+void bitmap_summary_update(bitmap_summary *bs, uint32_t start, uint32_t end)
+{
+	if (start >= end) return;
+	for (uint32_t w = start / 64; w <= (end - 1) / 64; w++) {
+		// walk up only while a word changes between zero and non-zero
+		bool value = read_word(bs, w) != ~(uint64_t)0;
+		uint32_t i = w;
+		for (int l = 0; l < bs->num_levels && set_level_bit(bs, l, i, value); l++) {
+			value = bs->level[l][i / 64] != 0;
+			i /= 64;
+		}
+	}
+}
+
+/** Find the first set bit at or after i in the level, or BITMAP_NONE. */
+static uint32_t find_set(const bitmap_summary *bs, int level, uint32_t i)
+{
+	if (i >= bs->level_bits[level]) return BITMAP_NONE;
+	uint64_t word = bs->level[level][i / 64] & (~(uint64_t)0 << (i % 64));
+	if (word != 0) return (i / 64) * 64 + __builtin_ctzll(word);
+	if (level + 1 == bs->num_levels) return BITMAP_NONE;
+	// the level above tells which of the following words is not zero
+	uint32_t next = find_set(bs, level + 1, i / 64 + 1);
+	if (next == BITMAP_NONE) return BITMAP_NONE;
+	return next * 64 + __builtin_ctzll(bs->level[level][next]);
+}
+
+uint32_t bitmap_summary_find_zero(const bitmap_summary *bs, uint32_t from)
+{
+	if (from >= bs->num_bits) return BITMAP_NONE;
+	// the word of from may only have unused bits before it
+	uint32_t w = from / 64;
+	uint64_t free_bits = ~read_word(bs, w) & (~(uint64_t)0 << (from % 64));
+	if (free_bits == 0) {
+		w = find_set(bs, 0, w + 1);
+		if (w == BITMAP_NONE) return BITMAP_NONE;
+		free_bits = ~read_word(bs, w);
+	}
+	return w * 64 + __builtin_ctzll(free_bits);
+}
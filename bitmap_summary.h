@@ -0,0 +1,39 @@
+/**
+ * CSC369 Assignment 1 - In-memory summary levels over an on-disk bitmap.
+ *
+ * Level 0 has one bit per 64-bit word of the bitmap, set if the word has an
+ * unused bit. Every level above has one bit per 64-bit word of the level
+ * below, set if that word is not zero, up to a top level of a single word.
+ * Finding an unused bit then reads one word per level instead of scanning the
+ * bitmap, i.e. O(log n) words. The summary is built from the bitmap at mount
+ * time and must be told about every change made to the bitmap.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "bitmap.h"
+
+
+/** Summary of the unused bits of a bitmap. */
+typedef struct bitmap_summary bitmap_summary;
+
+/**
+ * Build the summary of the bitmap selected by lookup (LOOKUP_DB or LOOKUP_IB).
+ *
+ * @param image     pointer to the start of the image.
+ * @param lookup    which bitmap to summarize.
+ * @param num_bits  number of bits in the bitmap.
+ * @return          pointer to the summary; NULL if out of memory.
+ */
+bitmap_summary *bitmap_summary_create(void *image, uint32_t lookup, uint32_t num_bits);
+
+/** Destroy the summary and free all its memory. */
+void bitmap_summary_destroy(bitmap_summary *bs);
+
+/** Re-read the bitmap words holding bits [start, end) after they changed. */
+void bitmap_summary_update(bitmap_summary *bs, uint32_t start, uint32_t end);
+
+/** Return the first unused bit at or after from, or BITMAP_NONE if none. */
+uint32_t bitmap_summary_find_zero(const bitmap_summary *bs, uint32_t from);
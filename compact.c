@@ -0,0 +1,91 @@
+/**
+ * CSC369 Assignment 1 - a1fs directory compaction tool.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "dir_compact.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "util.h"
+
+
+static const char *help_str = "\
+Usage: %s options image\n\
+\n\
+Compact the directories of an a1fs image that is not mounted: pack the\n\
+names of each directory into as few blocks as they need and free the rest.\n\
+Mounted file systems compact directories left mostly empty on their own;\n\
+this also recomputes the sizes of directories made by older versions.\n\
+\n\
+Options:\n\
+    -v      print each directory that is compacted\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+
+int main(int argc, char *argv[])
+{
+	bool verbose = false;
+	char o;
+	while ((o = getopt(argc, argv, "vh")) != -1) {
+		switch (o) {
+			case 'v': verbose = true; break;
+			case 'h': print_help(stdout, argv[0]); return 0;
+			default : print_help(stderr, argv[0]); return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Missing image path\n");
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+
+	size_t size;
+	void *image = map_file(argv[optind], A1FS_BLOCK_SIZE, &size);
+	if (image == NULL) return 1;
+	int ret = 1;
+	if (get_superblock(image)->magic != A1FS_MAGIC) {
+		fprintf(stderr, "Image does not contain a1fs\n");
+		goto end;
+	}
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		goto end;
+	}
+
+	uint32_t num_dirs = 0, num_compacted = 0;
+	a1fs_blk_t total_freed = 0;
+	for (a1fs_ino_t inum = 0; inum < fs.s->s_num_inodes; inum++) {
+		if (!is_used_bit(image, inum, LOOKUP_IB)) continue;
+		if (!S_ISDIR(get_inode_by_inumber(image, inum)->mode)) continue;
+		num_dirs++;
+		a1fs_blk_t freed;
+		if (dir_compact(&fs, inum, &freed) != 0) {
+			fprintf(stderr, "Out of memory compacting directory %u\n", inum);
+			break;
+		}
+		if (freed == 0) continue;
+		num_compacted++;
+		total_freed += freed;
+		if (verbose) printf("directory %u: %u blocks freed\n", inum, freed);
+	}
+	printf("%u of %u directories compacted, %u blocks freed\n", num_compacted, num_dirs, total_freed);
+	fs_ctx_destroy(&fs);
+	ret = 0;
+end:
+	munmap(image, size);
+	return ret;
+}
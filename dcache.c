@@ -0,0 +1,167 @@
+/**
+ * CSC369 Assignment 1 - Cache of directory lookups implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+
+static uint32_t hash_of(a1fs_ino_t parent, const char *name)
+{
+	// FNV-1a over the parent's inode number and the name
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < 4; i++, parent >>= 8) {
+		hash ^= parent & 0xff;
+		hash *= 16777619u;
+	}
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/** Get the shard of the entries with the hash. */
+static dc_shard *shard_of(dcache *dc, uint32_t hash)
+{
+	return &dc->shards[hash & (DCACHE_SHARDS - 1)];
+}
+
+static void lru_unlink(dc_shard *sh, dc_entry *e)
+{
+	if (e->prev_lru != NULL) e->prev_lru->next_lru = e->next_lru;
+	else sh->head = e->next_lru;
+	if (e->next_lru != NULL) e->next_lru->prev_lru = e->prev_lru;
+	else sh->tail = e->prev_lru;
+}
+
+static void lru_push(dc_shard *sh, dc_entry *e)
+{
+	e->prev_lru = NULL;
+	e->next_lru = sh->head;
+	if (sh->head != NULL) sh->head->prev_lru = e;
+	else sh->tail = e;
+	sh->head = e;
+}
+
+/** Get the bucket of the entries with the hash in their shard. */
+static dc_entry **bucket_of(dc_shard *sh, uint32_t hash)
+{
+	return &sh->buckets[(hash / DCACHE_SHARDS) & (DCACHE_BUCKETS / DCACHE_SHARDS - 1)];
+}
+
+/** Find the link to the entry of the name in its bucket; the link holds NULL
+ * if there is none. */
+static dc_entry **find_link(dc_shard *sh, uint32_t hash, a1fs_ino_t parent, const char *name)
+{
+	dc_entry **link = bucket_of(sh, hash);
+	for (; *link != NULL; link = &(*link)->next) {
+		dc_entry *e = *link;
+		if (e->hash == hash && e->parent == parent && strcmp(e->name, name) == 0) break;
+	}
+	return link;
+}
+
+/** Unlink the entry from its bucket at link and from the LRU list, and free it. */
+static void remove_entry(dc_shard *sh, dc_entry **link)
+{
+	dc_entry *e = *link;
+	*link = e->next;
+	lru_unlink(sh, e);
+	sh->count--;
+	free(e);
+}
+
+void dcache_init(dcache *dc, size_t max)
+{
+	memset(dc, 0, sizeof(*dc));
+	dc->max = max;
+	for (size_t i = 0; i < DCACHE_SHARDS; i++) pthread_mutex_init(&dc->shards[i].lock, NULL);
+}
+
+bool dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino)
+{
+	uint32_t hash = hash_of(parent, name);
+	dc_shard *sh = shard_of(dc, hash);
+	pthread_mutex_lock(&sh->lock);
+	dc_entry *e = *find_link(sh, hash, parent, name);
+	if (e == NULL) {
+		sh->misses++;
+		pthread_mutex_unlock(&sh->lock);
+		return false;
+	}
+	sh->hits++;
+	lru_unlink(sh, e);
+	lru_push(sh, e);
+	*ino = e->ino;
+	pthread_mutex_unlock(&sh->lock);
+	return true;
+}
+
+/** dcache_insert() with the shard locked. */
+static void insert_locked(dcache *dc, dc_shard *sh, uint32_t hash, a1fs_ino_t parent,
+                          const char *name, a1fs_ino_t ino)
+{
+	dc_entry *e = *find_link(sh, hash, parent, name);
+	if (e != NULL) {
+		e->ino = ino;
+		lru_unlink(sh, e);
+		lru_push(sh, e);
+		return;
+	}
+	if (sh->count == (dc->max + DCACHE_SHARDS - 1) / DCACHE_SHARDS) {
+		dc_entry *old = sh->tail;
+		remove_entry(sh, find_link(sh, old->hash, old->parent, old->name));
+	}
+	size_t len = strlen(name);
+	e = malloc(sizeof(dc_entry) + len + 1);
+	if (e == NULL) return;
+	e->hash = hash;
+	e->parent = parent;
+	e->ino = ino;
+	memcpy(e->name, name, len + 1);
+	dc_entry **bucket = bucket_of(sh, hash);
+	e->next = *bucket;
+	*bucket = e;
+	lru_push(sh, e);
+	sh->count++;
+}
+
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino)
+{
+	if (dc->max == 0) return;
+	uint32_t hash = hash_of(parent, name);
+	dc_shard *sh = shard_of(dc, hash);
+	pthread_mutex_lock(&sh->lock);
+	insert_locked(dc, sh, hash, parent, name, ino);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void dcache_stats(dcache *dc, uint64_t *hits, uint64_t *misses)
+{
+	*hits = *misses = 0;
+	for (size_t i = 0; i < DCACHE_SHARDS; i++) {
+		dc_shard *sh = &dc->shards[i];
+		pthread_mutex_lock(&sh->lock);
+		*hits += sh->hits;
+		*misses += sh->misses;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+void dcache_destroy(dcache *dc)
+{
+	for (size_t i = 0; i < DCACHE_SHARDS; i++) {
+		dc_shard *sh = &dc->shards[i];
+		while (sh->head != NULL) {
+			dc_entry *e = sh->head;
+			sh->head = e->next_lru;
+			free(e);
+		}
+		memset(sh->buckets, 0, sizeof(sh->buckets));
+		sh->tail = NULL;
+		sh->count = 0;
+	}
+}
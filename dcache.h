@@ -0,0 +1,108 @@
+/**
+ * CSC369 Assignment 1 - Cache of directory lookups.
+ *
+ * The kernel looks up each component of a path in its parent directory, and
+ * looks names up again once its own cache of them expires. The cache maps a
+ * (parent inode, name) pair to the inode number of the name, or to -1 if the
+ * parent has no such name, so that the lookup before each create() and the
+ * lookups of the same names over and over do not search the directories
+ * again. The entries are split into shards by hash, each with its own lock
+ * and LRU list, so that lookups of different names rarely wait for each
+ * other. The least recently used entry of a shard is dropped once the shard
+ * holds its share of the maximum number of entries.
+ *
+ * The cache is kept exact rather than invalidated: whatever adds or removes a
+ * name must record the new inode number (or -1) with dcache_insert(). Moving
+ * entries inside a directory, as uninlining or indexing it does, changes
+ * nothing. The entries of a removed directory all say -1 by then, which is
+ * also right for an empty directory that is given its inode later.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of hash buckets; a power of 2. */
+#define DCACHE_BUCKETS 4096
+
+/** Number of shards, each with DCACHE_BUCKETS / DCACHE_SHARDS buckets; a
+ * power of 2. */
+#define DCACHE_SHARDS 16
+
+/** Default maximum number of entries. */
+#define DCACHE_DEFAULT_MAX 16384
+
+/** A cached lookup. */
+typedef struct dc_entry {
+	/** Hash of the parent and the name. */
+	uint32_t hash;
+	/** Inode number of the directory. */
+	a1fs_ino_t parent;
+	/** Inode number of the name in the directory, -1 if there is none. */
+	a1fs_ino_t ino;
+	/** Next entry in the same hash bucket. */
+	struct dc_entry *next;
+	/** Neighbours in the LRU list; prev is more recently used. */
+	struct dc_entry *prev_lru, *next_lru;
+	/** The name. */
+	char name[];
+
+} dc_entry;
+
+/** The entries of the cache with the same hash modulo DCACHE_SHARDS. */
+typedef struct dc_shard {
+	/** Entries hashed by parent and name. */
+	dc_entry *buckets[DCACHE_BUCKETS / DCACHE_SHARDS];
+	/** Most and least recently used entries. */
+	dc_entry *head, *tail;
+	/** Number of entries. */
+	size_t count;
+	/** Lookups answered by the shard. */
+	uint64_t hits;
+	/** Lookups that had to search the directory. */
+	uint64_t misses;
+	/** Protects all of the above, since a lookup moves its entry in the LRU
+	 * list. */
+	pthread_mutex_t lock;
+
+} dc_shard;
+
+/** The lookup cache of a mounted file system. */
+typedef struct dcache {
+	/** Entries split by hash. */
+	dc_shard shards[DCACHE_SHARDS];
+	/** Maximum number of entries, shared evenly by the shards and rounded
+	 * up to a multiple of DCACHE_SHARDS; 0 disables the cache. Set before
+	 * the cache is used. */
+	size_t max;
+
+} dcache;
+
+/** Make the cache empty, holding at most about max entries. */
+void dcache_init(dcache *dc, size_t max);
+
+/**
+ * Look up the name in the directory with inode number parent.
+ *
+ * @param ino  receives the inode number of the name, -1 if it is known not to
+ *             exist.
+ * @return     true if the cache has an entry for the name; false otherwise.
+ */
+bool dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino);
+
+/** Record that the name in the directory with inode number parent has inode
+ * number ino, -1 if there is no such name. Out of memory, nothing is cached. */
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino);
+
+/** Get the number of lookups answered by the cache and of those that had to
+ * search the directory. */
+void dcache_stats(dcache *dc, uint64_t *hits, uint64_t *misses);
+
+/** Free all entries. */
+void dcache_destroy(dcache *dc);
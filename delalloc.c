@@ -0,0 +1,226 @@
+/**
+ * CSC369 Assignment 1 - Delayed allocation of appended file data implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "delalloc.h"
+#include "fs_ctx.h"
+#include "util.h"
+
+
+/** Get the head of the hash bucket of the inode. */
+static da_buf **bucket_of(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return &fs->da.buckets[ino % DELALLOC_BUCKETS];
+}
+
+/** Unlink the buffer from the table and free it, releasing its reservation. */
+static void remove_buf(fs_ctx *fs, da_buf *b)
+{
+	pthread_rwlock_wrlock(&fs->da.lock);
+	da_buf **link = bucket_of(fs, b->ino);
+	while (*link != b) link = &(*link)->next;
+	*link = b->next;
+	pthread_rwlock_unlock(&fs->da.lock);
+	fs->da.reserved -= b->reserved;
+	fs->da.bytes -= b->size - b->start;
+	free(b->data);
+	free(b);
+}
+
+da_buf *delalloc_find(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_rdlock(&fs->da.lock);
+	da_buf *b = *bucket_of(fs, ino);
+	while (b != NULL && b->ino != ino) b = b->next;
+	pthread_rwlock_unlock(&fs->da.lock);
+	return b;
+}
+
+uint64_t delalloc_size(fs_ctx *fs, a1fs_ino_t ino, const a1fs_inode *inode)
+{
+	da_buf *b = delalloc_find(fs, ino);
+	return b ? b->size : inode->size;
+}
+
+static int flush_buf(fs_ctx *fs, da_buf *b);
+
+/** Flush the buffer of the inode, which the caller has locked, and those of
+ * the files no other thread is using. Return 0 or the first error. */
+static int flush_idle(fs_ctx *fs, a1fs_ino_t ino)
+{
+	int res = 0;
+	for (size_t i = 0; i < DELALLOC_BUCKETS; i++) {
+		da_buf *b = fs->da.buckets[i];
+		while (b != NULL) {
+			da_buf *next = b->next;
+			// waiting for the lock of another file could deadlock, since
+			// its holder may be waiting for fs->alloc_lock
+			nlookup *n = b->ino != ino ? nlookup_trylock(&fs->nl, b->ino) : NULL;
+			if (b->ino == ino || n != NULL) {
+				int err = flush_buf(fs, b);
+				if (err != 0 && res == 0) res = err;
+			}
+			if (n != NULL) nlookup_unlock(&fs->nl, n);
+			b = next;
+		}
+	}
+	return res;
+}
+
+int delalloc_write(fs_ctx *fs, a1fs_ino_t ino, const a1fs_inode *inode,
+                   const char *buf, size_t size, off_t offset)
+{
+	assert((uint64_t) offset >= inode->size);
+	if (size == 0) return 0;
+
+	da_buf *b = delalloc_find(fs, ino);
+	uint64_t start = b ? b->start : inode->size;
+	uint64_t old_size = b ? b->size : inode->size;
+	uint64_t end = offset + size;
+	uint64_t new_size = end > old_size ? end : old_size;
+
+	// reserve the blocks the data will need once it is flushed; the tail
+	// of the last on-disk block is already allocated unless it is a hole
+	a1fs_blk_t need = CEIL_DIV(new_size, A1FS_BLOCK_SIZE) - CEIL_DIV(start, A1FS_BLOCK_SIZE);
+	if (start % A1FS_BLOCK_SIZE != 0 && !is_inline(inode)
+	    && find_blk_given_offset(fs->image, (a1fs_inode *)inode, start / A1FS_BLOCK_SIZE) == (a1fs_blk_t) -1)
+		need++;
+
+	// the buffer belongs to the lock of the inode, so it grows before
+	// fs->alloc_lock is taken
+	unsigned char *data = b ? b->data : NULL;
+	size_t cap = b ? b->cap : 0;
+	size_t len = new_size - start;
+	if (len > cap) {
+		cap = cap ? cap : A1FS_BLOCK_SIZE;
+		while (cap < len) cap *= 2;
+		data = realloc(data, cap);
+		if (data == NULL) return -ENOMEM;
+		if (b != NULL) {
+			b->data = data;
+			b->cap = cap;
+		}
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	a1fs_blk_t reserved = b ? b->reserved : 0;
+	if (need > reserved && !has_n_free_blk(fs, need - reserved, LOOKUP_DB)) {
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if (b == NULL) free(data);
+		return -ENOSPC;
+	}
+	if (b == NULL) {
+		b = calloc(1, sizeof(da_buf));
+		if (b == NULL) {
+			pthread_mutex_unlock(&fs->alloc_lock);
+			free(data);
+			return -ENOMEM;
+		}
+		b->ino = ino;
+		b->start = b->size = inode->size;
+		b->data = data;
+		b->cap = cap;
+		// flush_idle() walks the buckets under fs->alloc_lock only
+		pthread_rwlock_wrlock(&fs->da.lock);
+		b->next = *bucket_of(fs, ino);
+		*bucket_of(fs, ino) = b;
+		pthread_rwlock_unlock(&fs->da.lock);
+	}
+	if (need > b->reserved) {
+		fs->da.reserved += need - b->reserved;
+		b->reserved = need;
+	}
+	fs->da.bytes += new_size - b->size;
+	b->size = new_size;
+	bool full = fs->da.bytes > DELALLOC_MAX_BYTES;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	// zero the hole between the old end of the file and the write
+	if ((uint64_t) offset > old_size) {
+		memset(b->data + (old_size - b->start), 0, offset - old_size);
+	}
+	memcpy(b->data + (offset - b->start), buf, size);
+
+	// under memory pressure, write everything back
+	if (!full) return 0;
+	pthread_mutex_lock(&fs->alloc_lock);
+	int err = flush_idle(fs, ino);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return err;
+}
+
+const char *delalloc_data(fs_ctx *fs, a1fs_ino_t ino, off_t offset, size_t *size)
+{
+	da_buf *b = delalloc_find(fs, ino);
+	if (b == NULL || (uint64_t) offset < b->start || (uint64_t) offset >= b->size) return NULL;
+	if (*size > b->size - offset) *size = b->size - offset;
+	return (const char *)b->data + (offset - b->start);
+}
+
+/** Allocate blocks for the buffer, write its data to them and free it. */
+static int flush_buf(fs_ctx *fs, da_buf *b)
+{
+	a1fs_inode *inode = get_inode_by_inumber(fs->image, b->ino);
+	assert(inode->size == b->start);
+
+	// hand the reserved blocks back so that the allocator can use them
+	a1fs_blk_t reserved = b->reserved;
+	fs->da.reserved -= reserved;
+	b->reserved = 0;
+
+	size_t len = b->size - b->start;
+	int err = extend_by_amount(fs, inode, len);
+	if (err != 0) {
+		fs->da.reserved += reserved;
+		b->reserved = reserved;
+		return err;
+	}
+	// the buffered data past the last block is written to a hole, which is
+	// allocated at once, so it can go into a single run of blocks; the
+	// blocks are kept if this fails, so a later flush does not allocate
+	// them again
+	err = write_file_blks(fs, inode, b->start, b->data, len, NULL);
+	if (err != 0) return err;
+	inode->size = b->size;
+	remove_buf(fs, b);
+	return 0;
+}
+
+int delalloc_flush(fs_ctx *fs, a1fs_ino_t ino)
+{
+	da_buf *b = delalloc_find(fs, ino);
+	return b ? flush_buf(fs, b) : 0;
+}
+
+int delalloc_flush_all(fs_ctx *fs)
+{
+	int res = 0;
+	for (size_t i = 0; i < DELALLOC_BUCKETS; i++) {
+		da_buf *b = fs->da.buckets[i];
+		while (b != NULL) {
+			da_buf *next = b->next;
+			int err = flush_buf(fs, b);
+			if (err != 0 && res == 0) res = err;
+			b = next;
+		}
+	}
+	return res;
+}
+
+void delalloc_drop(fs_ctx *fs, a1fs_ino_t ino)
+{
+	da_buf *b = delalloc_find(fs, ino);
+	if (b != NULL) remove_buf(fs, b);
+}
+
+void delalloc_destroy(fs_ctx *fs)
+{
+	for (size_t i = 0; i < DELALLOC_BUCKETS; i++) {
+		while (fs->da.buckets[i] != NULL) remove_buf(fs, fs->da.buckets[i]);
+	}
+	pthread_rwlock_destroy(&fs->da.lock);
+}
@@ -0,0 +1,113 @@
+/**
+ * CSC369 Assignment 1 - Delayed allocation of appended file data.
+ *
+ * Writes past the end of a file are not given blocks right away. The data and
+ * the new file size are kept in a per-inode buffer, and only enough free
+ * blocks are reserved to make sure the data will fit. The blocks are
+ * allocated (as one contiguous run if possible) and the data copied into them
+ * when the buffer is flushed: on flush(), fsync() and release(), before the
+ * file is truncated, and for all files not in use by another thread once the
+ * buffers hold more than DELALLOC_MAX_BYTES.
+ *
+ * The data of a buffer is protected by the lock of its inode, and everything
+ * that allocates blocks or changes the totals runs under fs->alloc_lock.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "a1fs.h"
+
+struct fs_ctx;
+
+
+/** Buffered bytes of all files above which every buffer is flushed. */
+#define DELALLOC_MAX_BYTES (64ul << 20)
+
+/** Number of hash buckets of the buffer table. */
+#define DELALLOC_BUCKETS 64
+
+/** Data written past the on-disk end of a file. */
+typedef struct da_buf {
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** On-disk file size; data[0] is the byte at this offset. */
+	uint64_t start;
+	/** File size including the buffered data. */
+	uint64_t size;
+	/** Buffered bytes [start, size) of the file. */
+	unsigned char *data;
+	/** Allocated size of data in bytes. */
+	size_t cap;
+	/** Number of blocks reserved for the buffered data. */
+	a1fs_blk_t reserved;
+	/** Next buffer in the same hash bucket. */
+	struct da_buf *next;
+
+} da_buf;
+
+/** Buffers of all files with delayed allocation. */
+typedef struct delalloc {
+	/** Buffers hashed by inode number. */
+	da_buf *buckets[DELALLOC_BUCKETS];
+	/** Total size of the buffered data in bytes. */
+	size_t bytes;
+	/** Total number of blocks reserved by the buffers. */
+	a1fs_blk_t reserved;
+	/** Held for reading to find a buffer and for writing to add or remove
+	 * one. The data of a buffer belongs to the lock of its inode, the totals
+	 * to fs->alloc_lock. */
+	pthread_rwlock_t lock;
+
+} delalloc;
+
+/** Find the buffer of the given inode. Return NULL if it has none. */
+da_buf *delalloc_find(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/** Return the size of the file including its buffered data. */
+uint64_t delalloc_size(struct fs_ctx *fs, a1fs_ino_t ino, const a1fs_inode *inode);
+
+/**
+ * Buffer size bytes of data written at offset, which must be at or past the
+ * on-disk end of the file (inode->size). Any gap is filled with zeros. The
+ * inode must be locked for writing and fs->alloc_lock not held; it is taken
+ * only to reserve the blocks and to flush buffers under memory pressure, and
+ * the data is copied without it.
+ *
+ * @return  0 on success; -ENOSPC if the blocks cannot be reserved; -ENOMEM if
+ *          the buffer cannot grow; other -errno if a flush fails.
+ */
+int delalloc_write(struct fs_ctx *fs, a1fs_ino_t ino, const a1fs_inode *inode,
+                   const char *buf, size_t size, off_t offset);
+
+/**
+ * Find the buffered data of the inode at offset. The data stays in place
+ * until the inode is written to or flushed.
+ *
+ * @param size  number of bytes wanted; receives the number buffered at
+ *              offset, no more than that.
+ * @return      pointer to the data; NULL if there is none at offset.
+ */
+const char *delalloc_data(struct fs_ctx *fs, a1fs_ino_t ino, off_t offset, size_t *size);
+
+/**
+ * Allocate blocks for the buffered data of the inode, write the data to them
+ * and update the file size. Nothing happens if the inode has no buffer.
+ *
+ * @return  0 on success; -errno on error (the buffer is then kept).
+ */
+int delalloc_flush(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/** Flush the buffers of all files, which no other thread may be using.
+ * Return 0 or the first error. */
+int delalloc_flush_all(struct fs_ctx *fs);
+
+/** Discard the buffer of the inode (e.g. because the file was removed). */
+void delalloc_drop(struct fs_ctx *fs, a1fs_ino_t ino);
+
+/** Discard all buffers without writing them. */
+void delalloc_destroy(struct fs_ctx *fs);
@@ -0,0 +1,116 @@
+/**
+ * CSC369 Assignment 1 - Entries of a directory in either format implementation.
+ */
+
+#include <string.h>
+
+#include "dentry.h"
+#include "util.h"
+
+
+/** Size of a record without its name. */
+#define DIRENT_HEADER offsetof(a1fs_dirent, name)
+
+/** Record lengths are multiples of this. */
+#define DIRENT_ALIGN 4
+
+/** Length of a record holding a name of name_len bytes. */
+static size_t dirent_len(size_t name_len)
+{
+	return (DIRENT_HEADER + name_len + 1 + DIRENT_ALIGN - 1) / DIRENT_ALIGN * DIRENT_ALIGN;
+}
+
+/** Write a record of rec_len bytes at p for the name, unused. */
+static a1fs_dirent *put_dirent(unsigned char *p, size_t rec_len, const char *name)
+{
+	a1fs_dirent *r = (a1fs_dirent *)p;
+	r->ino = (a1fs_ino_t) -1;
+	r->rec_len = rec_len;
+	size_t name_len = name != NULL ? strlen(name) : 0;
+	r->name_len = name_len < A1FS_NAME_MAX ? name_len : A1FS_NAME_MAX - 1;
+	if (name != NULL) memcpy(r->name, name, r->name_len);
+	r->name[r->name_len] = '\0';
+	return r;
+}
+
+bool has_dirent(void *image)
+{
+	return (get_superblock(image)->s_features & A1FS_FEATURE_DIRENT) != 0;
+}
+
+void dentries_init(void *image, void *buf, size_t size)
+{
+	if (has_dirent(image)) {
+		// a single free record
+		size_t len = size / DIRENT_ALIGN * DIRENT_ALIGN;
+		if (len >= DIRENT_HEADER + 1) put_dirent(buf, len, NULL);
+		return;
+	}
+	a1fs_dentry *d = (a1fs_dentry *)buf;
+	for (size_t i = 0; i < size / sizeof(a1fs_dentry); i++) d[i].ino = (a1fs_ino_t) -1;
+}
+
+a1fs_dentry *dentries_next(void *image, void *buf, size_t size, size_t *off)
+{
+	size_t len = has_dirent(image) ? 0 : sizeof(a1fs_dentry);
+	if (*off + (len != 0 ? len : DIRENT_HEADER + 1) > size) return NULL;
+	a1fs_dentry *d = (a1fs_dentry *)((unsigned char *)buf + *off);
+	if (len == 0) len = ((a1fs_dirent *)d)->rec_len;
+	*off += len;
+	return d;
+}
+
+a1fs_dentry *dentries_add(void *image, void *buf, size_t size, const char *name)
+{
+	if (!has_dirent(image)) {
+		size_t off = 0;
+		for (a1fs_dentry *d; (d = dentries_next(image, buf, size, &off)) != NULL;) {
+			if (d->ino != (a1fs_ino_t) -1) continue;
+			strncpy(d->name, name, A1FS_NAME_MAX - 1);
+			d->name[A1FS_NAME_MAX - 1] = '\0';
+			return d;
+		}
+		return NULL;
+	}
+
+	size_t need = dentry_size(image, name);
+	unsigned char *p = (unsigned char *)buf;
+	size_t off = 0;
+	for (a1fs_dirent *r; (r = (a1fs_dirent *)dentries_next(image, buf, size, &off)) != NULL;) {
+		unsigned char *start = (unsigned char *)r;
+		if (r->ino == (a1fs_ino_t) -1) {
+			// free records next to each other are merged here rather than
+			// when they are freed
+			while (off + DIRENT_HEADER + 1 <= size && ((a1fs_dirent *)(p + off))->ino == (a1fs_ino_t) -1) {
+				size_t next_len = ((a1fs_dirent *)(p + off))->rec_len;
+				r->rec_len += next_len;
+				off += next_len;
+			}
+			if (r->rec_len < need) continue;
+			// the rest of the record stays free
+			size_t rest = r->rec_len - need;
+			if (rest >= dirent_len(0)) put_dirent(start + need, rest, NULL);
+			return (a1fs_dentry *)put_dirent(start, rest >= dirent_len(0) ? need : r->rec_len, name);
+		}
+		// the free space at the end of a used record
+		size_t used = dirent_len(r->name_len);
+		if (r->rec_len - used >= need) {
+			size_t rest = r->rec_len - used;
+			r->rec_len = used;
+			return (a1fs_dentry *)put_dirent(start + used, rest, name);
+		}
+	}
+	return NULL;
+}
+
+size_t dentry_size(void *image, const char *name)
+{
+	if (!has_dirent(image)) return sizeof(a1fs_dentry);
+	size_t len = strlen(name);
+	return dirent_len(len < A1FS_NAME_MAX ? len : A1FS_NAME_MAX - 1);
+}
+
+char *dentry_name(void *image, a1fs_dentry *d)
+{
+	return has_dirent(image) ? ((a1fs_dirent *)d)->name : d->name;
+}
@@ -0,0 +1,46 @@
+/**
+ * CSC369 Assignment 1 - Entries of a directory in either format.
+ *
+ * The names of a directory are kept in dentry areas: its dentry blocks, or
+ * the inode of an inline directory. An area holds fixed-size a1fs_dentry
+ * entries, or a1fs_dirent records on images made with variable-length
+ * entries. These functions hide the difference: entries are handled through
+ * a1fs_dentry pointers, which point to records on such images, so only their
+ * inode number may be used directly and dentry_name() gives the name.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "a1fs.h"
+
+
+/** Check if the image stores names in a1fs_dirent records. */
+bool has_dirent(void *image);
+
+/** Make the dentry area of size bytes at buf empty. */
+void dentries_init(void *image, void *buf, size_t size);
+
+/**
+ * Return the entry at byte offset *off of the dentry area of size bytes at
+ * buf, used or not, and move *off to the next one.
+ *
+ * @return  the entry; NULL past the last one.
+ */
+a1fs_dentry *dentries_next(void *image, void *buf, size_t size, size_t *off);
+
+/**
+ * Add an entry for the name to the dentry area of size bytes at buf. The
+ * entry is left unused, with an inode number of -1, for the caller to set.
+ *
+ * @return  the entry; NULL if there is no room for the name.
+ */
+a1fs_dentry *dentries_add(void *image, void *buf, size_t size, const char *name);
+
+/** Return the number of bytes an entry for the name takes. */
+size_t dentry_size(void *image, const char *name);
+
+/** Return the name of the entry. */
+char *dentry_name(void *image, a1fs_dentry *d);
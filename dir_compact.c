@@ -0,0 +1,191 @@
+/**
+ * CSC369 Assignment 1 - Compaction of directories implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dentry.h"
+#include "dir_compact.h"
+#include "dir_index.h"
+#include "extent_tree.h"
+#include "util.h"
+
+
+/** The used entries of a directory, copied out of it: each is an inode number
+ * followed by the name with its null terminator. */
+typedef struct live_names {
+	char *buf;
+	size_t len, cap;
+	/** Number of bytes the names take in their entries. */
+	uint64_t bytes;
+
+} live_names;
+
+static bool push_name(void *image, live_names *n, a1fs_dentry *d)
+{
+	const char *name = dentry_name(image, d);
+	size_t len = sizeof(a1fs_ino_t) + strlen(name) + 1;
+	if (n->len + len > n->cap) {
+		size_t cap = n->cap > 0 ? n->cap * 2 : A1FS_BLOCK_SIZE;
+		while (cap < n->len + len) cap *= 2;
+		char *buf = realloc(n->buf, cap);
+		if (buf == NULL) return false;
+		n->buf = buf;
+		n->cap = cap;
+	}
+	memcpy(n->buf + n->len, &d->ino, sizeof(a1fs_ino_t));
+	strcpy(n->buf + n->len + sizeof(a1fs_ino_t), name);
+	n->len += len;
+	n->bytes += dentry_size(image, name);
+	return true;
+}
+
+/** Return the name at byte offset *off of the copies, storing its inode
+ * number in ino, and move *off to the next one; NULL past the last one. */
+static const char *next_name(const live_names *n, size_t *off, a1fs_ino_t *ino)
+{
+	if (*off >= n->len) return NULL;
+	memcpy(ino, n->buf + *off, sizeof(a1fs_ino_t));
+	const char *name = n->buf + *off + sizeof(a1fs_ino_t);
+	*off += sizeof(a1fs_ino_t) + strlen(name) + 1;
+	return name;
+}
+
+/** Return the number of dentry areas of size bytes that the names fill when
+ * added in order, at least one; -1 if a name does not fit in an area. */
+static a1fs_blk_t count_areas(void *image, const live_names *n, size_t size)
+{
+	unsigned char area[A1FS_BLOCK_SIZE];
+	dentries_init(image, area, size);
+	a1fs_blk_t count = 1;
+	size_t off = 0;
+	a1fs_ino_t ino;
+	for (const char *name; (name = next_name(n, &off, &ino)) != NULL;) {
+		a1fs_dentry *d = dentries_add(image, area, size, name);
+		if (d == NULL) {
+			count++;
+			dentries_init(image, area, size);
+			d = dentries_add(image, area, size, name);
+			if (d == NULL) return (a1fs_blk_t) -1;
+		}
+		d->ino = ino;
+	}
+	return count;
+}
+
+/** Return the number of dentry blocks of the directory. */
+static a1fs_blk_t count_dentry_blks(void *image, a1fs_inode *dir)
+{
+	a1fs_extent *ext = extent_tree_find(image, dir, A1FS_DIR_INDEX_BLK - 1);
+	return ext != NULL ? ext->logical + ext_len(ext) : 0;
+}
+
+bool dir_compact_needed(void *image, a1fs_inode *dir)
+{
+	if (is_inline(dir)) return false;
+	a1fs_blk_t num_blks = count_dentry_blks(image, dir);
+	return num_blks > 1 && dir->size * DIR_COMPACT_RATIO < (uint64_t) num_blks * A1FS_BLOCK_SIZE;
+}
+
+/** Move the names into the inode of the directory, freeing all of its blocks. */
+static void pack_inline(fs_ctx *fs, a1fs_inode *dir, const live_names *n)
+{
+	void *image = fs->image;
+	free_dentry_blks(fs, dir);
+	extent_tree_free(fs, dir);
+	dir->i_flags = (dir->i_flags & ~A1FS_INODE_INDEXED) | A1FS_INODE_INLINE;
+	dentries_init(image, inline_data(dir), inline_capacity(image));
+	size_t off = 0;
+	a1fs_ino_t ino;
+	for (const char *name; (name = next_name(n, &off, &ino)) != NULL;)
+		dentries_add(image, inline_data(dir), inline_capacity(image), name)->ino = ino;
+}
+
+/** Move the names into the first num_blks dentry blocks of the directory,
+ * freeing the blocks after them and those of its index. */
+static void pack_blks(fs_ctx *fs, a1fs_inode *dir, const live_names *n, a1fs_blk_t num_blks)
+{
+	void *image = fs->image;
+	a1fs_blk_t lblk = 0, blk_num = find_blk_given_offset(image, dir, 0);
+	init_directory_blk(image, blk_num);
+	void *blk = jump_to(image, blk_num, A1FS_BLOCK_SIZE);
+	size_t off = 0;
+	a1fs_ino_t ino;
+	for (const char *name; (name = next_name(n, &off, &ino)) != NULL;) {
+		a1fs_dentry *d = dentries_add(image, blk, A1FS_BLOCK_SIZE, name);
+		if (d == NULL) {
+			blk_num = find_blk_given_offset(image, dir, ++lblk);
+			init_directory_blk(image, blk_num);
+			blk = jump_to(image, blk_num, A1FS_BLOCK_SIZE);
+			d = dentries_add(image, blk, A1FS_BLOCK_SIZE, name);
+		}
+		d->ino = ino;
+	}
+	assert(lblk + 1 == num_blks);
+	a1fs_extent *last;
+	while ((last = find_last_used_ext(image, dir)) != NULL && last->logical + ext_len(last) > num_blks) {
+		a1fs_blk_t num = last->logical >= num_blks ? ext_len(last)
+		                 : last->logical + ext_len(last) - num_blks;
+		shrink_ext_by_num_blk(fs, dir, last, &num);
+	}
+	dir->i_flags &= ~A1FS_INODE_INDEXED;
+}
+
+int dir_compact(fs_ctx *fs, a1fs_ino_t dir_inum, a1fs_blk_t *freed)
+{
+	void *image = fs->image;
+	a1fs_inode *dir = get_inode_by_inumber(image, dir_inum);
+	uint32_t free_blks = fs->s->s_num_free_blocks;
+	if (freed != NULL) *freed = 0;
+
+	live_names n = { 0 };
+	dir_iter it;
+	dir_iter_init(&it, dir);
+	for (a1fs_dentry *d; (d = dir_iter_next(image, &it)) != NULL;) {
+		if (d->ino == (a1fs_ino_t) -1) continue;
+		if (!push_name(image, &n, d)) {
+			free(n.buf);
+			return -ENOMEM;
+		}
+	}
+	dir->size = n.bytes;
+	if (is_inline(dir)) {
+		free(n.buf);
+		return 0;
+	}
+
+	// the names go back into the inode if they fit; an indexed directory
+	// left with several blocks is indexed again, over more blocks than the
+	// names fill so that it has room to grow
+	a1fs_blk_t num_blks = count_dentry_blks(image, dir);
+	bool to_inline = inline_capacity(image) >= dentry_size(image, "") &&
+	                 count_areas(image, &n, inline_capacity(image)) == 1;
+	a1fs_blk_t packed = to_inline ? 0 : count_areas(image, &n, A1FS_BLOCK_SIZE);
+	bool reindex = is_indexed(dir) && packed > 1;
+	a1fs_blk_t target = reindex && dir_index_num_leaves(n.bytes) > packed ? dir_index_num_leaves(n.bytes) : packed;
+	if (target >= num_blks && !(is_indexed(dir) && packed <= 1)) {
+		free(n.buf);
+		return 0;
+	}
+	if (to_inline) {
+		pack_inline(fs, dir, &n);
+	} else {
+		pack_blks(fs, dir, &n, packed);
+		// without memory or space for the index, the directory is searched
+		// block by block until it grows again
+		if (reindex) dir_index_build(fs, dir);
+	}
+	free(n.buf);
+	dir_hint_set(&fs->dh, dir_inum, 0);
+	if (freed != NULL && fs->s->s_num_free_blocks > free_blks) *freed = fs->s->s_num_free_blocks - free_blks;
+	return 0;
+}
+
+void dir_compact_maybe(fs_ctx *fs, a1fs_ino_t dir_inum)
+{
+	if (dir_hint_is_open(&fs->dh, dir_inum)) return;
+	if (dir_compact_needed(fs->image, get_inode_by_inumber(fs->image, dir_inum)))
+		dir_compact(fs, dir_inum, NULL);
+}
@@ -0,0 +1,44 @@
+/**
+ * CSC369 Assignment 1 - Compaction of directories.
+ *
+ * Removing a name only frees its entry, so a directory that once held many
+ * names keeps all of its dentry blocks, and listing it still reads every one.
+ * The size of a directory is the number of bytes its names take in their
+ * entries, which tells how full its blocks are without reading them. Once
+ * the names fill less than 1/DIR_COMPACT_RATIO of the dentry blocks, the
+ * directory is compacted: its names are packed into as few blocks as they
+ * need, back into the inode if they fit there, the blocks past them are
+ * freed, and an indexed directory gets a new index over the blocks left.
+ *
+ * Lookups are not affected, since names keep their inode numbers. Compaction
+ * waits while the directory is open, though, since readdir() offsets of an
+ * unindexed directory are byte positions of its entries.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Directories whose names fill less than 1/DIR_COMPACT_RATIO of their dentry
+ * blocks are compacted. */
+#define DIR_COMPACT_RATIO 4
+
+/** Check if the names of the directory fill so little of its dentry blocks
+ * that it should be compacted. */
+bool dir_compact_needed(void *image, a1fs_inode *dir);
+
+/**
+ * Compact the directory if doing so frees blocks, and recompute its size.
+ *
+ * @param freed  receives the number of blocks freed; may be NULL.
+ * @return       0 on success; -ENOMEM if out of memory, in which case the
+ *               directory is left as it was.
+ */
+int dir_compact(fs_ctx *fs, a1fs_ino_t dir_inum, a1fs_blk_t *freed);
+
+/** Compact the directory if it needs it and is not open. */
+void dir_compact_maybe(fs_ctx *fs, a1fs_ino_t dir_inum);
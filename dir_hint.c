@@ -0,0 +1,114 @@
+/**
+ * CSC369 Assignment 1 - Hints to the free entries of unindexed directories
+ * implementation.
+ */
+
+#include <stdlib.h>
+
+#include "dir_hint.h"
+
+
+/** Find the link to the hint of the directory in its bucket; the link holds
+ * NULL if there is none. */
+static dir_hint **find_link(dir_hints *dh, a1fs_ino_t ino)
+{
+	dir_hint **link = &dh->buckets[ino % DIR_HINT_BUCKETS];
+	while (*link != NULL && (*link)->ino != ino) link = &(*link)->next;
+	return link;
+}
+
+/** Return the hint of the directory, adding an empty one if there is none;
+ * NULL if out of memory. */
+static dir_hint *get_hint(dir_hints *dh, a1fs_ino_t ino)
+{
+	dir_hint **link = find_link(dh, ino);
+	if (*link == NULL) {
+		dir_hint *h = malloc(sizeof(dir_hint));
+		if (h == NULL) return NULL;
+		h->ino = ino;
+		h->blk = 0;
+		h->opens = 0;
+		h->next = NULL;
+		*link = h;
+	}
+	return *link;
+}
+
+/** Drop the hint at link if it records nothing any more. */
+static void put_hint(dir_hint **link)
+{
+	dir_hint *h = *link;
+	if (h != NULL && h->blk == 0 && h->opens == 0) {
+		*link = h->next;
+		free(h);
+	}
+}
+
+void dir_hint_init(dir_hints *dh)
+{
+	for (int i = 0; i < DIR_HINT_BUCKETS; i++) dh->buckets[i] = NULL;
+	pthread_mutex_init(&dh->lock, NULL);
+}
+
+a1fs_blk_t dir_hint_get(dir_hints *dh, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&dh->lock);
+	dir_hint *h = *find_link(dh, ino);
+	a1fs_blk_t blk = h != NULL ? h->blk : 0;
+	pthread_mutex_unlock(&dh->lock);
+	return blk;
+}
+
+void dir_hint_set(dir_hints *dh, a1fs_ino_t ino, a1fs_blk_t blk)
+{
+	pthread_mutex_lock(&dh->lock);
+	if (blk == 0) {
+		dir_hint **link = find_link(dh, ino);
+		if (*link != NULL) (*link)->blk = 0;
+		put_hint(link);
+	} else {
+		dir_hint *h = get_hint(dh, ino);
+		if (h != NULL) h->blk = blk;
+	}
+	pthread_mutex_unlock(&dh->lock);
+}
+
+bool dir_hint_open(dir_hints *dh, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&dh->lock);
+	dir_hint *h = get_hint(dh, ino);
+	if (h != NULL) h->opens++;
+	pthread_mutex_unlock(&dh->lock);
+	return h != NULL;
+}
+
+void dir_hint_release(dir_hints *dh, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&dh->lock);
+	dir_hint **link = find_link(dh, ino);
+	if (*link != NULL) {
+		if ((*link)->opens > 0) (*link)->opens--;
+		put_hint(link);
+	}
+	pthread_mutex_unlock(&dh->lock);
+}
+
+bool dir_hint_is_open(dir_hints *dh, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&dh->lock);
+	dir_hint *h = *find_link(dh, ino);
+	bool open = h != NULL && h->opens > 0;
+	pthread_mutex_unlock(&dh->lock);
+	return open;
+}
+
+void dir_hint_destroy(dir_hints *dh)
+{
+	for (int i = 0; i < DIR_HINT_BUCKETS; i++) {
+		while (dh->buckets[i] != NULL) {
+			dir_hint *h = dh->buckets[i];
+			dh->buckets[i] = h->next;
+			free(h);
+		}
+	}
+}
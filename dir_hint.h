@@ -0,0 +1,76 @@
+/**
+ * CSC369 Assignment 1 - Hints to the free entries of unindexed directories.
+ *
+ * A directory without an index is searched block by block for room for a new
+ * name. Directories that outgrow one dentry block normally get an index, but
+ * those made before indexes existed, or whose index could not be built, keep
+ * growing block by block, and filling one with N names would then read
+ * O(N^2) dentry blocks. For each such directory, the first dentry block that
+ * may have room is remembered: the blocks before it were found full, and
+ * freeing an entry in one of them moves the hint back. Directories whose
+ * first block has room have no hint, so only directories with several
+ * blocks take memory.
+ *
+ * The table also counts the open handles of each directory: compacting a
+ * directory moves its entries, which would make readdir() offsets handed out
+ * to a reader skip or repeat names, so it waits until nobody is listing it.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of hash buckets of the hint table. */
+#define DIR_HINT_BUCKETS 64
+
+/** The first dentry block of a directory that may have room. */
+typedef struct dir_hint {
+	/** Inode number of the directory. */
+	a1fs_ino_t ino;
+	/** Offset of the dentry block in the directory; 0 if there is no hint. */
+	a1fs_blk_t blk;
+	/** Number of open handles of the directory. */
+	uint32_t opens;
+	/** Next hint in the same hash bucket. */
+	struct dir_hint *next;
+
+} dir_hint;
+
+/** Hints of all directories. */
+typedef struct dir_hints {
+	/** Hints hashed by inode number. */
+	dir_hint *buckets[DIR_HINT_BUCKETS];
+	/** Protects the table. */
+	pthread_mutex_t lock;
+
+} dir_hints;
+
+/** Make the table empty. */
+void dir_hint_init(dir_hints *dh);
+
+/** Return the first dentry block of the directory that may have room, 0 if
+ * there is no hint. */
+a1fs_blk_t dir_hint_get(dir_hints *dh, a1fs_ino_t ino);
+
+/** Record that the dentry blocks of the directory before blk are full. A blk
+ * of 0 drops the hint. Out of memory, nothing is recorded. */
+void dir_hint_set(dir_hints *dh, a1fs_ino_t ino, a1fs_blk_t blk);
+
+/** Record that a handle of the directory is opened. Return false if out of
+ * memory. */
+bool dir_hint_open(dir_hints *dh, a1fs_ino_t ino);
+
+/** Record that a handle of the directory opened with dir_hint_open() is
+ * closed. */
+void dir_hint_release(dir_hints *dh, a1fs_ino_t ino);
+
+/** Check if the directory has open handles. */
+bool dir_hint_is_open(dir_hints *dh, a1fs_ino_t ino);
+
+/** Drop all hints. */
+void dir_hint_destroy(dir_hints *dh);
@@ -0,0 +1,497 @@
+/**
+ * CSC369 Assignment 1 - Hashed index of a directory implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dir_index.h"
+#include "extent_tree.h"
+#include "util.h"
+
+
+/** Deepest index supported; 511^4 dentry blocks is more than any image holds. */
+#define MAX_DEPTH 4
+
+/** Bytes of names put in each dentry block when building an index, leaving
+ * room for a few more before it has to be split. */
+#define BUILD_FILL (A1FS_BLOCK_SIZE * 3 / 4)
+
+/** Times a dentry block is split to make room for a name before giving up;
+ * once is enough unless the names that stay are long. */
+#define MAX_SPLITS 4
+
+/** Low bit of a key marking that its hash continues from the previous key. */
+#define HASH_CONTINUED 1u
+
+/** Index blocks visited going from the root down to a dentry block. */
+typedef struct dx_path {
+	/** Number of index blocks; the root is at 0. */
+	int len;
+	/** The index blocks. */
+	a1fs_dx_header *node[MAX_DEPTH + 1];
+	/** Index of the child taken in each index block. */
+	uint32_t pos[MAX_DEPTH + 1];
+} dx_path;
+
+
+static a1fs_dx_header *get_node(void *image, a1fs_blk_t blk_num)
+{
+	return (a1fs_dx_header *)jump_to(image, blk_num, A1FS_BLOCK_SIZE);
+}
+
+static a1fs_dx_entry *entries(a1fs_dx_header *h)
+{
+	return (a1fs_dx_entry *)(h + 1);
+}
+
+static a1fs_dx_header *get_root(void *image, a1fs_inode *dir)
+{
+	return get_node(image, find_blk_given_offset(image, dir, A1FS_DIR_INDEX_BLK));
+}
+
+/** Dentry block the path leads to. */
+static void *path_leaf(void *image, const dx_path *path)
+{
+	a1fs_dx_header *h = path->node[path->len - 1];
+	return jump_to(image, entries(h)[path->pos[path->len - 1]].dx_blk, A1FS_BLOCK_SIZE);
+}
+
+/** Key of the dentry block the path leads to. */
+static uint32_t path_key(const dx_path *path)
+{
+	a1fs_dx_header *h = path->node[path->len - 1];
+	return entries(h)[path->pos[path->len - 1]].dx_hash;
+}
+
+/** Walk from the root down to the first dentry block that may hold hash. */
+static void descend(void *image, a1fs_inode *dir, uint32_t hash, dx_path *path)
+{
+	a1fs_dx_header *h = get_root(image, dir);
+	for (int l = 0;; l++) {
+		assert(l <= MAX_DEPTH);
+		// the last child with a key at or before the hash
+		uint32_t lo = 1, hi = h->dx_entries;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (entries(h)[mid].dx_hash <= hash) lo = mid + 1;
+			else hi = mid;
+		}
+		path->node[l] = h;
+		path->pos[l] = lo - 1;
+		if (h->dx_depth == 0) {
+			path->len = l + 1;
+			return;
+		}
+		h = get_node(image, entries(h)[lo - 1].dx_blk);
+	}
+}
+
+/** Move the path to the next dentry block. Return false if there is none. */
+static bool next_leaf(void *image, dx_path *path)
+{
+	int l = path->len - 1;
+	while (l >= 0 && path->pos[l] + 1 >= path->node[l]->dx_entries) l--;
+	if (l < 0) return false;
+	path->pos[l]++;
+	for (l++; l < path->len; l++) {
+		path->node[l] = get_node(image, entries(path->node[l - 1])[path->pos[l - 1]].dx_blk);
+		path->pos[l] = 0;
+	}
+	return true;
+}
+
+/** Find the name in the dentry block. */
+static a1fs_dentry *find_in_blk(void *image, void *blk, const char *name)
+{
+	size_t off = 0;
+	for (a1fs_dentry *d; (d = dentries_next(image, blk, A1FS_BLOCK_SIZE, &off)) != NULL;) {
+		if (d->ino != (a1fs_ino_t) -1 && strcmp(dentry_name(image, d), name) == 0) return d;
+	}
+	return NULL;
+}
+
+/** A name moved between dentry blocks. */
+typedef struct dx_name {
+	uint32_t hash;
+	a1fs_ino_t ino;
+	/** Where the name was. */
+	a1fs_dentry *dentry;
+	char name[A1FS_NAME_MAX];
+} dx_name;
+
+static int cmp_name(const void *a, const void *b)
+{
+	uint32_t x = ((const dx_name *)a)->hash, y = ((const dx_name *)b)->hash;
+	return (x > y) - (x < y);
+}
+
+/** Copy a used entry to the end of the array of num names, growing it as
+ * needed. Return false if out of memory. */
+static bool push_name(void *image, a1fs_dentry *d, dx_name **names, uint32_t *num, uint32_t *cap)
+{
+	if (*num == *cap) {
+		dx_name *grown = realloc(*names, 2 * *cap * sizeof(dx_name));
+		if (grown == NULL) return false;
+		*names = grown;
+		*cap *= 2;
+	}
+	dx_name *n = &(*names)[(*num)++];
+	strcpy(n->name, dentry_name(image, d));
+	n->hash = dir_index_hash(n->name);
+	n->ino = d->ino;
+	n->dentry = d;
+	return true;
+}
+
+/** Make the dentry block hold the num names. */
+static void fill_blk(void *image, void *blk, const dx_name *names, uint32_t num)
+{
+	dentries_init(image, blk, A1FS_BLOCK_SIZE);
+	for (uint32_t i = 0; i < num; i++) {
+		a1fs_dentry *d = dentries_add(image, blk, A1FS_BLOCK_SIZE, names[i].name);
+		assert(d != NULL);
+		d->ino = names[i].ino;
+	}
+}
+
+/** Give block offset lblk of the directory a new block. Return its number,
+ * -1 if out of space. */
+static a1fs_blk_t alloc_blk_at(fs_ctx *fs, a1fs_inode *dir, a1fs_blk_t lblk)
+{
+	if (alloc_file_range(fs, dir, lblk, 1, false) != 0) return (a1fs_blk_t) -1;
+	return find_blk_given_offset(fs->image, dir, lblk);
+}
+
+/** Number of dentry blocks of the directory. */
+static a1fs_blk_t count_dentry_blks(void *image, a1fs_inode *dir)
+{
+	a1fs_extent *ext = extent_tree_find(image, dir, A1FS_DIR_INDEX_BLK - 1);
+	return ext != NULL ? ext->logical + ext_len(ext) : 0;
+}
+
+/** Add an index block of the given depth after the last one. Return its
+ * number, -1 if out of space. */
+static a1fs_blk_t alloc_node(fs_ctx *fs, a1fs_inode *dir, uint32_t depth)
+{
+	a1fs_blk_t end = count_file_blks(fs->image, dir);
+	a1fs_blk_t blk_num = alloc_blk_at(fs, dir, end > A1FS_DIR_INDEX_BLK ? end : A1FS_DIR_INDEX_BLK);
+	if (blk_num != (a1fs_blk_t) -1) get_node(fs->image, blk_num)->dx_depth = depth;
+	return blk_num;
+}
+
+/** Number of blocks that adding count blocks to the directory can take,
+ * counting the extent tree blocks they may need. */
+static a1fs_blk_t blks_needed(void *image, a1fs_inode *dir, a1fs_blk_t count)
+{
+	return count * (extent_tree_depth(image, dir) + 3);
+}
+
+/** Insert the entry at position i of the block. */
+static void insert_entry(a1fs_dx_header *h, uint32_t i, uint32_t hash, a1fs_blk_t blk_num)
+{
+	a1fs_dx_entry *e = entries(h);
+	memmove(&e[i + 1], &e[i], (h->dx_entries - i) * sizeof(a1fs_dx_entry));
+	e[i].dx_hash = hash;
+	e[i].dx_blk = blk_num;
+	h->dx_entries++;
+}
+
+/**
+ * Insert an entry at position i of index block l of the path, splitting full
+ * blocks up to the root. The path is only valid above l afterwards.
+ *
+ * @return  0 on success; -ENOSPC if out of space.
+ */
+static int insert_at(fs_ctx *fs, a1fs_inode *dir, dx_path *path, int l, uint32_t i,
+                     uint32_t hash, a1fs_blk_t blk_num)
+{
+	a1fs_dx_header *h = path->node[l];
+	if (h->dx_entries < A1FS_DX_PER_BLOCK) {
+		insert_entry(h, i, hash, blk_num);
+		return 0;
+	}
+	if (l == 0) {
+		// the entries of the root move to a new block, its only child,
+		// which is split below
+		if (path->len > MAX_DEPTH) return -ENOSPC;
+		a1fs_blk_t child_num = alloc_node(fs, dir, h->dx_depth);
+		if (child_num == (a1fs_blk_t) -1) return -ENOSPC;
+		a1fs_dx_header *child = get_node(fs->image, child_num);
+		memcpy(child, h, A1FS_BLOCK_SIZE);
+		h->dx_entries = 1;
+		h->dx_depth++;
+		entries(h)[0].dx_hash = 0;
+		entries(h)[0].dx_blk = child_num;
+		memmove(&path->node[1], &path->node[0], path->len * sizeof(path->node[0]));
+		memmove(&path->pos[1], &path->pos[0], path->len * sizeof(path->pos[0]));
+		path->node[1] = child;
+		path->pos[0] = 0;
+		path->len++;
+		l = 1;
+		h = child;
+	}
+	// move the upper half of the entries to a new block
+	a1fs_blk_t sibling_num = alloc_node(fs, dir, h->dx_depth);
+	if (sibling_num == (a1fs_blk_t) -1) return -ENOSPC;
+	a1fs_dx_header *sibling = get_node(fs->image, sibling_num);
+	uint32_t half = h->dx_entries / 2;
+	sibling->dx_entries = h->dx_entries - half;
+	memcpy(entries(sibling), &entries(h)[half], sibling->dx_entries * sizeof(a1fs_dx_entry));
+	h->dx_entries = half;
+	if (i <= half) insert_entry(h, i, hash, blk_num);
+	else insert_entry(sibling, i - half, hash, blk_num);
+	return insert_at(fs, dir, path, l - 1, path->pos[l - 1] + 1, entries(sibling)[0].dx_hash, sibling_num);
+}
+
+uint32_t dir_index_hash(const char *name)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash & ~HASH_CONTINUED;
+}
+
+a1fs_dentry *dir_index_find(void *image, a1fs_inode *dir, const char *name)
+{
+	uint32_t hash = dir_index_hash(name);
+	dx_path path;
+	descend(image, dir, hash, &path);
+	for (;;) {
+		a1fs_dentry *d = find_in_blk(image, path_leaf(image, &path), name);
+		if (d != NULL) return d;
+		// the names with this hash may go on in the next block
+		if (!next_leaf(image, &path) || path_key(&path) != (hash | HASH_CONTINUED)) return NULL;
+	}
+}
+
+/** Bits of a position of dir_index_walk() holding the rank of a name among
+ * those with the same hash. */
+#define RANK_BITS 16
+
+/** A name listed by dir_index_walk(). */
+typedef struct dx_walk_name {
+	uint32_t hash;
+	a1fs_dentry *dentry;
+	const char *name;
+} dx_walk_name;
+
+static int cmp_walk_name(const void *a, const void *b)
+{
+	const dx_walk_name *x = (const dx_walk_name *)a, *y = (const dx_walk_name *)b;
+	if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+	return strcmp(x->name, y->name);
+}
+
+int dir_index_walk(void *image, a1fs_inode *dir, uint64_t pos, dir_index_walk_fn fn, void *ctx)
+{
+	uint32_t hash0 = (uint32_t) (pos >> RANK_BITS) << 1, rank0 = pos & ((1u << RANK_BITS) - 1);
+	uint32_t cap = 64;
+	dx_walk_name *names = malloc(cap * sizeof(dx_walk_name));
+	if (names == NULL) return -ENOMEM;
+	dx_path path;
+	descend(image, dir, hash0, &path);
+	int ret = 0;
+	for (bool more = true; more && ret == 0;) {
+		// a dentry block and the ones continuing its last hash, ordered by
+		// hash and then by name
+		uint32_t num = 0;
+		do {
+			void *blk = path_leaf(image, &path);
+			size_t off = 0;
+			for (a1fs_dentry *d; (d = dentries_next(image, blk, A1FS_BLOCK_SIZE, &off)) != NULL;) {
+				if (d->ino == (a1fs_ino_t) -1) continue;
+				if (num == cap) {
+					dx_walk_name *grown = realloc(names, 2 * cap * sizeof(dx_walk_name));
+					if (grown == NULL) {
+						free(names);
+						return -ENOMEM;
+					}
+					names = grown;
+					cap *= 2;
+				}
+				names[num].dentry = d;
+				names[num].name = dentry_name(image, d);
+				names[num].hash = dir_index_hash(names[num].name);
+				num++;
+			}
+			more = next_leaf(image, &path);
+		} while (more && (path_key(&path) & HASH_CONTINUED));
+		qsort(names, num, sizeof(dx_walk_name), cmp_walk_name);
+
+		uint32_t rank = 0;
+		for (uint32_t i = 0; i < num && ret == 0; i++) {
+			rank = i > 0 && names[i].hash == names[i - 1].hash ? rank + 1 : 0;
+			if (names[i].hash < hash0 || (names[i].hash == hash0 && rank < rank0)) continue;
+			uint64_t next = (uint64_t) (names[i].hash >> 1) << RANK_BITS | (rank + 1);
+			ret = fn(ctx, names[i].dentry, next);
+		}
+	}
+	free(names);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Move the upper half of the names of the dentry block the path leads to,
+ * ordered by hash, to a new dentry block, as long as num_blk more blocks stay
+ * free for the caller.
+ *
+ * @return  0 on success; -ENOMEM or -ENOSPC on failure.
+ */
+static int split_leaf(fs_ctx *fs, a1fs_inode *dir, dx_path *path, a1fs_blk_t num_blk)
+{
+	void *image = fs->image;
+	void *leaf = path_leaf(image, path);
+	uint32_t num = 0, cap = 16;
+	dx_name *names = malloc(cap * sizeof(dx_name));
+	if (names == NULL) return -ENOMEM;
+	size_t off = 0, total = 0;
+	for (a1fs_dentry *d; (d = dentries_next(image, leaf, A1FS_BLOCK_SIZE, &off)) != NULL;) {
+		if (d->ino == (a1fs_ino_t) -1) continue;
+		if (!push_name(image, d, &names, &num, &cap)) {
+			free(names);
+			return -ENOMEM;
+		}
+		total += dentry_size(image, names[num - 1].name);
+	}
+	assert(num >= 2);
+
+	// a new dentry block and an index block on each level and a new root at
+	// most
+	int err = -ENOSPC;
+	if (!has_n_free_blk(fs, num_blk + blks_needed(image, dir, path->len + 2), LOOKUP_DB)) goto out;
+	a1fs_blk_t new_num = alloc_blk_at(fs, dir, count_dentry_blks(image, dir));
+	if (new_num == (a1fs_blk_t) -1) goto out;
+
+	// order the names by hash and split them in the middle of their bytes,
+	// or as close to it as possible between two different hashes
+	qsort(names, num, sizeof(dx_name), cmp_name);
+	uint32_t mid = 1;
+	for (size_t bytes = dentry_size(image, names[0].name); mid < num - 1 && bytes < total / 2; mid++)
+		bytes += dentry_size(image, names[mid].name);
+	uint32_t split = mid;
+	for (uint32_t k = 0; k < num; k++) {
+		if (mid > k && names[mid - k - 1].hash != names[mid - k].hash) { split = mid - k; break; }
+		if (mid + k < num && names[mid + k - 1].hash != names[mid + k].hash) { split = mid + k; break; }
+	}
+	uint32_t key = names[split].hash;
+	if (names[split - 1].hash == key) key |= HASH_CONTINUED;
+	int l = path->len - 1;
+	if ((err = insert_at(fs, dir, path, l, path->pos[l] + 1, key, new_num)) != 0) goto out;
+	// the names that stay are not moved, so that a readdir() going through
+	// the block does not miss them
+	for (uint32_t k = split; k < num; k++) names[k].dentry->ino = (a1fs_ino_t) -1;
+	fill_blk(image, jump_to(image, new_num, A1FS_BLOCK_SIZE), &names[split], num - split);
+out:
+	free(names);
+	return err;
+}
+
+a1fs_dentry *dir_index_alloc(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_blk_t num_blk)
+{
+	void *image = fs->image;
+	if (!has_n_free_blk(fs, num_blk, LOOKUP_DB)) return NULL;
+	uint32_t hash = dir_index_hash(name);
+	for (int i = 0; i < MAX_SPLITS; i++) {
+		dx_path path;
+		descend(image, dir, hash, &path);
+		a1fs_dentry *d = dentries_add(image, path_leaf(image, &path), A1FS_BLOCK_SIZE, name);
+		if (d != NULL) return d;
+		if (split_leaf(fs, dir, &path, num_blk) != 0) return NULL;
+	}
+	return NULL;
+}
+
+a1fs_blk_t dir_index_num_leaves(size_t bytes)
+{
+	return CEIL_DIV(bytes, BUILD_FILL) > 1 ? CEIL_DIV(bytes, BUILD_FILL) : 1;
+}
+
+int dir_index_build(fs_ctx *fs, a1fs_inode *dir)
+{
+	void *image = fs->image;
+	assert(!is_inline(dir) && !is_indexed(dir));
+
+	// collect the names, ordered by hash
+	uint32_t num = 0, cap = 16;
+	dx_name *names = malloc(cap * sizeof(dx_name));
+	if (names == NULL) return -ENOMEM;
+	dir_iter it;
+	dir_iter_init(&it, dir);
+	size_t total = 0;
+	for (a1fs_dentry *d; (d = dir_iter_next(image, &it)) != NULL;) {
+		if (d->ino == (a1fs_ino_t) -1) continue;
+		if (!push_name(image, d, &names, &num, &cap)) {
+			free(names);
+			return -ENOMEM;
+		}
+		total += dentry_size(image, names[num - 1].name);
+	}
+	qsort(names, num, sizeof(dx_name), cmp_name);
+
+	// the dentry blocks, and the index blocks on each level above them
+	a1fs_blk_t num_blks = count_dentry_blks(image, dir);
+	a1fs_blk_t num_leaves = dir_index_num_leaves(total);
+	a1fs_blk_t new_blks = num_leaves > num_blks ? num_leaves - num_blks : 0;
+	a1fs_blk_t num_nodes = 1;
+	for (a1fs_blk_t level = num_leaves; level > A1FS_DX_PER_BLOCK; level = CEIL_DIV(level, A1FS_DX_PER_BLOCK))
+		num_nodes += CEIL_DIV(level, A1FS_DX_PER_BLOCK);
+	a1fs_dx_entry *level = malloc(num_leaves * sizeof(a1fs_dx_entry));
+	if (level == NULL || !has_n_free_blk(fs, new_blks + blks_needed(image, dir, num_nodes + 1), LOOKUP_DB)) {
+		free(level);
+		free(names);
+		return level == NULL ? -ENOMEM : -ENOSPC;
+	}
+	a1fs_blk_t root_num = alloc_node(fs, dir, 0);
+	if (new_blks > 0) alloc_file_range(fs, dir, num_blks, new_blks, false);
+
+	// spread the bytes of the names evenly over the dentry blocks: a name
+	// goes to the block its first byte falls in; blocks past the last one
+	// used are left empty
+	uint32_t first = 0;
+	size_t bytes = 0;
+	for (a1fs_blk_t b = 0; b < num_blks + new_blks; b++) {
+		a1fs_blk_t blk_num = find_blk_given_offset(image, dir, b);
+		uint32_t end = first;
+		for (; b < num_leaves && end < num && bytes * num_leaves / total == b; end++)
+			bytes += dentry_size(image, names[end].name);
+		fill_blk(image, jump_to(image, blk_num, A1FS_BLOCK_SIZE), &names[first], end - first);
+		if (b >= num_leaves) continue;
+		level[b].dx_blk = blk_num;
+		level[b].dx_hash = 0;
+		if (b > 0 && first < num) {
+			level[b].dx_hash = names[first].hash;
+			if (names[first - 1].hash == names[first].hash) level[b].dx_hash |= HASH_CONTINUED;
+		}
+		first = end;
+	}
+	free(names);
+	// fill the index bottom up, spreading each level evenly over its blocks
+	uint32_t depth = 0;
+	a1fs_blk_t count = num_leaves;
+	while (count > A1FS_DX_PER_BLOCK) {
+		a1fs_blk_t num_level = CEIL_DIV(count, A1FS_DX_PER_BLOCK);
+		for (a1fs_blk_t b = 0; b < num_level; b++) {
+			a1fs_blk_t first = (uint64_t) b * count / num_level, end = (uint64_t) (b + 1) * count / num_level;
+			a1fs_blk_t blk_num = alloc_node(fs, dir, depth);
+			a1fs_dx_header *h = get_node(image, blk_num);
+			h->dx_entries = end - first;
+			memcpy(entries(h), &level[first], (end - first) * sizeof(a1fs_dx_entry));
+			level[b].dx_hash = level[first].dx_hash;
+			level[b].dx_blk = blk_num;
+		}
+		count = num_level;
+		depth++;
+	}
+	a1fs_dx_header *root = get_node(image, root_num);
+	root->dx_entries = count;
+	root->dx_depth = depth;
+	memcpy(entries(root), level, count * sizeof(a1fs_dx_entry));
+	free(level);
+	dir->i_flags |= A1FS_INODE_INDEXED;
+	return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * CSC369 Assignment 1 - Hashed index of a directory.
+ *
+ * A directory that outgrows its first dentry block gets an index, so that
+ * finding a name or a free entry for it reads the index blocks on the way
+ * down the tree and one dentry block, whatever the size of the directory.
+ * The names of each dentry block have hashes in the range given by the index.
+ * When a dentry block fills up, half of its names move to a new one, ordered
+ * by hash, and a key for it is added to the index, splitting full index
+ * blocks up to the root. Blocks are never merged; removing a name only frees
+ * its entry, and a directory left mostly empty is compacted as a whole (see
+ * dir_compact.h). Directories without the A1FS_INODE_INDEXED flag are searched
+ * block by block.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Return the hash of a name used to place it in a directory index. */
+uint32_t dir_index_hash(const char *name);
+
+/** Find the entry of the indexed directory with the given name, NULL if
+ * there is none. */
+a1fs_dentry *dir_index_find(void *image, a1fs_inode *dir, const char *name);
+
+/**
+ * Find a free entry for the name in the indexed directory, splitting its
+ * dentry block if it is full, as long as num_blk more blocks stay free for
+ * the caller.
+ *
+ * @return  the entry; NULL if there is no space.
+ */
+a1fs_dentry *dir_index_alloc(fs_ctx *fs, a1fs_inode *dir, const char *name, a1fs_blk_t num_blk);
+
+/** Called by dir_index_walk() for an entry with the position of the next
+ * one; a nonzero result stops the walk. */
+typedef int (*dir_index_walk_fn)(void *ctx, a1fs_dentry *d, uint64_t next);
+
+/**
+ * Call fn for the entries of the indexed directory from position pos on, 0
+ * being the start. The entries are listed in the order of their hashes, and
+ * of their names for equal hashes, and a position is the hash of the next
+ * entry with its rank among the names with that hash. Unlike byte offsets in
+ * the dentry blocks, positions stay valid when blocks are split.
+ *
+ * @return  0 on success, including when fn stopped the walk; a negative
+ *          result of fn; -ENOMEM if out of memory.
+ */
+int dir_index_walk(void *image, a1fs_inode *dir, uint64_t pos, dir_index_walk_fn fn, void *ctx);
+
+/** Return the number of dentry blocks dir_index_build() spreads names taking
+ * the given number of bytes over. */
+a1fs_blk_t dir_index_num_leaves(size_t bytes);
+
+/**
+ * Give the directory an index, redistributing its entries among its dentry
+ * blocks by hash and adding blocks so that each has room for a few more.
+ *
+ * @return  0 on success; -ENOMEM or -ENOSPC on failure, in which case the
+ *          directory is left as it was.
+ */
+int dir_index_build(fs_ctx *fs, a1fs_inode *dir);
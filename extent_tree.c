@@ -0,0 +1,321 @@
+/**
+ * CSC369 Assignment 1 - On-disk extent tree of an inode implementation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "extent_tree.h"
+#include "util.h"
+
+
+/** Deepest tree supported; 340^5 extents is more than any image holds. */
+#define MAX_DEPTH 5
+
+/** Size of an entry of a tree block, extent or index alike. */
+#define ENTRY_SIZE sizeof(a1fs_extent)
+
+/** Nodes visited going from the root of a tree down to a leaf. */
+typedef struct ext_path {
+	/** Number of nodes; the root is at 0 and the leaf at len - 1. */
+	int len;
+	/** The nodes. */
+	a1fs_extent_header *node[MAX_DEPTH + 1];
+	/** Block numbers of the nodes; the root is in the inode and has none. */
+	a1fs_blk_t blk[MAX_DEPTH + 1];
+	/** Index of the child taken in each index block. In the leaf, the
+	 * number of extents starting at or before the offset looked up. */
+	uint32_t pos[MAX_DEPTH + 1];
+} ext_path;
+
+
+static a1fs_extent_header *get_node(void *image, a1fs_blk_t blk_num)
+{
+	return (a1fs_extent_header *)jump_to(image, blk_num, A1FS_BLOCK_SIZE);
+}
+
+static a1fs_extent_header *get_root(const a1fs_inode *ino)
+{
+	return (a1fs_extent_header *)&ino->i_root;
+}
+
+/** Number of entries that fit in node l of a path. */
+static uint32_t node_capacity(void *image, int l)
+{
+	return l == 0 ? extent_tree_root_capacity(image) : A1FS_EXTENTS_PER_BLOCK;
+}
+
+static a1fs_extent *leaf_entries(a1fs_extent_header *h)
+{
+	return (a1fs_extent *)(h + 1);
+}
+
+static a1fs_extent_idx *idx_entries(a1fs_extent_header *h)
+{
+	return (a1fs_extent_idx *)(h + 1);
+}
+
+/** Logical offset of entry i of the block; extents and index entries both
+ * start with it. */
+static a1fs_blk_t key_at(a1fs_extent_header *h, uint32_t i)
+{
+	return leaf_entries(h)[i].logical;
+}
+
+/** Return the number of entries of the block with a key at or before lblk. */
+static uint32_t upper_bound(a1fs_extent_header *h, a1fs_blk_t lblk)
+{
+	uint32_t lo = 0, hi = h->h_entries;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (key_at(h, mid) <= lblk) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/** Walk from the root down to the leaf that holds, or would hold, lblk. */
+static void descend(void *image, const a1fs_inode *ino, a1fs_blk_t lblk, ext_path *path)
+{
+	a1fs_extent_header *h = get_root(ino);
+	a1fs_blk_t blk_num = (a1fs_blk_t) -1;
+	for (int l = 0;; l++) {
+		uint32_t n = upper_bound(h, lblk);
+		path->node[l] = h;
+		path->blk[l] = blk_num;
+		if (h->h_depth == 0) {
+			path->pos[l] = n;
+			path->len = l + 1;
+			return;
+		}
+		// offsets before the first key still belong to the first child
+		path->pos[l] = n > 0 ? n - 1 : 0;
+		blk_num = idx_entries(h)[path->pos[l]].child;
+		h = get_node(image, blk_num);
+	}
+}
+
+/** Return the first or the last extent under the node, NULL if empty. */
+static a1fs_extent *edge_extent(void *image, a1fs_extent_header *h, bool last)
+{
+	while (h->h_depth > 0) {
+		h = get_node(image, idx_entries(h)[last ? h->h_entries - 1 : 0].child);
+	}
+	if (h->h_entries == 0) return NULL;
+	return leaf_entries(h) + (last ? h->h_entries - 1 : 0);
+}
+
+/** Insert the entry at index i of a block that is not full. */
+static void insert_entry(a1fs_extent_header *h, uint32_t i, const void *entry)
+{
+	unsigned char *entries = (unsigned char *)(h + 1);
+	memmove(entries + (i + 1) * ENTRY_SIZE, entries + i * ENTRY_SIZE, (h->h_entries - i) * ENTRY_SIZE);
+	memcpy(entries + i * ENTRY_SIZE, entry, ENTRY_SIZE);
+	h->h_entries++;
+}
+
+/** Remove the entry at index i of the block. */
+static void remove_entry(a1fs_extent_header *h, uint32_t i)
+{
+	unsigned char *entries = (unsigned char *)(h + 1);
+	memmove(entries + i * ENTRY_SIZE, entries + (i + 1) * ENTRY_SIZE, (h->h_entries - i - 1) * ENTRY_SIZE);
+	h->h_entries--;
+}
+
+/** Allocate a block for the tree near goal. Return -1 if out of space. */
+static a1fs_blk_t alloc_node(fs_ctx *fs, a1fs_blk_t goal)
+{
+	if (!has_n_free_blk(fs, 1, LOOKUP_DB)) return (a1fs_blk_t) -1;
+	a1fs_blk_t blk_num = find_free_blk_near(fs, LOOKUP_DB, goal);
+	if (blk_num == (a1fs_blk_t) -1) return blk_num;
+	mask(fs, blk_num, LOOKUP_DB, true);
+	return blk_num;
+}
+
+/** Move the entries of the root to a new block near goal and make the root
+ * an index pointing to it, one level higher. */
+static int grow_root(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t goal)
+{
+	a1fs_blk_t blk_num = alloc_node(fs, goal);
+	if (blk_num == (a1fs_blk_t) -1) return -ENOSPC;
+	a1fs_extent_header *root = get_root(ino);
+	a1fs_extent_header *child = get_node(fs->image, blk_num);
+	memcpy(child, root, sizeof(a1fs_extent_header) + root->h_entries * ENTRY_SIZE);
+	root->h_depth++;
+	root->h_entries = 1;
+	idx_entries(root)[0].logical = key_at(child, 0);
+	idx_entries(root)[0].child = blk_num;
+	return 0;
+}
+
+/**
+ * Split block l > 0 of the path into a new block near goal; the parent must
+ * not be full. When appending, only the last entry moves to the new block,
+ * otherwise half of them do.
+ */
+static int split_node(fs_ctx *fs, const ext_path *path, int l, bool append, a1fs_blk_t goal)
+{
+	a1fs_blk_t blk_num = alloc_node(fs, goal);
+	if (blk_num == (a1fs_blk_t) -1) return -ENOSPC;
+	a1fs_extent_header *h = path->node[l];
+	a1fs_extent_header *sibling = get_node(fs->image, blk_num);
+	uint32_t keep = append ? h->h_entries - 1 : h->h_entries / 2;
+	sibling->h_depth = h->h_depth;
+	sibling->h_entries = h->h_entries - keep;
+	memcpy(sibling + 1, (unsigned char *)(h + 1) + keep * ENTRY_SIZE, sibling->h_entries * ENTRY_SIZE);
+	h->h_entries = keep;
+
+	a1fs_extent_idx idx = { .logical = key_at(sibling, 0), .child = blk_num };
+	insert_entry(path->node[l - 1], path->pos[l - 1] + 1, &idx);
+	return 0;
+}
+
+uint32_t extent_tree_root_capacity(void *image)
+{
+	size_t root_size = get_superblock(image)->s_inode_size - offsetof(a1fs_inode, i_root);
+	return (root_size - sizeof(a1fs_extent_header)) / ENTRY_SIZE;
+}
+
+void extent_tree_init(a1fs_inode *ino)
+{
+	memset(get_root(ino), 0, sizeof(a1fs_extent_header));
+}
+
+uint32_t extent_tree_depth(void *image, const a1fs_inode *ino)
+{
+	(void)image;
+	return get_root(ino)->h_depth;
+}
+
+a1fs_extent *extent_tree_find(void *image, const a1fs_inode *ino, a1fs_blk_t lblk)
+{
+	ext_path path;
+	descend(image, ino, lblk, &path);
+	uint32_t n = path.pos[path.len - 1];
+	if (n == 0) return NULL;
+	return leaf_entries(path.node[path.len - 1]) + n - 1;
+}
+
+a1fs_extent *extent_tree_first(void *image, const a1fs_inode *ino)
+{
+	return edge_extent(image, get_root(ino), false);
+}
+
+a1fs_extent *extent_tree_last(void *image, const a1fs_inode *ino)
+{
+	return edge_extent(image, get_root(ino), true);
+}
+
+a1fs_extent *extent_tree_next(void *image, const a1fs_inode *ino, const a1fs_extent *ext)
+{
+	// the leaf holding ext is the root or the block ext points into
+	a1fs_extent_header *leaf = get_root(ino);
+	if (leaf->h_depth > 0) {
+		leaf = get_node(image, ((const unsigned char *)ext - (unsigned char *)image) / A1FS_BLOCK_SIZE);
+	}
+	if (ext + 1 < leaf_entries(leaf) + leaf->h_entries) return (a1fs_extent *)ext + 1;
+
+	// otherwise it is the first extent under the next child of the lowest
+	// index block that has one
+	ext_path path;
+	descend(image, ino, ext->logical, &path);
+	for (int l = path.len - 2; l >= 0; l--) {
+		a1fs_extent_header *h = path.node[l];
+		if (path.pos[l] + 1 < h->h_entries) {
+			return edge_extent(image, get_node(image, idx_entries(h)[path.pos[l] + 1].child), false);
+		}
+	}
+	return NULL;
+}
+
+int extent_tree_insert(fs_ctx *fs, a1fs_inode *ino, const a1fs_extent *ext)
+{
+	void *image = fs->image;
+	// make room from the top down, one node at a time, until the leaf has
+	// some; this allocates at most one block per level plus one for the root.
+	// Tree blocks go next to the data they map.
+	ext_path path;
+	for (;;) {
+		descend(image, ino, ext->logical, &path);
+		int l = path.len - 1;
+		while (l >= 0 && path.node[l]->h_entries == node_capacity(image, l)) l--;
+		if (l == path.len - 1) break;
+
+		int err;
+		if (l < 0) {
+			if (path.len > MAX_DEPTH) return -ENOSPC;
+			err = grow_root(fs, ino, ext->start);
+		} else {
+			// appending if the extent goes after everything in the tree
+			bool append = path.pos[path.len - 1] == A1FS_EXTENTS_PER_BLOCK;
+			for (int k = 0; append && k < path.len - 1; k++) {
+				append = path.pos[k] + 1 == path.node[k]->h_entries;
+			}
+			err = split_node(fs, &path, l + 1, append, ext->start);
+		}
+		if (err != 0) return err;
+	}
+
+	int leaf = path.len - 1;
+	insert_entry(path.node[leaf], path.pos[leaf], ext);
+	// a new first extent of a block lowers the key of the block in its parent
+	for (int l = leaf; l > 0 && path.pos[l] == 0; l--) {
+		idx_entries(path.node[l - 1])[path.pos[l - 1]].logical = ext->logical;
+	}
+	ino->i_extents++;
+	return 0;
+}
+
+void extent_tree_remove(fs_ctx *fs, a1fs_inode *ino, const a1fs_extent *ext)
+{
+	void *image = fs->image;
+	ext_path path;
+	descend(image, ino, ext->logical, &path);
+	int l = path.len - 1;
+	assert(path.pos[l] > 0);
+	uint32_t i = path.pos[l] - 1;
+	// remove the extent, then the index entry of every block left empty
+	for (;;) {
+		a1fs_extent_header *h = path.node[l];
+		remove_entry(h, i);
+		if (h->h_entries > 0 || l == 0) break;
+		mask(fs, path.blk[l], LOOKUP_DB, false);
+		l--;
+		i = path.pos[l];
+	}
+	// a block that lost its first entry has a higher key in its parent
+	for (; l > 0 && i == 0; l--) {
+		i = path.pos[l - 1];
+		idx_entries(path.node[l - 1])[i].logical = key_at(path.node[l], 0);
+	}
+	ino->i_extents--;
+
+	// an empty root is a leaf again, and a root with a single child takes
+	// the place of the child if it fits
+	a1fs_extent_header *root = get_root(ino);
+	if (root->h_entries == 0) root->h_depth = 0;
+	while (root->h_depth > 0 && root->h_entries == 1) {
+		a1fs_blk_t child = idx_entries(root)[0].child;
+		a1fs_extent_header *h = get_node(image, child);
+		if (h->h_entries > extent_tree_root_capacity(image)) break;
+		memcpy(root, h, sizeof(a1fs_extent_header) + h->h_entries * ENTRY_SIZE);
+		mask(fs, child, LOOKUP_DB, false);
+	}
+}
+
+/** Free the blocks under the node. */
+static void free_children(fs_ctx *fs, a1fs_extent_header *h)
+{
+	for (uint32_t i = 0; h->h_depth > 0 && i < h->h_entries; i++) {
+		a1fs_blk_t child = idx_entries(h)[i].child;
+		free_children(fs, get_node(fs->image, child));
+		mask(fs, child, LOOKUP_DB, false);
+	}
+}
+
+void extent_tree_free(fs_ctx *fs, a1fs_inode *ino)
+{
+	free_children(fs, get_root(ino));
+	extent_tree_init(ino);
+	ino->i_extents = 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * CSC369 Assignment 1 - On-disk extent tree of an inode.
+ *
+ * The extents of a file live in a B+tree rooted in the inode itself, like the
+ * ext4 extent tree. Leaves hold extents and index nodes hold the first logical
+ * offset and block number of each child, all sorted by logical offset. A file
+ * starts with an empty leaf as the root, which holds as many extents as fit
+ * in the rest of the on-disk inode, so files with few extents need no tree
+ * blocks. When the root fills up, its entries move to a new block and the
+ * root becomes an index one level higher. Lookups read one block per level
+ * below the root. A full block is split in half, except when appending past
+ * the end of the file, where only the last entry moves to the new block so
+ * that the blocks left behind stay full.
+ *
+ * Extent pointers returned by these functions point into the inode or tree
+ * blocks and are only valid until the next insertion or removal.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Return the number of entries that fit in the root of a tree. */
+uint32_t extent_tree_root_capacity(void *image);
+
+/** Make the tree of the inode empty, i.e. an empty leaf as the root. */
+void extent_tree_init(a1fs_inode *ino);
+
+/** Return the height of the tree of the inode above its leaves. */
+uint32_t extent_tree_depth(void *image, const a1fs_inode *ino);
+
+/**
+ * Find the last extent of the file starting at or before the given block
+ * offset. The extent does not necessarily cover the offset.
+ *
+ * @return  pointer to the extent; NULL if all extents start after lblk.
+ */
+a1fs_extent *extent_tree_find(void *image, const a1fs_inode *ino, a1fs_blk_t lblk);
+
+/** Return the first extent of the file, NULL if it has none. */
+a1fs_extent *extent_tree_first(void *image, const a1fs_inode *ino);
+
+/** Return the last extent of the file, NULL if it has none. */
+a1fs_extent *extent_tree_last(void *image, const a1fs_inode *ino);
+
+/** Return the extent following ext in the file, NULL if ext is the last. */
+a1fs_extent *extent_tree_next(void *image, const a1fs_inode *ino, const a1fs_extent *ext);
+
+/**
+ * Add a copy of the extent to the tree. The extent must not overlap the
+ * extents already in the tree. Blocks for the tree are allocated as needed.
+ *
+ * @return  0 on success; -ENOSPC if out of space for tree blocks, in which
+ *          case the extent is not added. The tree may still have grown a
+ *          level or had nodes split on the way, but it holds the same
+ *          extents and all of its blocks stay in use.
+ */
+int extent_tree_insert(fs_ctx *fs, a1fs_inode *ino, const a1fs_extent *ext);
+
+/**
+ * Remove the extent from the tree, freeing tree blocks left empty. The blocks
+ * of the extent itself are not freed.
+ */
+void extent_tree_remove(fs_ctx *fs, a1fs_inode *ino, const a1fs_extent *ext);
+
+/** Free all the blocks of the tree and make it empty. */
+void extent_tree_free(fs_ctx *fs, a1fs_inode *ino);
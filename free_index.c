@@ -0,0 +1,321 @@
+/**
+ * CSC369 Assignment 1 - In-memory index of free data block runs implementation.
+ *
+ * Both trees are treaps sharing the same nodes: each run has one set of child
+ * links per tree and a random priority that keeps both trees balanced with
+ * high probability. Nodes of the start tree also cache the largest run length
+ * in their subtree, which is what makes first-fit lookups logarithmic.
+ */
+
+#include <stdlib.h>
+
+#include "free_index.h"
+#include "util.h"
+
+
+/** Tree selectors for the child links of a run. */
+enum { BY_START, BY_LEN };
+
+/** A maximal run of free blocks. */
+typedef struct free_run {
+	/** First block of the run. */
+	uint32_t start;
+	/** Number of blocks in the run. */
+	uint32_t len;
+	/** Treap priority; a parent's priority is never lower than its children's. */
+	uint32_t prio;
+	/** Largest len in this node's subtree of the start tree. */
+	uint32_t max_len;
+	/** Left and right children in each tree, indexed by BY_START/BY_LEN. */
+	struct free_run *child[2][2];
+
+} free_run;
+
+struct free_index {
+	/** Roots of the start and length trees. */
+	free_run *root[2];
+	/** State of the priority generator. */
+	uint32_t seed;
+};
+
+
+/** Generate the next node priority (xorshift32). */
+static uint32_t next_prio(free_index *fi)
+{
+	uint32_t x = fi->seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return fi->seed = x;
+}
+
+/** Compare two runs by the key of the given tree. */
+static int run_cmp(const free_run *a, const free_run *b, int tree)
+{
+	if (tree == BY_LEN && a->len != b->len) return a->len < b->len ? -1 : 1;
+	if (a->start != b->start) return a->start < b->start ? -1 : 1;
+	return 0;
+}
+
+/** Recompute the cached subtree data of t after its children changed. */
+static void update(free_run *t, int tree)
+{
+	if (tree != BY_START) return;
+	t->max_len = t->len;
+	for (int side = 0; side < 2; side++) {
+		free_run *c = t->child[BY_START][side];
+		if (c && c->max_len > t->max_len) t->max_len = c->max_len;
+	}
+}
+
+/** Rotate the child of t on the given side up into t's place. */
+static free_run *rotate(free_run *t, int tree, int side)
+{
+	free_run *c = t->child[tree][side];
+	t->child[tree][side] = c->child[tree][!side];
+	c->child[tree][!side] = t;
+	update(t, tree);
+	update(c, tree);
+	return c;
+}
+
+static free_run *tree_insert(free_run *t, free_run *node, int tree)
+{
+	if (t == NULL) return node;
+	int side = run_cmp(node, t, tree) > 0;
+	t->child[tree][side] = tree_insert(t->child[tree][side], node, tree);
+	if (t->child[tree][side]->prio > t->prio) return rotate(t, tree, side);
+	update(t, tree);
+	return t;
+}
+
+/** Join two treaps where every key in a is less than every key in b. */
+static free_run *tree_join(free_run *a, free_run *b, int tree)
+{
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (a->prio > b->prio) {
+		a->child[tree][1] = tree_join(a->child[tree][1], b, tree);
+		update(a, tree);
+		return a;
+	}
+	b->child[tree][0] = tree_join(a, b->child[tree][0], tree);
+	update(b, tree);
+	return b;
+}
+
+static free_run *tree_erase(free_run *t, free_run *node, int tree)
+{
+	if (t == node) {
+		free_run *res = tree_join(t->child[tree][0], t->child[tree][1], tree);
+		node->child[tree][0] = node->child[tree][1] = NULL;
+		return res;
+	}
+	int side = run_cmp(node, t, tree) > 0;
+	t->child[tree][side] = tree_erase(t->child[tree][side], node, tree);
+	update(t, tree);
+	return t;
+}
+
+static void link_run(free_index *fi, free_run *run)
+{
+	run->max_len = run->len;
+	fi->root[BY_START] = tree_insert(fi->root[BY_START], run, BY_START);
+	fi->root[BY_LEN] = tree_insert(fi->root[BY_LEN], run, BY_LEN);
+}
+
+static void unlink_run(free_index *fi, free_run *run)
+{
+	fi->root[BY_START] = tree_erase(fi->root[BY_START], run, BY_START);
+	fi->root[BY_LEN] = tree_erase(fi->root[BY_LEN], run, BY_LEN);
+}
+
+static free_run *new_run(free_index *fi, uint32_t start, uint32_t len)
+{
+	free_run *run = calloc(1, sizeof(free_run));
+	if (run == NULL) return NULL;
+	run->start = start;
+	run->len = len;
+	run->prio = next_prio(fi);
+	return run;
+}
+
+/** Find the run with the largest start that is <= block. */
+static free_run *find_le(const free_index *fi, uint32_t block)
+{
+	free_run *res = NULL;
+	for (free_run *t = fi->root[BY_START]; t != NULL;) {
+		if (t->start <= block) {
+			res = t;
+			t = t->child[BY_START][1];
+		} else {
+			t = t->child[BY_START][0];
+		}
+	}
+	return res;
+}
+
+/** Find the run with the smallest start that is > block. */
+static free_run *find_gt(const free_index *fi, uint32_t block)
+{
+	free_run *res = NULL;
+	for (free_run *t = fi->root[BY_START]; t != NULL;) {
+		if (t->start > block) {
+			res = t;
+			t = t->child[BY_START][0];
+		} else {
+			t = t->child[BY_START][1];
+		}
+	}
+	return res;
+}
+
+free_index *free_index_create(void *image, uint32_t num_blocks)
+{
+	free_index *fi = calloc(1, sizeof(free_index));
+	if (fi == NULL) return NULL;
+	fi->seed = 0x9E3779B9u;
+
+	uint32_t start = bitmap_find_zero(image, LOOKUP_DB, 0, num_blocks);
+	while (start != BITMAP_NONE) {
+		uint32_t end = bitmap_find_one(image, LOOKUP_DB, start, num_blocks);
+		if (end == BITMAP_NONE) end = num_blocks;
+		free_run *run = new_run(fi, start, end - start);
+		if (run == NULL) {
+			free_index_destroy(fi);
+			return NULL;
+		}
+		link_run(fi, run);
+		if (end == num_blocks) break;
+		start = bitmap_find_zero(image, LOOKUP_DB, end, num_blocks);
+	}
+	return fi;
+}
+
+static void free_tree(free_run *t)
+{
+	if (t == NULL) return;
+	free_tree(t->child[BY_START][0]);
+	free_tree(t->child[BY_START][1]);
+	free(t);
+}
+
+void free_index_destroy(free_index *fi)
+{
+	if (fi == NULL) return;
+	free_tree(fi->root[BY_START]);
+	free(fi);
+}
+
+bool free_index_insert(free_index *fi, uint32_t start, uint32_t len)
+{
+	if (len == 0) return true;
+	free_run *prev = start > 0 ? find_le(fi, start - 1) : NULL;
+	free_run *next = find_gt(fi, start);
+	// blocks that are already free must not be inserted again
+	if (prev && prev->start + prev->len > start) return false;
+	if (next && next->start < start + len) return false;
+	if (prev && prev->start + prev->len < start) prev = NULL;
+	if (next && next->start != start + len) next = NULL;
+
+	if (prev != NULL) {
+		// grow the previous run, absorbing the next one if it is adjacent
+		unlink_run(fi, prev);
+		prev->len += len;
+		if (next != NULL) {
+			unlink_run(fi, next);
+			prev->len += next->len;
+			free(next);
+		}
+		link_run(fi, prev);
+	} else if (next != NULL) {
+		unlink_run(fi, next);
+		next->start = start;
+		next->len += len;
+		link_run(fi, next);
+	} else {
+		free_run *run = new_run(fi, start, len);
+		if (run == NULL) return false;
+		link_run(fi, run);
+	}
+	return true;
+}
+
+bool free_index_remove(free_index *fi, uint32_t start, uint32_t len)
+{
+	if (len == 0) return true;
+	free_run *run = find_le(fi, start);
+	if (run == NULL || run->start + run->len < start + len) return false;
+
+	uint32_t tail_start = start + len;
+	uint32_t tail_len = run->start + run->len - tail_start;
+	free_run *tail = NULL;
+	if (start > run->start && tail_len > 0) {
+		// splitting a run in two needs a new node for the tail
+		tail = new_run(fi, tail_start, tail_len);
+		if (tail == NULL) return false;
+	}
+
+	unlink_run(fi, run);
+	if (start > run->start) {
+		run->len = start - run->start;
+		link_run(fi, run);
+		if (tail) link_run(fi, tail);
+	} else if (tail_len > 0) {
+		run->start = tail_start;
+		run->len = tail_len;
+		link_run(fi, run);
+	} else {
+		free(run);
+	}
+	return true;
+}
+
+/** Find the lowest run in the subtree t with len >= n and start >= from. */
+static free_run *first_fit(free_run *t, uint32_t n, uint32_t from)
+{
+	while (t != NULL && t->max_len >= n) {
+		if (t->start < from) {
+			// t and its left subtree all start too early
+			t = t->child[BY_START][1];
+			continue;
+		}
+		free_run *res = first_fit(t->child[BY_START][0], n, from);
+		if (res != NULL) return res;
+		if (t->len >= n) return t;
+		t = t->child[BY_START][1];
+	}
+	return NULL;
+}
+
+uint32_t free_index_first_fit(const free_index *fi, uint32_t n, uint32_t from)
+{
+	free_run *res = first_fit(fi->root[BY_START], n, from);
+	return res ? res->start : BITMAP_NONE;
+}
+
+uint32_t free_index_best_fit(const free_index *fi, uint32_t n)
+{
+	free_run *res = NULL;
+	for (free_run *t = fi->root[BY_LEN]; t != NULL;) {
+		if (t->len >= n) {
+			res = t;
+			t = t->child[BY_LEN][0];
+		} else {
+			t = t->child[BY_LEN][1];
+		}
+	}
+	return res ? res->start : BITMAP_NONE;
+}
+
+uint32_t free_index_largest(const free_index *fi, uint32_t *len)
+{
+	free_run *t = fi->root[BY_LEN];
+	if (t == NULL) {
+		*len = 0;
+		return BITMAP_NONE;
+	}
+	while (t->child[BY_LEN][1] != NULL) t = t->child[BY_LEN][1];
+	*len = t->len;
+	return t->start;
+}
@@ -0,0 +1,62 @@
+/**
+ * CSC369 Assignment 1 - In-memory index of free data block runs.
+ *
+ * Every maximal run of unused bits in the data bitmap is kept in two balanced
+ * trees: one ordered by the first block of the run and one ordered by its
+ * length. This allows finding the lowest (first-fit) or the smallest
+ * (best-fit) run of at least n free blocks, or the largest free run, in
+ * O(log n) instead of scanning the bitmap. The index is built from the bitmap
+ * at mount time and must be told about every change made to the bitmap.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bitmap.h"
+
+
+/** Free block run index. */
+typedef struct free_index free_index;
+
+/**
+ * Build the index from the data bitmap of the image.
+ *
+ * @param image       pointer to the start of the image.
+ * @param num_blocks  number of bits in the data bitmap.
+ * @return            pointer to the index; NULL if out of memory.
+ */
+free_index *free_index_create(void *image, uint32_t num_blocks);
+
+/** Destroy the index and free all its memory. */
+void free_index_destroy(free_index *fi);
+
+/**
+ * Record that blocks [start, start + len) became free. None of them may be in
+ * the index already; adjacent runs are merged.
+ *
+ * @return  true on success; false if out of memory or some of the blocks are
+ *          already free.
+ */
+bool free_index_insert(free_index *fi, uint32_t start, uint32_t len);
+
+/**
+ * Record that blocks [start, start + len) became used. They must all belong to
+ * the same free run, which is split as needed.
+ *
+ * @return  true on success; false if out of memory or the blocks are not free.
+ */
+bool free_index_remove(free_index *fi, uint32_t start, uint32_t len);
+
+/** Return the first block of the lowest run of at least n free blocks that
+ * starts at or after from, or BITMAP_NONE if there is none. */
+uint32_t free_index_first_fit(const free_index *fi, uint32_t n, uint32_t from);
+
+/** Return the first block of the shortest run of at least n free blocks (the
+ * lowest one among equally long runs), or BITMAP_NONE if there is none. */
+uint32_t free_index_best_fit(const free_index *fi, uint32_t n);
+
+/** Return the first block of the longest free run and store its length in
+ * len, or return BITMAP_NONE (and set len to 0) if no block is free. */
+uint32_t free_index_largest(const free_index *fi, uint32_t *len);
@@ -16,7 +16,10 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <string.h>
+
 #include "fs_ctx.h"
+#include "util.h"
 
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
@@ -32,11 +35,43 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	// record the inumber of root node
 	fs->root_inum = 0;
 
+	// the allocator reads the inode bitmap a 64-bit word at a time, so the
+	// groups must start on word boundaries
+	if (fs->s->s_num_groups > 1 && fs->s->s_inodes_per_group % 64 != 0) return false;
+
+	// index the free runs of the data bitmap for contiguous allocation
+	fs->free_blks = free_index_create(image, fs->s->s_num_blocks);
+	if (fs->free_blks == NULL) return false;
+
+	// summarize the inode bitmap for fast free inode lookups
+	fs->free_inodes = bitmap_summary_create(image, LOOKUP_IB, fs->s->s_num_inodes);
+	if (fs->free_inodes == NULL) {
+		free_index_destroy(fs->free_blks);
+		fs->free_blks = NULL;
+		return false;
+	}
+
+	memset(&fs->da, 0, sizeof(fs->da));
+	pthread_rwlock_init(&fs->da.lock, NULL);
+	dcache_init(&fs->dc, DCACHE_DEFAULT_MAX);
+	fs->dcache_stats = false;
+	dir_hint_init(&fs->dh);
+	nlookup_init(&fs->nl);
+	pthread_mutex_init(&fs->alloc_lock, NULL);
+	fs->ext_gen = 0;
+
 	return true;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	//TODO: cleanup any resources allocated in fs_ctx_init()
-	(void)fs;
+	delalloc_destroy(fs);
+	dcache_destroy(&fs->dc);
+	dir_hint_destroy(&fs->dh);
+	nlookup_destroy(&fs->nl, NULL, NULL);
+	free_index_destroy(fs->free_blks);
+	fs->free_blks = NULL;
+	bitmap_summary_destroy(fs->free_inodes);
+	fs->free_inodes = NULL;
+	pthread_mutex_destroy(&fs->alloc_lock);
 }
@@ -18,10 +18,17 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 #include "a1fs.h"
+#include "free_index.h"
+#include "bitmap_summary.h"
+#include "delalloc.h"
+#include "dcache.h"
+#include "dir_hint.h"
+#include "nlookup.h"
 
 
 /**
@@ -40,6 +47,45 @@ typedef struct fs_ctx {
 
 	// root inumber
 	a1fs_ino_t root_inum;
+
+	/** Index of the free data block runs; NULL if not available. */
+	free_index *free_blks;
+
+	/** Summary of the free inodes in the inode bitmap; NULL if not available. */
+	bitmap_summary *free_inodes;
+
+	/** Where to look for free data blocks and inodes. */
+	a1fs_alloc_policy alloc_policy;
+
+	/** Where to place new inodes. */
+	a1fs_inode_placement inode_placement;
+
+	/** Buffered file data waiting for blocks to be allocated. */
+	delalloc da;
+
+	/** Cached lookups of names in directories. */
+	dcache dc;
+
+	/** Whether to print the hits and misses of dc on unmount. */
+	bool dcache_stats;
+
+	/** Where to look for a free entry in unindexed directories. */
+	dir_hints dh;
+
+	/** Lookup counts of the inodes known to the kernel. */
+	nlookups nl;
+
+	/** Incremented whenever data blocks are freed or change between written
+	 * and unwritten, which makes extent cursors taken before stale. Read and
+	 * written atomically, since cursors are checked without alloc_lock. */
+	uint64_t ext_gen;
+
+	/** Protects the free space: the bitmaps and their indexes, the free
+	 * counts in the superblock and group descriptors, where the next-fit
+	 * search continues, and the delayed allocation totals. Held, after the
+	 * locks of the inodes involved, around every step that may allocate or
+	 * free blocks or inodes, but not while file data is copied. */
+	pthread_mutex_t alloc_lock;
 } fs_ctx;
 
 /**
@@ -25,6 +25,8 @@
 #include <time.h>
 
 #include "a1fs.h"
+#include "bitmap.h"
+#include "extent_tree.h"
 #include "map.h"
 #include "util.h"
 
@@ -35,6 +37,12 @@ typedef struct mkfs_opts {
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Number of blocks in an allocation group. */
+	size_t blocks_per_group;
+	/** Size of an inode in bytes. */
+	size_t inode_size;
+	/** Store names in variable-length directory entries. */
+	bool dirent;
 
 	/** Print help and exit. */
 	bool help;
@@ -53,6 +61,12 @@ its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -g num  number of blocks per allocation group; must be a multiple of %d\n\
+            (default %d)\n\
+    -I num  inode size in bytes; a power of 2 from %d to %zu (default %d);\n\
+            larger inodes store more data of small files inline\n\
+    -d      variable-length directory entries; packs more short names\n\
+            into each directory block\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
@@ -60,16 +74,20 @@ Options:\n\
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, BITS_PER_BITMAP_BLK,
+	        A1FS_BLOCKS_PER_GROUP, A1FS_INODE_SIZE, A1FS_BLOCK_SIZE, A1FS_INODE_SIZE);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:g:I:dhfvz")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'g': opts->blocks_per_group = strtoul(optarg, NULL, 10); break;
+			case 'I': opts->inode_size = strtoul(optarg, NULL, 10); break;
+			case 'd': opts->dirent = true; break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
@@ -86,10 +104,24 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 	}
 	opts->img_path = argv[optind];
 
-	if (opts->n_inodes == 0) {
+	if (opts->n_inodes == 0 || opts->n_inodes > UINT32_MAX) {
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->blocks_per_group == 0) {
+		opts->blocks_per_group = A1FS_BLOCKS_PER_GROUP;
+	} else if (opts->blocks_per_group % BITS_PER_BITMAP_BLK != 0 ||
+	           opts->blocks_per_group > UINT32_MAX) {
+		fprintf(stderr, "Invalid number of blocks per group\n");
+		return false;
+	}
+	if (opts->inode_size == 0) {
+		opts->inode_size = A1FS_INODE_SIZE;
+	} else if (opts->inode_size < A1FS_INODE_SIZE || opts->inode_size > A1FS_BLOCK_SIZE ||
+	           !is_powerof2(opts->inode_size)) {
+		fprintf(stderr, "Invalid inode size\n");
+		return false;
+	}
 	return true;
 }
 
@@ -99,50 +131,64 @@ static bool a1fs_is_present(void *image)
 {
 	// check if the image already contains a valid a1fs superblock
 	a1fs_superblock *s = (a1fs_superblock *) image;
-	int is_valid = true;
 	if (s->magic != A1FS_MAGIC) {
-		is_valid = false;
+		return false;
 	} else if (IS_ZERO(s->size)) {
-		is_valid = false;
+		return false;
 	} else if (IS_ZERO(s->s_num_blocks)) {
-		is_valid = false;
+		return false;
 	} else if (IS_ZERO(s->s_num_inodes)) {
-		is_valid = false;
+		return false;
 	} else if (IS_ZERO(s->s_num_data_bitmaps)) {
-		is_valid = false;
+		return false;
 	} else if (IS_ZERO(s->s_num_inode_tables)) {
-		is_valid = false;
+		return false;
+	} else if (IS_ZERO(s->s_blocks_per_group) || IS_ZERO(s->s_inodes_per_group)) {
+		return false;
+	} else if (s->s_inode_size < A1FS_INODE_SIZE || s->s_inode_size > A1FS_BLOCK_SIZE ||
+	           !is_powerof2(s->s_inode_size)) {
+		return false;
 	}
-	unsigned int num_data_bitmaps = (uint32_t) CEIL_DIV(s->s_num_blocks, A1FS_BLOCK_SIZE);
-	if (num_data_bitmaps != s->s_num_data_bitmaps) {
-		is_valid = false;
+	if (s->s_num_blocks != s->size / A1FS_BLOCK_SIZE) {
+		return false;
 	}
-	unsigned int num_inode_tables = (uint32_t) CEIL_DIV(s->s_num_inodes * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
-	if (num_inode_tables != s->s_num_inode_tables) {
-		is_valid = false;
+	// check the group geometry
+	uint32_t num_groups = s->s_num_blocks / s->s_blocks_per_group;
+	if (IS_ZERO(num_groups)) num_groups = 1;
+	if (num_groups != s->s_num_groups) {
+		return false;
 	}
-	if (s->s_num_blocks != s->size / A1FS_BLOCK_SIZE) {
-		is_valid = false;
+	if ((uint64_t) s->s_inodes_per_group * num_groups != s->s_num_inodes) {
+		return false;
 	}
-	unsigned int num_inode_bitmaps = (uint32_t) CEIL_DIV(s->s_num_inodes, A1FS_BLOCK_SIZE);
+	unsigned int num_inode_bitmaps = (uint32_t) CEIL_DIV(s->s_inodes_per_group, BITS_PER_BITMAP_BLK);
 	if (num_inode_bitmaps != s->s_num_inode_bitmaps) {
-		is_valid = false;
+		return false;
 	}
-	// superblock + inode bitmap + num_data_bitmaps + inode_tables
-	unsigned int num_reserved_blk = 1 + num_inode_bitmaps + num_data_bitmaps + num_inode_tables;
-	if (num_reserved_blk != s->s_num_reserved_blocks) {
-		is_valid = false;
+	unsigned int num_inode_tables = (uint32_t) CEIL_DIV((uint64_t) s->s_inodes_per_group * s->s_inode_size, A1FS_BLOCK_SIZE);
+	if (num_inode_tables != s->s_num_inode_tables) {
+		return false;
+	}
+	unsigned int num_gdt_blks = (uint32_t) CEIL_DIV(num_groups * sizeof(a1fs_group_desc), A1FS_BLOCK_SIZE);
+	if (s->s_group_desc != 1 || num_gdt_blks != s->s_num_group_desc_blocks) {
+		return false;
 	}
 	// Check root
-	a1fs_inode *root = (a1fs_inode *) jump_to(image, s->s_inode_table, A1FS_BLOCK_SIZE);
+	a1fs_inode *root = get_inode_by_inumber(image, 0);
 	if (root->mode != (S_IFDIR | 0777)) {
-		is_valid = false;
+		return false;
 	}
-	a1fs_extent *root_extent = (a1fs_extent *) jump_to(image, root->i_ptr_extent, A1FS_BLOCK_SIZE);
-	if (root_extent->start == (a1fs_blk_t) -1) {
-		is_valid = false;
+	// a root directory compacted back into its inode has no blocks
+	if (is_inline(root)) {
+		return true;
 	}
-	return is_valid;
+	if (root->i_root.h_entries > extent_tree_root_capacity(image)) {
+		return false;
+	}
+	if (extent_tree_first(image, root) == NULL) {
+		return false;
+	}
+	return true;
 }
 
 
@@ -162,58 +208,111 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	// initialize the superblock and create an empty root directory
 	// NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
 	a1fs_superblock *s = get_superblock(image);
+	uint32_t num_blocks = size / A1FS_BLOCK_SIZE;	// this is equivalent to floor of size / 4K
+	uint32_t blocks_per_group = opts->blocks_per_group;
+	// the last group also takes the blocks that do not make up a whole group
+	uint32_t num_groups = num_blocks / blocks_per_group;
+	if (IS_ZERO(num_groups)) num_groups = 1;
+	uint32_t last_group_size = num_blocks - (num_groups - 1) * blocks_per_group;
+	// every group gets the same number of inodes, filling whole 64-bit words
+	// of the inode bitmap so that no word read by the allocator straddles two
+	// groups. A word holds a whole number of inode table blocks.
+	uint64_t inodes_per_group = align_up(CEIL_DIV(opts->n_inodes, num_groups), 64);
+	uint64_t num_inode_tables = inodes_per_group * opts->inode_size / A1FS_BLOCK_SIZE;
+	if (inodes_per_group * num_groups > UINT32_MAX || num_inode_tables > UINT16_MAX ||
+	    CEIL_DIV(last_group_size, BITS_PER_BITMAP_BLK) > UINT16_MAX) {
+		fprintf(stderr, "Too many inodes or blocks per group\n");
+		return false;
+	}
+
 	s->magic = A1FS_MAGIC;
 	s->size = size;
-	s->s_num_blocks = size / A1FS_BLOCK_SIZE;	// this is equivalent to floor of size / 4K
-	s->s_num_inodes = opts->n_inodes;
-	s->s_num_inode_tables = CEIL_DIV(opts->n_inodes * sizeof(a1fs_inode), A1FS_BLOCK_SIZE);
-	s->s_num_inode_bitmaps = CEIL_DIV(opts->n_inodes, A1FS_BLOCK_SIZE);
-	s->s_num_data_bitmaps = CEIL_DIV(s->s_num_blocks, A1FS_BLOCK_SIZE);
-	s->s_inode_bitmap = (a1fs_blk_t) 1;
-	s->s_data_bitmap = (a1fs_blk_t) (1 + s->s_num_inode_bitmaps);
-	s->s_inode_table = (a1fs_blk_t) (s->s_data_bitmap + s->s_num_data_bitmaps);
-	s->s_first_block = (a1fs_blk_t) (s->s_inode_table + s->s_num_inode_tables);
-	s->s_num_reserved_blocks = 1 + s->s_num_inode_bitmaps + s->s_num_data_bitmaps + s->s_num_inode_tables;
+	s->s_num_blocks = num_blocks;
+	s->s_num_inodes = inodes_per_group * num_groups;
+	s->s_num_inode_tables = num_inode_tables;
+	s->s_num_inode_bitmaps = CEIL_DIV(inodes_per_group, BITS_PER_BITMAP_BLK);
+	s->s_num_data_bitmaps = CEIL_DIV(num_groups > 1 ? blocks_per_group : num_blocks, BITS_PER_BITMAP_BLK);
+	s->s_blocks_per_group = blocks_per_group;
+	s->s_inodes_per_group = inodes_per_group;
+	s->s_num_groups = num_groups;
+	s->s_group_desc = (a1fs_blk_t) 1;
+	s->s_num_group_desc_blocks = CEIL_DIV(num_groups * sizeof(a1fs_group_desc), A1FS_BLOCK_SIZE);
+	s->s_num_reserved_blocks = 0;
 	s->s_num_free_inodes = s->s_num_inodes;
 	s->s_num_free_blocks = s->s_num_blocks;
+	s->s_next_block = 0;
+	s->s_next_inode = 0;
+	s->s_inode_size = opts->inode_size;
+	s->s_features = opts->dirent ? A1FS_FEATURE_DIRENT : 0;
+
+	// lay out the metadata at the start of each group
+	for (uint32_t group = 0; group < num_groups; group++) {
+		a1fs_group_desc *gd = get_group_desc(image, group);
+		a1fs_blk_t group_start = group * blocks_per_group;
+		a1fs_blk_t group_end = group_start + (group + 1 == num_groups ? last_group_size : blocks_per_group);
+		// group 0 also holds the superblock and the group descriptor table
+		a1fs_blk_t next = group_start;
+		if (group == 0) next += 1 + s->s_num_group_desc_blocks;
+		uint32_t num_data_bitmaps = CEIL_DIV(group_end - group_start, BITS_PER_BITMAP_BLK);
+		gd->g_inode_bitmap = next;
+		next += s->s_num_inode_bitmaps;
+		gd->g_data_bitmap = next;
+		next += num_data_bitmaps;
+		gd->g_inode_table = next;
+		next += s->s_num_inode_tables;
+		gd->g_first_block = next;
+		if (next >= group_end) {
+			fprintf(stderr, "Image is too small for %zu inodes\n", opts->n_inodes);
+			return false;
+		}
+		gd->g_num_free_inodes = inodes_per_group;
+		gd->g_num_free_blocks = group_end - group_start;
+		gd->g_num_dirs = 0;
+		s->s_num_reserved_blocks += next - group_start;
+
+		// init inode bitmap
+		for (a1fs_blk_t offset = 0; offset < s->s_num_inode_bitmaps; offset++) {
+			reset_bitmap((unsigned char *) jump_to(image, gd->g_inode_bitmap + offset, A1FS_BLOCK_SIZE));
+		}
+		// init data bitmap
+		for (a1fs_blk_t offset = 0; offset < num_data_bitmaps; offset++) {
+			reset_bitmap((unsigned char *) jump_to(image, gd->g_data_bitmap + offset, A1FS_BLOCK_SIZE));
+		}
+	}
+	a1fs_group_desc *first_group = get_group_desc(image, 0);
+	s->s_inode_bitmap = first_group->g_inode_bitmap;
+	s->s_data_bitmap = first_group->g_data_bitmap;
+	s->s_inode_table = first_group->g_inode_table;
+	s->s_first_block = first_group->g_first_block;
 
-	// init inode bitmap
-	unsigned char *bitmap;
-	for (a1fs_blk_t offset = 0; offset < s->s_num_data_bitmaps; offset++) {
-		bitmap = (unsigned char *) jump_to(image, s->s_data_bitmap + offset, A1FS_BLOCK_SIZE);
-		reset_bitmap(bitmap);
+	// there is no free block index while formatting; allocate from the bitmap
+	fs_ctx fs = { .image = image, .size = size, .s = s };
+	// reserve the metadata blocks of each group in data bitmap
+	mask_range(&fs, 0, first_group->g_first_block, LOOKUP_DB, true);
+	for (uint32_t group = 1; group < num_groups; group++) {
+		a1fs_group_desc *gd = get_group_desc(image, group);
+		mask_range(&fs, group * blocks_per_group, gd->g_first_block, LOOKUP_DB, true);
 	}
-	// init data bitmap
-	for (a1fs_blk_t offset = 0; offset < s->s_num_inode_bitmaps; offset++) {
-		bitmap = (unsigned char *) jump_to(image, s->s_inode_bitmap + offset, A1FS_BLOCK_SIZE);
-		reset_bitmap(bitmap);
-	}	
-	// reserve blocks in data bitmap
-	mask_range(image, 0, s->s_num_reserved_blocks, LOOKUP_DB, true);
 
 	// initialize root inode at inumber 0
-	a1fs_inode *root = (a1fs_inode *) jump_to(image, s->s_inode_table, A1FS_BLOCK_SIZE);
+	a1fs_inode *root = get_inode_by_inumber(image, 0);
+	memset(root, 0, s->s_inode_size);
 	root->mode = (mode_t) (S_IFDIR | 0777);
 	root->links = 2;
 	root->size = 0;
-	root->i_extents = 1;
+	root->i_extents = 0;
     clock_gettime(CLOCK_REALTIME, &(root->mtime));
-	// find the number of an unused data block to store extents
-	root->i_ptr_extent = (a1fs_blk_t) find_first_free_blk_num(image, LOOKUP_DB);
-	// format the block to extents
-	init_extent_blk(image, root->i_ptr_extent);
-	mask(image, root->i_ptr_extent, LOOKUP_DB, true);
-	// find an extent and a free block for directories
-	int extent_offset = find_first_empty_extent_offset(image, root->i_ptr_extent);
-	a1fs_extent * this_extent = (a1fs_extent *) jump_to(image, root->i_ptr_extent, A1FS_BLOCK_SIZE);
-	this_extent += extent_offset;
-	this_extent->start = find_first_free_blk_num(image, LOOKUP_DB);
-	this_extent->count = 1;
+	// the extents are kept in the inode
+	extent_tree_init(root);
+	// find a free block for directories and record it in the first extent
+	a1fs_blk_t dentry_blk = (a1fs_blk_t) find_first_free_blk_num(&fs, LOOKUP_DB);
 	// format to empty directory
-	init_directory_blk(image, this_extent->start);
-	mask(image, this_extent->start, LOOKUP_DB, true);
+	init_directory_blk(image, dentry_blk);
+	mask(&fs, dentry_blk, LOOKUP_DB, true);
+	append_extent(&fs, root, dentry_blk, 1);
 	// mark the first bit for root inode as used
-	mask(image, 0, LOOKUP_IB, true);
+	mask(&fs, 0, LOOKUP_IB, true);
+	first_group->g_num_dirs = 1;
 	return true;
 }
 
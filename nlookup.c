@@ -0,0 +1,181 @@
+/**
+ * CSC369 Assignment 1 - Lookup counts and locks of inodes in use
+ * implementation.
+ */
+
+#include <stdlib.h>
+
+#include "nlookup.h"
+
+
+/** Lock the mutex of the bucket of the inode. */
+static void lock_bucket(nlookups *nl, a1fs_ino_t ino)
+{
+	pthread_mutex_lock(&nl->locks[ino % NLOOKUP_BUCKETS % NLOOKUP_LOCKS]);
+}
+
+static void unlock_bucket(nlookups *nl, a1fs_ino_t ino)
+{
+	pthread_mutex_unlock(&nl->locks[ino % NLOOKUP_BUCKETS % NLOOKUP_LOCKS]);
+}
+
+/** Find the link to the entry of the inode in its bucket; the link holds NULL
+ * if there is none. */
+static nlookup **find_link(nlookups *nl, a1fs_ino_t ino)
+{
+	nlookup **link = &nl->buckets[ino % NLOOKUP_BUCKETS];
+	while (*link != NULL && (*link)->ino != ino) link = &(*link)->next;
+	return link;
+}
+
+/** Return the entry of the inode, adding an unused one if there is none;
+ * NULL if out of memory. The bucket must be locked. */
+static nlookup *get_entry(nlookups *nl, a1fs_ino_t ino)
+{
+	nlookup **link = find_link(nl, ino);
+	if (*link == NULL) {
+		nlookup *n = malloc(sizeof(nlookup));
+		if (n == NULL) return NULL;
+		n->ino = ino;
+		n->count = 0;
+		n->users = 0;
+		pthread_rwlock_init(&n->lock, NULL);
+		// the file may have buffered data from before it was forgotten
+		n->buffered = true;
+		n->next = NULL;
+		*link = n;
+	}
+	return *link;
+}
+
+/** Free the entry at link if it is neither counted nor used. The bucket must
+ * be locked. */
+static void put_entry(nlookup **link)
+{
+	nlookup *n = *link;
+	if (n != NULL && n->count == 0 && n->users == 0) {
+		*link = n->next;
+		pthread_rwlock_destroy(&n->lock);
+		free(n);
+	}
+}
+
+void nlookup_init(nlookups *nl)
+{
+	for (int i = 0; i < NLOOKUP_BUCKETS; i++) nl->buckets[i] = NULL;
+	for (int i = 0; i < NLOOKUP_LOCKS; i++) pthread_mutex_init(&nl->locks[i], NULL);
+}
+
+bool nlookup_get(nlookups *nl, a1fs_ino_t ino)
+{
+	lock_bucket(nl, ino);
+	nlookup *n = get_entry(nl, ino);
+	if (n != NULL) n->count++;
+	unlock_bucket(nl, ino);
+	return n != NULL;
+}
+
+uint64_t nlookup_put(nlookups *nl, a1fs_ino_t ino, uint64_t n)
+{
+	lock_bucket(nl, ino);
+	nlookup **link = find_link(nl, ino);
+	uint64_t count = 0;
+	if (*link != NULL) {
+		nlookup *c = *link;
+		c->count = c->count > n ? c->count - n : 0;
+		count = c->count;
+		put_entry(link);
+	}
+	unlock_bucket(nl, ino);
+	return count;
+}
+
+uint64_t nlookup_count(nlookups *nl, a1fs_ino_t ino)
+{
+	lock_bucket(nl, ino);
+	nlookup *c = *find_link(nl, ino);
+	uint64_t count = c != NULL ? c->count : 0;
+	unlock_bucket(nl, ino);
+	return count;
+}
+
+/** Return the entry of the inode with one more user; NULL if out of memory. */
+static nlookup *use_entry(nlookups *nl, a1fs_ino_t ino)
+{
+	lock_bucket(nl, ino);
+	nlookup *n = get_entry(nl, ino);
+	if (n != NULL) n->users++;
+	unlock_bucket(nl, ino);
+	return n;
+}
+
+/** Drop a user of the entry, freeing it if it is not needed any more. */
+static void unuse_entry(nlookups *nl, nlookup *n)
+{
+	a1fs_ino_t ino = n->ino;
+	lock_bucket(nl, ino);
+	n->users--;
+	put_entry(find_link(nl, ino));
+	unlock_bucket(nl, ino);
+}
+
+nlookup *nlookup_lock(nlookups *nl, a1fs_ino_t ino, bool write)
+{
+	nlookup *n = use_entry(nl, ino);
+	if (n != NULL) nlookup_lock_pinned(n, write);
+	return n;
+}
+
+nlookup *nlookup_trylock(nlookups *nl, a1fs_ino_t ino)
+{
+	nlookup *n = use_entry(nl, ino);
+	if (n == NULL) return NULL;
+	if (pthread_rwlock_trywrlock(&n->lock) != 0) {
+		unuse_entry(nl, n);
+		return NULL;
+	}
+	return n;
+}
+
+void nlookup_unlock(nlookups *nl, nlookup *n)
+{
+	pthread_rwlock_unlock(&n->lock);
+	unuse_entry(nl, n);
+}
+
+nlookup *nlookup_pin(nlookups *nl, a1fs_ino_t ino)
+{
+	return use_entry(nl, ino);
+}
+
+void nlookup_unpin(nlookups *nl, nlookup *n)
+{
+	unuse_entry(nl, n);
+}
+
+void nlookup_lock_pinned(nlookup *n, bool write)
+{
+	if (write) {
+		pthread_rwlock_wrlock(&n->lock);
+	} else {
+		pthread_rwlock_rdlock(&n->lock);
+	}
+}
+
+void nlookup_unlock_pinned(nlookup *n)
+{
+	pthread_rwlock_unlock(&n->lock);
+}
+
+void nlookup_destroy(nlookups *nl, void (*fn)(void *arg, a1fs_ino_t ino), void *arg)
+{
+	for (int i = 0; i < NLOOKUP_BUCKETS; i++) {
+		while (nl->buckets[i] != NULL) {
+			nlookup *c = nl->buckets[i];
+			nl->buckets[i] = c->next;
+			if (fn != NULL) fn(arg, c->ino);
+			pthread_rwlock_destroy(&c->lock);
+			free(c);
+		}
+	}
+}
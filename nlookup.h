@@ -0,0 +1,105 @@
+/**
+ * CSC369 Assignment 1 - Lookup counts and locks of inodes in use.
+ *
+ * With the FUSE low-level API, the kernel refers to files by inode number.
+ * Every inode it is handed by lookup(), create() or mkdir() is counted, and
+ * forget() drops the count once the kernel no longer refers to the inode.
+ * A file or directory removed while the kernel still knows it is only
+ * unlinked, with no links left, and is freed when its count drops to 0; this
+ * is what lets a file that is still open keep its data after unlink(). Only
+ * inodes the kernel knows take memory.
+ *
+ * The entry of an inode also holds its reader/writer lock. Callbacks lock the
+ * inodes they use with nlookup_lock(), which keeps the entry while it is
+ * locked even if the kernel forgets the inode meanwhile. A directory is
+ * locked before the inodes in it, so locking a parent and then a child never
+ * deadlocks. An open file pins its entry with nlookup_pin(), so that reads and
+ * writes through it lock the entry directly, without the bucket mutexes.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+
+/** Number of hash buckets of the lookup count table. */
+#define NLOOKUP_BUCKETS 4096
+
+/** Number of mutexes protecting the buckets; bucket i belongs to mutex
+ * i % NLOOKUP_LOCKS. */
+#define NLOOKUP_LOCKS 64
+
+/** The lookup count and the lock of an inode. */
+typedef struct nlookup {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** Number of times the inode was handed to the kernel and not forgotten. */
+	uint64_t count;
+	/** Number of callbacks holding or waiting for the lock, and of open files
+	 * pinning the entry. */
+	uint32_t users;
+	/** Held for reading to read the inode, its blocks and its buffered data,
+	 * and for writing to change them; for a directory, also its entries. */
+	pthread_rwlock_t lock;
+	/** False if the file is known to have no buffered data, so that reads
+	 * need not look for it in fs->da. Set with the inode locked for writing
+	 * by writes that buffer data, cleared with the inode locked by whoever
+	 * finds no buffer, and set in new entries. Accessed atomically. */
+	bool buffered;
+	/** Next count in the same hash bucket. */
+	struct nlookup *next;
+
+} nlookup;
+
+/** Lookup counts of all inodes known to the kernel. */
+typedef struct nlookups {
+	/** Counts hashed by inode number. */
+	nlookup *buckets[NLOOKUP_BUCKETS];
+	/** Protect the buckets and the count and users of their entries. */
+	pthread_mutex_t locks[NLOOKUP_LOCKS];
+
+} nlookups;
+
+/** Make the table empty. */
+void nlookup_init(nlookups *nl);
+
+/** Count one more reference to the inode. Return false if out of memory. */
+bool nlookup_get(nlookups *nl, a1fs_ino_t ino);
+
+/** Drop n references to the inode and return the number left. */
+uint64_t nlookup_put(nlookups *nl, a1fs_ino_t ino, uint64_t n);
+
+/** Return the number of references to the inode. */
+uint64_t nlookup_count(nlookups *nl, a1fs_ino_t ino);
+
+/** Lock the inode for reading or writing. Return its entry, to be passed to
+ * nlookup_unlock(); NULL if out of memory. */
+nlookup *nlookup_lock(nlookups *nl, a1fs_ino_t ino, bool write);
+
+/** Like nlookup_lock() for writing, but return NULL at once if the inode is
+ * locked. */
+nlookup *nlookup_trylock(nlookups *nl, a1fs_ino_t ino);
+
+/** Unlock the inode locked with nlookup_lock() or nlookup_trylock(). */
+void nlookup_unlock(nlookups *nl, nlookup *n);
+
+/** Keep the entry of the inode until nlookup_unpin(), e.g. while the file is
+ * open. Return the entry; NULL if out of memory. */
+nlookup *nlookup_pin(nlookups *nl, a1fs_ino_t ino);
+
+/** Release the entry pinned with nlookup_pin(). */
+void nlookup_unpin(nlookups *nl, nlookup *n);
+
+/** Lock the inode of the pinned entry for reading or writing. */
+void nlookup_lock_pinned(nlookup *n, bool write);
+
+/** Unlock the inode locked with nlookup_lock_pinned(). */
+void nlookup_unlock_pinned(nlookup *n);
+
+/** Drop all counts, calling fn(arg, ino) for each inode that had one unless
+ * fn is NULL. No inode may be locked. */
+void nlookup_destroy(nlookups *nl, void (*fn)(void *arg, a1fs_ino_t ino), void *arg);
@@ -18,8 +18,10 @@
 
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "dcache.h"
 #include "options.h"
 
 
@@ -31,6 +33,10 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("alloc=%s", alloc),
+	A1FS_OPT("placement=%s", placement),
+	A1FS_OPT("dcache=%s", dcache),
+	A1FS_OPT("dcache_stats", dcache_stats),
 	FUSE_OPT_END
 };
 
@@ -38,11 +44,23 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are handled by several threads unless -s is given.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
+    -s                     single-threaded operation\n\
+\n\
+a1fs options:\n\
+    -o alloc=POLICY        where to allocate blocks and inodes: first (lowest\n\
+                           free near the parent/file; default), next (after\n\
+                           the last allocation) or best (smallest free run)\n\
+    -o placement=POLICY    where to place new inodes: orlov (spread out\n\
+                           directories, files near their parent; default) or\n\
+                           linear (lowest free inode)\n\
+    -o dcache=N            number of directory lookups to cache (default\n\
+                           %d; 0 disables the cache)\n\
+    -o dcache_stats        print the lookup cache hits and misses on unmount\n\
 \n\
 ";
 
@@ -66,21 +84,54 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
-		fprintf(stderr, help_str, args->argv[0]);
+		fprintf(stderr, help_str, args->argv[0], DCACHE_DEFAULT_MAX);
 		fuse_opt_add_arg(args, "-ho");
 	}
 	if (!opts->help && !opts->img_path) {
 		fprintf(stderr, "Missing image path\n");
 		return false;
 	}
+	if (opts->alloc == NULL || strcmp(opts->alloc, "first") == 0) {
+		opts->alloc_policy = A1FS_ALLOC_FIRST_FIT;
+	} else if (strcmp(opts->alloc, "next") == 0) {
+		opts->alloc_policy = A1FS_ALLOC_NEXT_FIT;
+	} else if (strcmp(opts->alloc, "best") == 0) {
+		opts->alloc_policy = A1FS_ALLOC_BEST_FIT;
+	} else {
+		fprintf(stderr, "Invalid allocation policy: %s\n", opts->alloc);
+		return false;
+	}
+	if (opts->placement == NULL || strcmp(opts->placement, "orlov") == 0) {
+		opts->inode_placement = A1FS_PLACE_ORLOV;
+	} else if (strcmp(opts->placement, "linear") == 0) {
+		opts->inode_placement = A1FS_PLACE_LINEAR;
+	} else {
+		fprintf(stderr, "Invalid inode placement: %s\n", opts->placement);
+		return false;
+	}
+	if (opts->dcache == NULL) {
+		opts->dcache_max = DCACHE_DEFAULT_MAX;
+	} else {
+		char *end;
+		opts->dcache_max = strtoul(opts->dcache, &end, 10);
+		if (*opts->dcache == '\0' || *end != '\0') {
+			fprintf(stderr, "Invalid lookup cache size: %s\n", opts->dcache);
+			return false;
+		}
+	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
-	// Limit the size of reads and writes to 4K
+	// Take reads and writes of up to 128K, the most the kernel sends in one
+	// request, instead of splitting them into pages
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "max_read=131072");
+	fuse_opt_add_arg(args, "-o");
+	fuse_opt_add_arg(args, "max_write=131072");
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_read=4096");
+	fuse_opt_add_arg(args, "big_writes");
+	// Read replies point into the image; with splice, the kernel copies them
+	// from there instead of libfuse gathering them into one buffer first
 	fuse_opt_add_arg(args, "-o");
-	fuse_opt_add_arg(args, "max_write=4096");
+	fuse_opt_add_arg(args, "splice_write");
 
 	return true;
 }
@@ -23,12 +23,44 @@
 #include <fuse_opt.h>
 
 
+/** Where to look for free data blocks and inodes. */
+typedef enum a1fs_alloc_policy {
+	/** Lowest free run at or after the locality goal (default). */
+	A1FS_ALLOC_FIRST_FIT,
+	/** Continue from where the last allocation ended, wrapping around. */
+	A1FS_ALLOC_NEXT_FIT,
+	/** Shortest free run of data blocks that fits. */
+	A1FS_ALLOC_BEST_FIT,
+} a1fs_alloc_policy;
+
+/** Where to place new inodes in the inode table. */
+typedef enum a1fs_inode_placement {
+	/** Spread directories out, keep files near their parent (default). */
+	A1FS_PLACE_ORLOV,
+	/** Lowest free inode in the parent's group. */
+	A1FS_PLACE_LINEAR,
+} a1fs_inode_placement;
+
 /** a1fs command line options. */
 typedef struct a1fs_opts {
 	/** a1fs image file path. */
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Value of the alloc= mount option. */
+	char *alloc;
+	/** Allocation policy selected by the alloc= mount option. */
+	a1fs_alloc_policy alloc_policy;
+	/** Value of the placement= mount option. */
+	char *placement;
+	/** Inode placement selected by the placement= mount option. */
+	a1fs_inode_placement inode_placement;
+	/** Value of the dcache= mount option. */
+	char *dcache;
+	/** Maximum number of cached lookups selected by the dcache= mount option. */
+	size_t dcache_max;
+	/** Print lookup cache statistics on unmount. dcache_stats mount option. */
+	int dcache_stats;
 
 } a1fs_opts;
 
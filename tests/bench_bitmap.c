@@ -0,0 +1,143 @@
+/**
+ * CSC369 Assignment 1 - Benchmark of the bitmap scan and range masking.
+ *
+ * Marks all data blocks of the image used except the last few, then finds the
+ * first free block with bitmap_find_zero() and with a loop over is_used_bit(),
+ * the per-bit scan that find_first_free_blk_num() used to do. Then allocates
+ * and frees again all the free blocks with one mask_range() call and with a
+ * loop of mask() calls. The bitmaps of the image are overwritten, so it must be a
+ * scratch image made by mkfs.a1fs.
+ *
+ * Usage: bench_bitmap image [free_blocks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "map.h"
+#include "test.h"
+#include "util.h"
+
+
+/** Set or clear a bit of the data bitmap, leaving the free counters as they are. */
+static void set_bit(void *image, uint32_t bit, bool on)
+{
+	uint32_t first_bit, num_bits;
+	unsigned char *bitmap = get_bitmap_blk(image, LOOKUP_DB, bit, &first_bit, &num_bits);
+	uint32_t i = bit - first_bit;
+	if (on) bitmap[i / 8] |= 1 << (i % 8);
+	else bitmap[i / 8] &= ~(1 << (i % 8));
+}
+
+/** Find the first unused bit of the data bitmap one bit at a time. */
+static uint32_t scan_per_bit(void *image, uint32_t n)
+{
+	for (uint32_t bit = 0; bit < n; bit++) {
+		if (!is_used_bit(image, bit, LOOKUP_DB)) return bit;
+	}
+	return BITMAP_NONE;
+}
+
+/** Find the first unused bit of the data bitmap a word at a time. */
+static uint32_t scan_words(void *image, uint32_t n)
+{
+	return bitmap_find_zero(image, LOOKUP_DB, 0, n);
+}
+
+/**
+ * Run the scan for at least half a second, checking that it finds the
+ * expected bit.
+ *
+ * @return  average time of a scan in nanoseconds.
+ */
+static double time_scan(uint32_t (*scan)(void *, uint32_t), void *image,
+                        uint32_t n, uint32_t expected)
+{
+	uint64_t start = now_ns(), elapsed;
+	uint64_t runs = 0;
+	do {
+		if (scan(image, n) != expected) {
+			fprintf(stderr, "Scan found the wrong block\n");
+			exit(1);
+		}
+		runs++;
+		elapsed = now_ns() - start;
+	} while (elapsed < 500000000);
+	return (double)elapsed / runs;
+}
+
+/**
+ * Allocate and free again blocks [start, end) of the data bitmap for at least
+ * half a second, either with mask_range() or one bit at a time with mask().
+ *
+ * @return  average time of allocating and freeing the range in nanoseconds.
+ */
+static double time_mask(fs_ctx *fs, uint32_t start, uint32_t end, bool per_bit)
+{
+	uint32_t free_blocks = fs->s->s_num_free_blocks;
+	uint64_t begin = now_ns(), elapsed;
+	uint64_t runs = 0;
+	do {
+		for (int on = 1; on >= 0; on--) {
+			if (per_bit) {
+				for (uint32_t bit = start; bit < end; bit++) mask(fs, bit, LOOKUP_DB, on);
+			} else {
+				mask_range(fs, start, end, LOOKUP_DB, on);
+			}
+		}
+		runs++;
+		elapsed = now_ns() - begin;
+	} while (elapsed < 500000000);
+	if (fs->s->s_num_free_blocks != free_blocks) {
+		fprintf(stderr, "Masking changed the free block count\n");
+		exit(1);
+	}
+	return (double)elapsed / runs;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [free_blocks]\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+
+	uint32_t n = get_superblock(image)->s_num_blocks;
+	uint32_t free_blks = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+	if (free_blks == 0 || free_blks > n) free_blks = n;
+	uint32_t used_end = n - free_blks;
+	for (uint32_t bit = 0; bit < n; bit++) set_bit(image, bit, bit < used_end);
+
+	double per_bit = time_scan(scan_per_bit, image, n, used_end);
+	double words = time_scan(scan_words, image, n, used_end);
+	const char *word_scan = "word scan:";
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(A1FS_NO_SIMD)
+	if (__builtin_cpu_supports("avx2")) word_scan = "word scan (AVX2):";
+#endif
+	printf("first free block of %u (%u free at the end)\n", n, free_blks);
+	printf("  %-18s %12.0f ns\n", "per-bit scan:", per_bit);
+	printf("  %-18s %12.0f ns  (%.0fx faster)\n", word_scan, words, per_bit / words);
+
+	// the counters must match the bitmap for mask() to keep them right
+	fs_ctx fs = { .image = image, .size = size, .s = get_superblock(image) };
+	uint32_t used = 0;
+	for (uint32_t bit = 0; bit < n; bit++) used += is_used_bit(image, bit, LOOKUP_DB);
+	fs.s->s_num_free_blocks = n - used;
+	for (uint32_t g = 0; g < fs.s->s_num_groups; g++) {
+		a1fs_group_desc *gd = get_group_desc(image, g);
+		uint32_t end = get_group_end_bit(image, g, LOOKUP_DB);
+		uint32_t first = get_group_first_bit(image, g, LOOKUP_DB);
+		gd->g_num_free_blocks = 0;
+		for (uint32_t bit = first; bit < end; bit++) gd->g_num_free_blocks += !is_used_bit(image, bit, LOOKUP_DB);
+	}
+	double mask_per_bit = time_mask(&fs, used_end, n, true);
+	double mask_words = time_mask(&fs, used_end, n, false);
+	printf("allocate and free %u blocks\n", free_blks);
+	printf("  %-18s %12.0f ns\n", "mask() per bit:", mask_per_bit);
+	printf("  %-18s %12.0f ns  (%.0fx faster)\n", "mask_range():", mask_words, mask_per_bit / mask_words);
+	return 0;
+}
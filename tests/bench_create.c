@@ -0,0 +1,123 @@
+/**
+ * CSC369 Assignment 1 - Benchmark of file creation in large directories.
+ *
+ * Creates 10k, 100k and 1M empty files in a new directory each and reports
+ * the creation rate over the first and the last tenth of each directory,
+ * which stay about the same when adding a name does not depend on the size
+ * of the directory. The directories are indexed, the way a1fs makes them
+ * ("index"), or grown block by block without an index, the way directories
+ * made by older versions or whose index could not be built are, with the hint
+ * to their first block with room ("linear") or with the hint dropped before
+ * each name, which searches every block ("scan"). The image is overwritten,
+ * so it must be a scratch image made by mkfs.a1fs.
+ *
+ * Usage: bench_create image [index|linear|scan] [num_files...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent_tree.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "test.h"
+#include "util.h"
+
+
+/** How directories are grown. */
+typedef enum mode { MODE_INDEX, MODE_LINEAR, MODE_SCAN } mode;
+
+static const char *mode_names[] = { "index", "linear", "scan" };
+
+/** Find a free entry for the name in the directory, adding a dentry block
+ * without building an index in the linear modes. */
+static a1fs_dentry *find_entry(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, mode m)
+{
+	if (m == MODE_INDEX) return alloc_dentry(fs, dir_inum, name, 1);
+	if (m == MODE_SCAN) dir_hint_set(&fs->dh, dir_inum, 0);
+	a1fs_dentry *dentry = add_dentry_in_dir(fs, dir_inum, name);
+	if (dentry != NULL) return dentry;
+	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+	if (is_inline(dir_ino) && uninline_file(fs, dir_ino) != 0) return NULL;
+	a1fs_blk_t lblk = count_file_blks(fs->image, dir_ino);
+	if (alloc_file_range(fs, dir_ino, lblk, 1, false) != 0) return NULL;
+	init_directory_blk(fs->image, find_blk_given_offset(fs->image, dir_ino, lblk));
+	return add_dentry_in_dir(fs, dir_inum, name);
+}
+
+/** Create the directory or empty file called name in the directory. */
+static a1fs_ino_t create(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, bool is_dir, mode m)
+{
+	a1fs_dentry *dentry = find_entry(fs, dir_inum, name, is_dir ? MODE_INDEX : m);
+	if (dentry == NULL || !has_n_free_blk(fs, 1, LOOKUP_IB)) {
+		fprintf(stderr, "Out of space creating %s\n", name);
+		exit(1);
+	}
+	if (is_dir) {
+		create_new_dir_in_dentry(fs, dir_inum, dentry, S_IFDIR | 0777);
+		get_inode_by_inumber(fs->image, dir_inum)->links++;
+	} else {
+		create_new_file_in_dentry(fs, dir_inum, dentry, S_IFREG | 0666);
+	}
+	return dentry->ino;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [index|linear|scan] [num_files...]\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+	mode m = MODE_INDEX;
+	for (int i = 0; argc > 2 && i < 3; i++) {
+		if (strcmp(argv[2], mode_names[i]) == 0) m = i;
+	}
+	uint32_t default_counts[] = { 10000, 100000, 1000000 };
+	int num_counts = argc > 3 ? argc - 3 : 3;
+
+	char name[A1FS_NAME_MAX];
+	for (int c = 0; c < num_counts; c++) {
+		uint32_t num_files = argc > 3 ? strtoul(argv[3 + c], NULL, 10) : default_counts[c];
+		snprintf(name, sizeof(name), "dir%d", c);
+		a1fs_ino_t dir_inum = create(&fs, fs.root_inum, name, true, m);
+
+		// time the first and the last tenth of the names separately
+		uint64_t start = now_ns(), first_end = 0, last_start = 0;
+		uint32_t tenth = num_files / 10 > 0 ? num_files / 10 : 1;
+		for (uint32_t i = 0; i < num_files; i++) {
+			if (i == tenth) first_end = now_ns();
+			if (i == num_files - tenth) last_start = now_ns();
+			snprintf(name, sizeof(name), "file-%u", i);
+			create(&fs, dir_inum, name, false, m);
+		}
+		uint64_t end = now_ns();
+		if (first_end == 0) first_end = end;
+		if (last_start == 0) last_start = start;
+
+		// every name can be found
+		a1fs_inode *dir_ino = get_inode_by_inumber(fs.image, dir_inum);
+		for (uint32_t i = 0; i < num_files; i += num_files / 1000 + 1) {
+			snprintf(name, sizeof(name), "file-%u", i);
+			if (find_dentry_in_dir(fs.image, dir_ino, name) == NULL) {
+				fprintf(stderr, "%s not found\n", name);
+				return 1;
+			}
+		}
+		a1fs_extent *last = extent_tree_find(fs.image, dir_ino, A1FS_DIR_INDEX_BLK - 1);
+		printf("%s: %u files in %.2f s (%.0f/s; first tenth %.0f/s, last tenth %.0f/s), %u dentry blocks\n",
+		       mode_names[m], num_files, (end - start) / 1e9, num_files / ((end - start) / 1e9),
+		       tenth / ((first_end - start) / 1e9), tenth / ((end - last_start) / 1e9),
+		       last != NULL ? last->logical + ext_len(last) : 0);
+	}
+	fs_ctx_destroy(&fs);
+	return 0;
+}
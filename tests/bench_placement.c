@@ -0,0 +1,154 @@
+/**
+ * CSC369 Assignment 1 - Benchmark of inode placement.
+ *
+ * Builds a tree of directories and creates files in them round-robin, the way
+ * several processes untarring or compiling at once would, then unlinks a
+ * quarter of the files and creates as many again. Then walks every directory
+ * like readdir followed by a stat of each entry and counts the distinct
+ * inode table blocks (pages) touched. The image is overwritten, so it must be
+ * a scratch image made by mkfs.a1fs.
+ *
+ * Usage: bench_placement image [orlov|linear] [num_files] [files_per_dir]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_ctx.h"
+#include "map.h"
+#include "test.h"
+#include "util.h"
+
+
+/** Number of directories at the top of the tree. */
+#define TOP_DIRS 10
+
+/** Create a directory or a file called name in the directory. */
+static a1fs_ino_t create(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, bool is_dir)
+{
+	a1fs_dentry *dentry = alloc_dentry(fs, dir_inum, name, is_dir ? 2 : 1);
+	if (dentry == NULL || !has_n_free_blk(fs, 1, LOOKUP_IB)) {
+		fprintf(stderr, "Out of space creating %s\n", name);
+		exit(1);
+	}
+	if (is_dir) {
+		create_new_dir_in_dentry(fs, dir_inum, dentry, S_IFDIR | 0777);
+		get_inode_by_inumber(fs->image, dir_inum)->links++;
+	} else {
+		create_new_file_in_dentry(fs, dir_inum, dentry, S_IFREG | 0666);
+	}
+	return dentry->ino;
+}
+
+/** Unlink the file called name from the directory. */
+static void unlink_file(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name)
+{
+	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+	a1fs_dentry *dentry = find_dentry_in_dir(fs->image, dir_ino, name);
+	a1fs_inode *file_ino = get_inode_by_inumber(fs->image, dentry->ino);
+	free_dentry_blks(fs, file_ino);
+	free_extent_blk(fs, file_ino);
+	mask(fs, dentry->ino, LOOKUP_IB, false);
+	free_dentry(fs, dir_inum, dentry);
+}
+
+static int cmp_blk(const void *a, const void *b)
+{
+	a1fs_blk_t x = *(const a1fs_blk_t *)a, y = *(const a1fs_blk_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * List the directory and look up the inode of every entry.
+ *
+ * @param blks     scratch array large enough for one block per entry.
+ * @param entries  incremented by the number of entries.
+ * @return         number of distinct inode table blocks touched.
+ */
+static uint32_t walk_dir(fs_ctx *fs, a1fs_ino_t dir_inum, a1fs_blk_t *blks, uint32_t *entries)
+{
+	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+	uint32_t n = 0;
+	dir_iter it;
+	dir_iter_init(&it, dir_ino);
+	for (a1fs_dentry *d; (d = dir_iter_next(fs->image, &it)) != NULL;) {
+		if (d->ino == (a1fs_ino_t) -1) continue;
+		a1fs_inode *ino = get_inode_by_inumber(fs->image, d->ino);
+		blks[n++] = ((char *)ino - (char *)fs->image) / A1FS_BLOCK_SIZE;
+	}
+	*entries += n;
+	qsort(blks, n, sizeof(a1fs_blk_t), cmp_blk);
+	uint32_t pages = 0;
+	for (uint32_t i = 0; i < n; i++) pages += i == 0 || blks[i] != blks[i - 1];
+	return pages;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [orlov|linear] [num_files] [files_per_dir]\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+	bool linear = argc > 2 && strcmp(argv[2], "linear") == 0;
+	fs.inode_placement = linear ? A1FS_PLACE_LINEAR : A1FS_PLACE_ORLOV;
+	uint32_t num_files = argc > 3 ? strtoul(argv[3], NULL, 10) : 100000;
+	uint32_t per_dir = argc > 4 ? strtoul(argv[4], NULL, 10) : 100;
+	if (per_dir == 0) per_dir = 1;
+	uint32_t num_dirs = CEIL_DIV(num_files, per_dir);
+
+	uint64_t start = now_ns();
+	char name[A1FS_NAME_MAX];
+	a1fs_ino_t top[TOP_DIRS];
+	for (uint32_t t = 0; t < TOP_DIRS; t++) {
+		snprintf(name, sizeof(name), "top%u", t);
+		top[t] = create(&fs, fs.root_inum, name, true);
+	}
+	a1fs_ino_t *dirs = malloc(num_dirs * sizeof(a1fs_ino_t));
+	uint32_t *next_name = calloc(num_dirs, sizeof(uint32_t));
+	a1fs_blk_t *blks = malloc(2 * (per_dir + 1) * sizeof(a1fs_blk_t));
+	if (dirs == NULL || next_name == NULL || blks == NULL) return 1;
+	for (uint32_t d = 0; d < num_dirs; d++) {
+		snprintf(name, sizeof(name), "dir%u", d);
+		dirs[d] = create(&fs, top[d % TOP_DIRS], name, true);
+	}
+
+	// round-robin over the directories, like parallel writers would
+	for (uint32_t i = 0; i < num_files; i++) {
+		uint32_t d = i % num_dirs;
+		snprintf(name, sizeof(name), "f%u", next_name[d]++);
+		create(&fs, dirs[d], name, false);
+	}
+	uint32_t churn = 0;
+	for (uint32_t d = 0; d < num_dirs; d++) {
+		for (uint32_t f = 0; f < next_name[d]; f += 4) {
+			snprintf(name, sizeof(name), "f%u", f);
+			unlink_file(&fs, dirs[d], name);
+			churn++;
+		}
+	}
+	for (uint32_t i = 0; i < churn; i++) {
+		uint32_t d = i % num_dirs;
+		snprintf(name, sizeof(name), "f%u", next_name[d]++);
+		create(&fs, dirs[d], name, false);
+	}
+	double build = (now_ns() - start) / 1e9;
+
+	uint32_t pages = 0, entries = 0;
+	for (uint32_t d = 0; d < num_dirs; d++) pages += walk_dir(&fs, dirs[d], blks, &entries);
+
+	printf("%s placement: %u files in %u directories (%u unlinked and recreated), built in %.2f s\n",
+	       linear ? "linear" : "orlov", num_files, num_dirs, churn, build);
+	printf("  readdir+stat: %u inode table pages touched (%.1f per directory, %.1f entries per page)\n",
+	       pages, (double)pages / num_dirs, (double)entries / pages);
+	fs_ctx_destroy(&fs);
+	return 0;
+}
@@ -0,0 +1,533 @@
+/**
+ * CSC369 Assignment 1 - Stress test of the driver run by several threads.
+ *
+ * Calls the low-level callbacks of a1fs.c from several threads at once, the
+ * way the multithreaded FUSE session loop does. Each thread creates, appends
+ * to, reads back, overwrites, lists and removes files in a directory of its own and in
+ * one shared by all, and looks up and reads the files of another thread in
+ * the shared directory while that thread writes or removes them. Afterwards
+ * the files left must hold exactly what was written to them, and once they
+ * are removed the free block and inode counts must be back where they
+ * started and match the bitmaps. Then the time to read one file from one
+ * thread and from all of them at once is reported. The image is overwritten,
+ * so it must be a scratch image made by mkfs.a1fs.
+ *
+ * Usage: stress_mt image [num_threads] [num_rounds]
+ */
+
+#define main a1fs_main
+#include "../a1fs.c"
+#undef main
+
+#include <stdio.h>
+
+#include "test.h"
+
+
+/** A request, which records the reply of the callback it is passed to. */
+struct fuse_req {
+	fs_ctx *fs;
+	/** 0 for any reply other than an error. */
+	int err;
+	struct fuse_entry_param e;
+	struct fuse_file_info fi;
+	struct stat attr;
+	size_t count;
+	/** Buffer that receives data replies, its size and the bytes replied. */
+	char *buf;
+	size_t size;
+};
+
+int fuse_reply_err(fuse_req_t req, int err)
+{
+	req->err = err;
+	return 0;
+}
+
+void fuse_reply_none(fuse_req_t req)
+{
+	req->err = 0;
+}
+
+int fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+	req->err = 0;
+	req->e = *e;
+	return 0;
+}
+
+int fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e, const struct fuse_file_info *fi)
+{
+	req->err = 0;
+	req->e = *e;
+	req->fi = *fi;
+	return 0;
+}
+
+int fuse_reply_attr(fuse_req_t req, const struct stat *attr, double attr_timeout)
+{
+	(void)attr_timeout;
+	req->err = 0;
+	req->attr = *attr;
+	return 0;
+}
+
+int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+	req->err = 0;
+	req->fi = *fi;
+	return 0;
+}
+
+int fuse_reply_write(fuse_req_t req, size_t count)
+{
+	req->err = 0;
+	req->count = count;
+	return 0;
+}
+
+int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+	assert(size <= req->size);
+	req->err = 0;
+	memcpy(req->buf, buf, size);
+	req->size = size;
+	return 0;
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv, enum fuse_buf_copy_flags flags)
+{
+	(void)flags;
+	req->err = 0;
+	size_t size = 0;
+	for (size_t i = bufv->idx; i < bufv->count; i++) {
+		assert(!(bufv->buf[i].flags & FUSE_BUF_IS_FD));
+		assert(size + bufv->buf[i].size <= req->size);
+		memcpy(req->buf + size, bufv->buf[i].mem, bufv->buf[i].size);
+		size += bufv->buf[i].size;
+	}
+	req->size = size;
+	return 0;
+}
+
+int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
+{
+	(void)stbuf;
+	req->err = 0;
+	return 0;
+}
+
+/** Directory entry in a readdir() reply. */
+typedef struct test_dirent {
+	fuse_ino_t ino;
+	off_t off;
+	size_t namelen;
+	char name[];
+} test_dirent;
+
+#define DIRENT_SIZE(namelen) \
+	((sizeof(test_dirent) + (namelen) + 1 + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1))
+
+size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize, const char *name,
+                         const struct stat *stbuf, off_t off)
+{
+	(void)req;
+	size_t namelen = strlen(name);
+	if (DIRENT_SIZE(namelen) > bufsize) return DIRENT_SIZE(namelen);
+	test_dirent *d = (test_dirent *)buf;
+	d->ino = stbuf->st_ino;
+	d->off = off;
+	d->namelen = namelen;
+	strcpy(d->name, name);
+	return DIRENT_SIZE(namelen);
+}
+
+void *fuse_req_userdata(fuse_req_t req)
+{
+	return req->fs;
+}
+
+
+/** The callbacks, each failing the test on an unexpected error. */
+
+static void check(struct fuse_req *req, const char *op, const char *name)
+{
+	if (req->err != 0) {
+		fprintf(stderr, "%s %s: %s\n", op, name, strerror(req->err));
+		exit(1);
+	}
+}
+
+/** Look up the name in the directory; 0 if it does not exist. */
+static fuse_ino_t lookup(fs_ctx *fs, fuse_ino_t dir, const char *name)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_lookup(&req, dir, name);
+	if (req.err == ENOENT) return 0;
+	check(&req, "lookup", name);
+	return req.e.ino;
+}
+
+static void forget(fs_ctx *fs, fuse_ino_t ino)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_forget(&req, ino, 1);
+}
+
+static fuse_ino_t make_dir(fs_ctx *fs, fuse_ino_t dir, const char *name)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_mkdir(&req, dir, name, 0777);
+	check(&req, "mkdir", name);
+	return req.e.ino;
+}
+
+static void remove_dir(fs_ctx *fs, fuse_ino_t dir, const char *name)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_rmdir(&req, dir, name);
+	check(&req, "rmdir", name);
+}
+
+/** Create the file and open it, storing the handle in fi. */
+static fuse_ino_t create(fs_ctx *fs, fuse_ino_t dir, const char *name, struct fuse_file_info *fi)
+{
+	struct fuse_req req = { .fs = fs };
+	memset(fi, 0, sizeof(*fi));
+	a1fs_create(&req, dir, name, S_IFREG | 0666, fi);
+	check(&req, "create", name);
+	*fi = req.fi;
+	return req.e.ino;
+}
+
+static void open_handle(fs_ctx *fs, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fuse_req req = { .fs = fs };
+	memset(fi, 0, sizeof(*fi));
+	a1fs_open(&req, ino, fi);
+	check(&req, "open", "");
+	*fi = req.fi;
+}
+
+static void release(fs_ctx *fs, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_release(&req, ino, fi);
+	check(&req, "release", "");
+}
+
+static void remove_file(fs_ctx *fs, fuse_ino_t dir, const char *name)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_unlink(&req, dir, name);
+	check(&req, "unlink", name);
+}
+
+static uint64_t file_size(fs_ctx *fs, fuse_ino_t ino)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_getattr(&req, ino, NULL);
+	check(&req, "getattr", "");
+	return req.attr.st_size;
+}
+
+static void write_data(fs_ctx *fs, fuse_ino_t ino, struct fuse_file_info *fi, const char *buf,
+                       size_t size, off_t offset)
+{
+	struct fuse_req req = { .fs = fs };
+	a1fs_write(&req, ino, buf, size, offset, fi);
+	check(&req, "write", "");
+	assert(req.count == size);
+}
+
+/** Return the number of bytes read, fewer than size only at the end of file. */
+static size_t read_data(fs_ctx *fs, fuse_ino_t ino, struct fuse_file_info *fi, char *buf,
+                        size_t size, off_t offset)
+{
+	struct fuse_req req = { .fs = fs, .buf = buf, .size = size };
+	a1fs_read(&req, ino, size, offset, fi);
+	check(&req, "read", "");
+	return req.size;
+}
+
+/** Return the number of entries in the directory, "." and ".." included. */
+static uint32_t count_entries(fs_ctx *fs, fuse_ino_t dir)
+{
+	struct fuse_file_info fi = { 0 };
+	struct fuse_req req = { .fs = fs };
+	a1fs_opendir(&req, dir, &fi);
+	check(&req, "opendir", "");
+	fi = req.fi;
+
+	char buf[A1FS_BLOCK_SIZE];
+	uint32_t count = 0;
+	off_t off = 0;
+	do {
+		req = (struct fuse_req){ .fs = fs, .buf = buf, .size = sizeof(buf) };
+		a1fs_readdir(&req, dir, sizeof(buf), off, &fi);
+		check(&req, "readdir", "");
+		for (size_t pos = 0; pos < req.size; pos += DIRENT_SIZE(((test_dirent *)(buf + pos))->namelen)) {
+			off = ((test_dirent *)(buf + pos))->off;
+			count++;
+		}
+	} while (req.size > 0);
+
+	req = (struct fuse_req){ .fs = fs };
+	a1fs_releasedir(&req, dir, &fi);
+	return count;
+}
+
+
+/** Largest file a thread writes in a round. */
+#define MAX_FILE_SIZE (6 * A1FS_BLOCK_SIZE)
+/** Size of the reads that check files, which do not line up with blocks. */
+#define READ_SIZE 3000
+/** Size of the reads and writes of the large file, the most the kernel sends
+ * in one request. */
+#define IO_SIZE (128 << 10)
+
+/** Byte at offset off of the file thread t writes in round r. */
+static char pattern(uint32_t t, uint32_t r, uint64_t off)
+{
+	return (char)(t * 31 + r * 7 + off % 251);
+}
+
+/** Size of the file thread t writes in round r. */
+static size_t round_size(uint32_t t, uint32_t r)
+{
+	return 1 + (t * 7919 + r * 104729) % MAX_FILE_SIZE;
+}
+
+/** Files in the shared directory; the rest go into that of the thread. */
+static bool in_shared(uint32_t r)
+{
+	return r % 4 == 0;
+}
+
+/** Files left in place until all threads are done. */
+static bool kept(uint32_t r)
+{
+	return r % 8 < 2;
+}
+
+typedef struct worker {
+	pthread_t thread;
+	fs_ctx *fs;
+	uint32_t t, num_threads, num_rounds;
+	fuse_ino_t dir, shared;
+} worker;
+
+/** Check that the file holds a prefix of what thread t writes in round r,
+ * all of it if complete is set. */
+static void verify(fs_ctx *fs, fuse_ino_t ino, uint32_t t, uint32_t r, bool complete)
+{
+	struct fuse_file_info fi;
+	open_handle(fs, ino, &fi);
+	char buf[MAX_FILE_SIZE + READ_SIZE];
+	size_t size = 0;
+	for (size_t n; (n = read_data(fs, ino, &fi, buf + size, READ_SIZE, size)) > 0;) {
+		size += n;
+		assert(size <= MAX_FILE_SIZE);
+	}
+	release(fs, ino, &fi);
+	for (size_t off = 0; off < size; off++) {
+		if (buf[off] != pattern(t, r, off)) {
+			fprintf(stderr, "file of thread %u, round %u: wrong byte at %zu\n", t, r, off);
+			exit(1);
+		}
+	}
+	if (complete && size != round_size(t, r)) {
+		fprintf(stderr, "file of thread %u, round %u: %zu bytes instead of %zu\n",
+		        t, r, size, round_size(t, r));
+		exit(1);
+	}
+}
+
+static void *run_worker(void *arg)
+{
+	worker *w = (worker *)arg;
+	fs_ctx *fs = w->fs;
+	uint32_t t = w->t;
+	char name[A1FS_NAME_MAX], buf[MAX_FILE_SIZE];
+	// files of this thread in its own directory
+	uint32_t own_files = 0;
+
+	for (uint32_t r = 0; r < w->num_rounds; r++) {
+		// append to a new file in pieces that do not line up with blocks
+		fuse_ino_t dir = in_shared(r) ? w->shared : w->dir;
+		snprintf(name, sizeof(name), "t%u-r%u", t, r);
+		struct fuse_file_info fi;
+		fuse_ino_t ino = create(fs, dir, name, &fi);
+		size_t size = round_size(t, r);
+		for (size_t off = 0; off < size; off++) buf[off] = pattern(t, r, off);
+		for (size_t off = 0, n; off < size; off += n) {
+			n = size - off < 1500 ? size - off : 1500;
+			write_data(fs, ino, &fi, buf + off, n, off);
+		}
+		assert(file_size(fs, ino) == size);
+		release(fs, ino, &fi);
+		verify(fs, ino, t, r, true);
+		// then overwrite it in place, which allocates nothing
+		open_handle(fs, ino, &fi);
+		for (size_t off = 0, n; off < size; off += n) {
+			n = size - off < 4000 ? size - off : 4000;
+			write_data(fs, ino, &fi, buf + off, n, off);
+		}
+		release(fs, ino, &fi);
+		verify(fs, ino, t, r, true);
+		forget(fs, ino);
+		if (!in_shared(r)) own_files++;
+
+		// read a file the next thread may be writing or removing; it stays
+		// readable while looked up
+		uint32_t other = (t + 1) % w->num_threads;
+		uint32_t other_r = r & ~3u;
+		snprintf(name, sizeof(name), "t%u-r%u", other, other_r);
+		fuse_ino_t other_ino = lookup(fs, w->shared, name);
+		if (other_ino != 0) {
+			verify(fs, other_ino, other, other_r, false);
+			forget(fs, other_ino);
+		}
+
+		// remove the file of two rounds ago
+		if (r >= 2 && !kept(r - 2)) {
+			snprintf(name, sizeof(name), "t%u-r%u", t, r - 2);
+			remove_file(fs, in_shared(r - 2) ? w->shared : w->dir, name);
+			if (!in_shared(r - 2)) own_files--;
+		}
+		if (r % 16 == 0 && count_entries(fs, w->dir) != own_files + 2) {
+			fprintf(stderr, "thread %u, round %u: wrong number of entries\n", t, r);
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+/** Return the number of set bits among the first n of the bitmap. */
+static uint32_t count_used(void *image, uint32_t n, uint32_t lookup)
+{
+	uint32_t used = 0;
+	for (uint32_t bit = 0; bit < n; bit++) used += is_used_bit(image, bit, lookup);
+	return used;
+}
+
+typedef struct reader {
+	pthread_t thread;
+	fs_ctx *fs;
+	fuse_ino_t ino;
+} reader;
+
+static void *run_reader(void *arg)
+{
+	reader *rd = (reader *)arg;
+	struct fuse_file_info fi;
+	open_handle(rd->fs, rd->ino, &fi);
+	char buf[IO_SIZE];
+	for (off_t off = 0; read_data(rd->fs, rd->ino, &fi, buf, sizeof(buf), off) > 0; off += sizeof(buf));
+	release(rd->fs, rd->ino, &fi);
+	return NULL;
+}
+
+/** Read the file from num_threads threads at once; return the time taken. */
+static double time_reads(fs_ctx *fs, fuse_ino_t ino, uint32_t num_threads)
+{
+	reader readers[num_threads];
+	uint64_t start = now_ns();
+	for (uint32_t i = 0; i < num_threads; i++) {
+		readers[i] = (reader){ .fs = fs, .ino = ino };
+		pthread_create(&readers[i].thread, NULL, run_reader, &readers[i]);
+	}
+	for (uint32_t i = 0; i < num_threads; i++) pthread_join(readers[i].thread, NULL);
+	return (now_ns() - start) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [num_threads] [num_rounds]\n", argv[0]);
+		return 1;
+	}
+	uint32_t num_threads = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+	uint32_t num_rounds = argc > 3 ? strtoul(argv[3], NULL, 10) : 200;
+	if (num_threads == 0) num_threads = 1;
+
+	a1fs_opts opts = { .img_path = argv[1], .dcache_max = DCACHE_DEFAULT_MAX };
+	fs_ctx fs;
+	if (!a1fs_init(&fs, &opts)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+	uint32_t free_blks = fs.s->s_num_free_blocks, free_inodes = fs.s->s_num_free_inodes;
+
+	char name[A1FS_NAME_MAX];
+	fuse_ino_t root = FUSE_ROOT_ID;
+	fuse_ino_t shared = make_dir(&fs, root, "shared");
+	worker workers[num_threads];
+	uint64_t start = now_ns();
+	for (uint32_t t = 0; t < num_threads; t++) {
+		snprintf(name, sizeof(name), "t%u", t);
+		workers[t] = (worker){ .fs = &fs, .t = t, .num_threads = num_threads,
+		                       .num_rounds = num_rounds, .dir = make_dir(&fs, root, name),
+		                       .shared = shared };
+		pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+	}
+	for (uint32_t t = 0; t < num_threads; t++) pthread_join(workers[t].thread, NULL);
+	double elapsed = (now_ns() - start) / 1e9;
+	printf("%u threads, %u files each: %.2f s (%.0f files/s)\n", num_threads, num_rounds,
+	       elapsed, num_threads * num_rounds / elapsed);
+
+	// the files left are complete, and removing them and the directories
+	// frees everything that was allocated
+	for (uint32_t t = 0; t < num_threads; t++) {
+		for (uint32_t r = 0; r < num_rounds; r++) {
+			if (r + 2 < num_rounds && !kept(r)) continue;
+			fuse_ino_t dir = in_shared(r) ? shared : workers[t].dir;
+			snprintf(name, sizeof(name), "t%u-r%u", t, r);
+			fuse_ino_t ino = lookup(&fs, dir, name);
+			if (ino == 0) {
+				fprintf(stderr, "%s not found\n", name);
+				return 1;
+			}
+			verify(&fs, ino, t, r, true);
+			remove_file(&fs, dir, name);
+			forget(&fs, ino);
+		}
+		forget(&fs, workers[t].dir);
+		snprintf(name, sizeof(name), "t%u", t);
+		remove_dir(&fs, root, name);
+	}
+	assert(count_entries(&fs, shared) == 2);
+	forget(&fs, shared);
+	remove_dir(&fs, root, "shared");
+	uint32_t used_blks = count_used(fs.image, fs.s->s_num_blocks, LOOKUP_DB);
+	uint32_t used_inodes = count_used(fs.image, fs.s->s_num_inodes, LOOKUP_IB);
+	if (fs.s->s_num_free_blocks != free_blks || fs.s->s_num_free_inodes != free_inodes ||
+	    fs.s->s_num_free_blocks != fs.s->s_num_blocks - used_blks ||
+	    fs.s->s_num_free_inodes != fs.s->s_num_inodes - used_inodes) {
+		fprintf(stderr, "free counts: %u blocks, %u inodes before; %u blocks, %u inodes after; "
+		        "%u blocks, %u inodes free in the bitmaps\n", free_blks, free_inodes,
+		        fs.s->s_num_free_blocks, fs.s->s_num_free_inodes,
+		        fs.s->s_num_blocks - used_blks, fs.s->s_num_inodes - used_inodes);
+		return 1;
+	}
+
+	// the same file read by one thread and by all of them at once
+	struct fuse_file_info fi;
+	fuse_ino_t ino = create(&fs, root, "big", &fi);
+	char buf[IO_SIZE];
+	size_t big_size = 16ul << 20;
+	for (size_t off = 0; off < big_size; off += sizeof(buf)) {
+		memset(buf, (int)(off / sizeof(buf)), sizeof(buf));
+		write_data(&fs, ino, &fi, buf, sizeof(buf), off);
+	}
+	release(&fs, ino, &fi);
+	double one = time_reads(&fs, ino, 1), all = time_reads(&fs, ino, num_threads);
+	printf("reads of a %zu MiB file: 1 thread %.0f MiB/s, %u threads %.0f MiB/s\n",
+	       big_size >> 20, (big_size >> 20) / one, num_threads,
+	       num_threads * (big_size >> 20) / all);
+	remove_file(&fs, root, "big");
+	forget(&fs, ino);
+
+	a1fs_destroy(&fs);
+	return 0;
+}
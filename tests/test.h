@@ -0,0 +1,17 @@
+/**
+ * CSC369 Assignment 1 - Helpers shared by the tests and benchmarks.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+
+/** Return the current time of the monotonic clock in nanoseconds. */
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
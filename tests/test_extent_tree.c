@@ -0,0 +1,199 @@
+/**
+ * CSC369 Assignment 1 - Test of the extent tree.
+ *
+ * Gives a new inode extents a few blocks apart, so that none of them could be
+ * merged: first in order, which appends to the last leaf, then in between in
+ * random order, which splits leaves in the middle, until the tree is at least
+ * two levels above its leaves. Checks that the extents come back in order and
+ * that lookups at random offsets find the right one. Removes the first extent
+ * of each leaf but the first, checking that every other extent is still found,
+ * and puts it back. Then removes them all in random order and checks that the tree collapses back into the inode and
+ * that every tree block is freed. The image is overwritten, so it must be a
+ * scratch image made by mkfs.a1fs.
+ *
+ * Usage: test_extent_tree image [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "extent_tree.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Logical distance between the extents, which are one block long. */
+#define STRIDE 3
+
+/** Report the failed check and exit. */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+/** Shuffle the block offsets. */
+static void shuffle(a1fs_blk_t *a, uint32_t n)
+{
+	for (uint32_t i = n; i > 1; i--) {
+		uint32_t j = rand() % i;
+		a1fs_blk_t t = a[i - 1];
+		a[i - 1] = a[j];
+		a[j] = t;
+	}
+}
+
+/** The extent at offset lblk, whose data block is made up from it. */
+static a1fs_extent make_extent(fs_ctx *fs, a1fs_blk_t lblk)
+{
+	return (a1fs_extent){ .logical = lblk, .start = lblk % fs->s->s_num_blocks, .count = 1 };
+}
+
+/** Insert the extent at offset lblk, failing the test if it does not fit. */
+static void insert(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t lblk)
+{
+	a1fs_extent ext = make_extent(fs, lblk);
+	int ret = extent_tree_insert(fs, ino, &ext);
+	if (ret != 0) {
+		fprintf(stderr, "Inserting the extent at %u failed: %d\n", lblk, ret);
+		exit(1);
+	}
+}
+
+/** Check that the tree holds exactly the extents at the first n multiples
+ * of STRIDE plus 0 or 1, the latter for the first n1 of them. */
+static void check_extents(fs_ctx *fs, a1fs_inode *ino, uint32_t n, uint32_t n1)
+{
+	CHECK(ino->i_extents == n + n1);
+	uint32_t seen = 0;
+	a1fs_blk_t prev = 0;
+	for (a1fs_extent *ext = extent_tree_first(fs->image, ino); ext != NULL;
+	     ext = extent_tree_next(fs->image, ino, ext)) {
+		CHECK(seen == 0 || ext->logical > prev);
+		a1fs_blk_t i = ext->logical / STRIDE;
+		CHECK(i < n && (ext->logical % STRIDE == 0 || (ext->logical % STRIDE == 1 && i < n1)));
+		CHECK(ext->start == make_extent(fs, ext->logical).start && ext->count == 1);
+		prev = ext->logical;
+		seen++;
+	}
+	CHECK(seen == n + n1);
+	CHECK(extent_tree_last(fs->image, ino)->logical == (n - 1) * STRIDE + (n1 == n));
+
+	// the extent found is the last one starting at or before the offset
+	for (uint32_t k = 0; k < 10000; k++) {
+		a1fs_blk_t lblk = rand() % (n * STRIDE);
+		a1fs_blk_t i = lblk / STRIDE, expect = i * STRIDE;
+		if (lblk % STRIDE != 0 && i < n1) expect++;
+		a1fs_extent *ext = extent_tree_find(fs->image, ino, lblk);
+		CHECK(ext != NULL && ext->logical == expect);
+	}
+}
+
+/** Return whether the extents are in different blocks of the image. */
+static bool other_block(fs_ctx *fs, const a1fs_extent *a, const a1fs_extent *b)
+{
+	return ((const unsigned char *)a - (unsigned char *)fs->image) / A1FS_BLOCK_SIZE !=
+	       ((const unsigned char *)b - (unsigned char *)fs->image) / A1FS_BLOCK_SIZE;
+}
+
+/** Remove the extent at offset lblk, the first of its leaf, and check that
+ * every extent left is found, and that lblk now falls in the one before. */
+static void remove_first_of_leaf(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t lblk)
+{
+	a1fs_extent ext = make_extent(fs, lblk);
+	extent_tree_remove(fs, ino, &ext);
+	a1fs_blk_t prev = 0;
+	for (a1fs_extent *e = extent_tree_first(fs->image, ino); e != NULL;
+	     e = extent_tree_next(fs->image, ino, e)) {
+		CHECK(e->logical != lblk);
+		CHECK(extent_tree_find(fs->image, ino, e->logical) == e);
+		if (e->logical < lblk) prev = e->logical;
+	}
+	a1fs_extent *found = extent_tree_find(fs->image, ino, lblk);
+	CHECK(found != NULL && found->logical == prev);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [seed]\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+	srand(argc > 2 ? strtoul(argv[2], NULL, 10) : 369);
+
+	// an inode of its own, not linked anywhere
+	CHECK(has_n_free_blk(&fs, 1, LOOKUP_IB));
+	a1fs_ino_t inum = find_free_blk_near(&fs, LOOKUP_IB, 0);
+	mask(&fs, inum, LOOKUP_IB, true);
+	init_inode(image, inum, S_IFREG | 0666, 1, 0);
+	a1fs_inode *ino = get_inode_by_inumber(image, inum);
+	uint32_t free_blks = fs.s->s_num_free_blocks;
+
+	// appending fills the leaves; go on until the root is two levels up
+	uint32_t n = 0;
+	while (extent_tree_depth(image, ino) < 2) insert(&fs, ino, n++ * STRIDE);
+	uint32_t leaves = fs.s->s_num_free_blocks;
+	check_extents(&fs, ino, n, 0);
+
+	// then fill every other gap in random order, splitting the full leaves
+	// in the middle
+	a1fs_blk_t *lblks = malloc(2 * n * sizeof(a1fs_blk_t));
+	if (lblks == NULL) return 1;
+	for (uint32_t i = 0; i < n; i++) lblks[i] = i * STRIDE + 1;
+	shuffle(lblks, n);
+	for (uint32_t i = 0; i < n; i++) insert(&fs, ino, lblks[i]);
+	CHECK(fs.s->s_num_free_blocks < leaves);
+	check_extents(&fs, ino, n, n);
+	printf("%u extents, depth %u, %u tree blocks\n", ino->i_extents,
+	       extent_tree_depth(image, ino), free_blks - fs.s->s_num_free_blocks);
+
+	// the first extent of a leaf is the key of the leaf in its parent, and
+	// of the parent in its own if the leaf is a first child
+	a1fs_blk_t *firsts = malloc(2 * n * sizeof(a1fs_blk_t));
+	if (firsts == NULL) return 1;
+	uint32_t num_leaves = 0;
+	a1fs_extent *prev = extent_tree_first(image, ino);
+	for (a1fs_extent *ext = extent_tree_next(image, ino, prev); ext != NULL;
+	     prev = ext, ext = extent_tree_next(image, ino, ext)) {
+		if (other_block(&fs, prev, ext)) firsts[num_leaves++] = ext->logical;
+	}
+	CHECK(num_leaves > 1);
+	for (uint32_t i = 0; i < num_leaves; i++) {
+		remove_first_of_leaf(&fs, ino, firsts[i]);
+		insert(&fs, ino, firsts[i]);
+	}
+	free(firsts);
+	check_extents(&fs, ino, n, n);
+
+	// removing everything leaves an empty root and no blocks
+	for (uint32_t i = 0; i < n; i++) lblks[n + i] = i * STRIDE;
+	shuffle(lblks, 2 * n);
+	for (uint32_t i = 0; i < 2 * n; i++) {
+		a1fs_extent ext = make_extent(&fs, lblks[i]);
+		extent_tree_remove(&fs, ino, &ext);
+		CHECK(ino->i_extents == 2 * n - i - 1);
+		if (i == n) {
+			a1fs_extent *found = extent_tree_find(image, ino, lblks[i + 1]);
+			CHECK(found != NULL && found->logical == lblks[i + 1]);
+		}
+	}
+	CHECK(extent_tree_depth(image, ino) == 0);
+	CHECK(extent_tree_first(image, ino) == NULL);
+	CHECK(fs.s->s_num_free_blocks == free_blks);
+
+	mask(&fs, inum, LOOKUP_IB, false);
+	free(lblks);
+	fs_ctx_destroy(&fs);
+	printf("Extent tree test passed\n");
+	return 0;
+}
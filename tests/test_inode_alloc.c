@@ -0,0 +1,196 @@
+/**
+ * CSC369 Assignment 1 - Test of inode allocation.
+ *
+ * Creates directories in the root until there is one for every inode table
+ * block, checking that each starts a block of its own if its group has an
+ * unused one, then fills the rest
+ * of the inodes with files. Every inode handed out must have been free, and
+ * once they are all taken the free counts must be zero. Then removes half of
+ * the files in random order and creates as many again, and finally removes
+ * everything and checks that only the root is left. Meant for images whose
+ * inodes are larger than 64 bytes and whose groups are small, e.g.
+ * mkfs.a1fs -I 256 -g 4096 -i 200 on a 32 MiB image, where a group does not
+ * fill whole words of the inode bitmap unless mkfs rounds it up. The image is
+ * overwritten, so it must be a scratch image made by mkfs.a1fs.
+ *
+ * Usage: test_inode_alloc image [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_ctx.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Report the failed check and exit. */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+/** An inode created by the test. */
+typedef struct entry {
+	a1fs_ino_t dir;
+	a1fs_ino_t inum;
+	char name[16];
+} entry;
+
+/** Whether each inode is taken, as far as the test knows. */
+static bool *used;
+
+/** Create a directory or a file called name in the directory, checking that
+ * it gets an inode that was free. */
+static a1fs_ino_t create(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, bool is_dir)
+{
+	uint32_t free_inodes = fs->s->s_num_free_inodes;
+	a1fs_dentry *dentry = alloc_dentry(fs, dir_inum, name, is_dir ? 2 : 1);
+	if (dentry == NULL || !has_n_free_blk(fs, 1, LOOKUP_IB)) {
+		fprintf(stderr, "Out of space creating %s\n", name);
+		exit(1);
+	}
+	if (is_dir) {
+		create_new_dir_in_dentry(fs, dir_inum, dentry, S_IFDIR | 0777);
+		get_inode_by_inumber(fs->image, dir_inum)->links++;
+	} else {
+		create_new_file_in_dentry(fs, dir_inum, dentry, S_IFREG | 0666);
+	}
+	a1fs_ino_t inum = dentry->ino;
+	if (inum >= fs->s->s_num_inodes || used[inum]) {
+		fprintf(stderr, "Creating %s took inode %u, which is not free\n", name, inum);
+		exit(1);
+	}
+	CHECK(fs->s->s_num_free_inodes == free_inodes - 1);
+	used[inum] = true;
+	return inum;
+}
+
+/** Remove the entry, freeing its inode and blocks. */
+static void remove_entry(fs_ctx *fs, const entry *e)
+{
+	a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, e->dir);
+	a1fs_dentry *dentry = find_dentry_in_dir(fs->image, dir_ino, e->name);
+	CHECK(dentry != NULL && dentry->ino == e->inum);
+	a1fs_inode *ino = get_inode_by_inumber(fs->image, e->inum);
+	if (S_ISDIR(ino->mode)) {
+		get_group_desc(fs->image, get_group_of(fs->image, e->inum, LOOKUP_IB))->g_num_dirs--;
+		dir_ino->links--;
+	}
+	free_dentry_blks(fs, ino);
+	free_extent_blk(fs, ino);
+	mask(fs, e->inum, LOOKUP_IB, false);
+	free_dentry(fs, e->dir, dentry);
+	used[e->inum] = false;
+}
+
+/** Return whether the group has an inode table block with no inode taken
+ * other than inum. */
+static bool has_unused_table_blk(fs_ctx *fs, uint32_t group, a1fs_ino_t inum)
+{
+	uint32_t per_blk = A1FS_BLOCK_SIZE / fs->s->s_inode_size;
+	uint32_t end = get_group_end_bit(fs->image, group, LOOKUP_IB);
+	for (uint32_t i = get_group_first_bit(fs->image, group, LOOKUP_IB); i < end; i += per_blk) {
+		uint32_t k = 0;
+		while (k < per_blk && (!used[i + k] || i + k == inum)) k++;
+		if (k == per_blk) return true;
+	}
+	return false;
+}
+
+/** Check the free inode counts against the bitmap and the test's own view. */
+static void check_counts(fs_ctx *fs)
+{
+	uint32_t num_used = 0, group_free = 0;
+	for (uint32_t i = 0; i < fs->s->s_num_inodes; i++) {
+		CHECK(is_used_bit(fs->image, i, LOOKUP_IB) == used[i]);
+		num_used += used[i];
+	}
+	for (uint32_t g = 0; g < fs->s->s_num_groups; g++) {
+		group_free += get_group_desc(fs->image, g)->g_num_free_inodes;
+	}
+	CHECK(fs->s->s_num_free_inodes == fs->s->s_num_inodes - num_used);
+	CHECK(group_free == fs->s->s_num_free_inodes);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image [seed]\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+	fs.inode_placement = A1FS_PLACE_ORLOV;
+	srand(argc > 2 ? strtoul(argv[2], NULL, 10) : 369);
+
+	uint32_t num_inodes = fs.s->s_num_inodes;
+	uint32_t per_blk = A1FS_BLOCK_SIZE / fs.s->s_inode_size;
+	used = calloc(num_inodes, sizeof(bool));
+	entry *entries = calloc(num_inodes, sizeof(entry));
+	if (used == NULL || entries == NULL) return 1;
+	used[fs.root_inum] = true;
+	check_counts(&fs);
+
+	// a directory for every inode table block but the root's, each starting
+	// a block while its group has unused ones
+	uint32_t n = 0, num_dirs = num_inodes / per_blk - 1;
+	for (; n < num_dirs; n++) {
+		entry *e = &entries[n];
+		e->dir = fs.root_inum;
+		snprintf(e->name, sizeof(e->name), "d%u", n);
+		e->inum = create(&fs, e->dir, e->name, true);
+		uint32_t group = get_group_of(image, e->inum, LOOKUP_IB);
+		CHECK(e->inum % per_blk == 0 || !has_unused_table_blk(&fs, group, e->inum));
+	}
+
+	// files take every inode left
+	for (; fs.s->s_num_free_inodes > 0; n++) {
+		entry *e = &entries[n];
+		e->dir = entries[n % num_dirs].inum;
+		snprintf(e->name, sizeof(e->name), "f%u", n);
+		e->inum = create(&fs, e->dir, e->name, false);
+	}
+	CHECK(n == num_inodes - 1);
+	check_counts(&fs);
+
+	// free half of the files and take their inodes again
+	uint32_t num_files = n - num_dirs;
+	for (uint32_t i = num_files; i > 1; i--) {
+		uint32_t j = rand() % i;
+		entry t = entries[num_dirs + i - 1];
+		entries[num_dirs + i - 1] = entries[num_dirs + j];
+		entries[num_dirs + j] = t;
+	}
+	for (uint32_t i = num_dirs; i < num_dirs + num_files / 2; i++) remove_entry(&fs, &entries[i]);
+	check_counts(&fs);
+	for (uint32_t i = num_dirs; i < num_dirs + num_files / 2; i++) {
+		entry *e = &entries[i];
+		e->dir = entries[i % num_dirs].inum;
+		snprintf(e->name, sizeof(e->name), "g%u", i);
+		e->inum = create(&fs, e->dir, e->name, false);
+	}
+	CHECK(fs.s->s_num_free_inodes == 0);
+	check_counts(&fs);
+
+	// the files go before the directories holding them
+	for (uint32_t i = n; i > 0; i--) remove_entry(&fs, &entries[i - 1]);
+	check_counts(&fs);
+	CHECK(fs.s->s_num_free_inodes == num_inodes - 1);
+
+	printf("%u inodes of %u bytes in %u groups: inode allocation test passed\n",
+	       num_inodes, fs.s->s_inode_size, fs.s->s_num_groups);
+	free(entries);
+	free(used);
+	fs_ctx_destroy(&fs);
+	return 0;
+}
@@ -0,0 +1,169 @@
+/**
+ * CSC369 Assignment 1 - Test of punching holes in files.
+ *
+ * Gives a new inode one-block extents at every other block offset until its
+ * extent tree is at least two levels above its leaves and has at least three
+ * of them, each block holding its offset. Punches out the first extent of each leaf but the first, which
+ * changes the keys of the leaves, then a range across many leaves that starts
+ * and ends inside blocks, and finally the whole file. After each punch only
+ * the blocks punched out may be gone, and every other block must still be
+ * found, both by offset and by walking the file. The image is overwritten, so
+ * it must be a scratch image made by mkfs.a1fs.
+ *
+ * Usage: test_punch_hole image
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "extent_tree.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "util.h"
+
+
+/** Report the failed check and exit. */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+/** Whether each block of the file has data, as far as the test knows. */
+static bool *present;
+
+/** Number of blocks in the file. */
+static a1fs_blk_t num_blks;
+
+/** Return the number of blocks the test knows to have data. */
+static a1fs_blk_t count_present(void)
+{
+	a1fs_blk_t n = 0;
+	for (a1fs_blk_t b = 0; b < num_blks; b++) n += present[b];
+	return n;
+}
+
+/** Position of walk_file_blks() over the file. */
+typedef struct walk_pos {
+	uint64_t offset;
+} walk_pos;
+
+/** Check that a run of the walk is data where the file has some, and a hole
+ * where it has none. */
+static int check_run(void *arg, const void *data, size_t len)
+{
+	walk_pos *pos = (walk_pos *)arg;
+	for (uint64_t off = pos->offset; off < pos->offset + len; off += A1FS_BLOCK_SIZE) {
+		a1fs_blk_t b = off / A1FS_BLOCK_SIZE;
+		CHECK((data != NULL) == present[b]);
+		if (data != NULL) {
+			CHECK(*(const uint32_t *)((const unsigned char *)data + (off - pos->offset)) == b + 1);
+		}
+	}
+	pos->offset += len;
+	return 0;
+}
+
+/** Check every block of the file against the test's own view. */
+static void check_file(fs_ctx *fs, a1fs_inode *ino)
+{
+	for (a1fs_blk_t b = 0; b < num_blks; b++) {
+		a1fs_blk_t blk = find_blk_given_offset(fs->image, ino, b);
+		CHECK((blk != (a1fs_blk_t) -1) == present[b]);
+		if (present[b]) CHECK(*(uint32_t *)jump_to(fs->image, blk, A1FS_BLOCK_SIZE) == b + 1);
+	}
+	CHECK(ino->i_extents == count_present());
+	CHECK(count_alloc_blks(fs->image, ino) == count_present());
+	walk_pos pos = { 0 };
+	CHECK(walk_file_blks(fs, ino, 0, ino->size, NULL, check_run, &pos) == 0);
+}
+
+/** Punch out bytes [offset, offset + len) of the file and check that the
+ * whole blocks in the range, and nothing else, are freed. */
+static void punch(fs_ctx *fs, a1fs_inode *ino, uint64_t offset, uint64_t len)
+{
+	uint32_t free_blks = fs->s->s_num_free_blocks;
+	a1fs_blk_t num_present = count_present();
+	for (a1fs_blk_t b = CEIL_DIV(offset, A1FS_BLOCK_SIZE); b < (offset + len) / A1FS_BLOCK_SIZE; b++) {
+		present[b] = false;
+	}
+	punch_hole(fs, ino, offset, len);
+	// tree blocks left empty are freed as well
+	CHECK(fs->s->s_num_free_blocks >= free_blks + num_present - count_present());
+	check_file(fs, ino);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s image\n", argv[0]);
+		return 1;
+	}
+	size_t size;
+	void *image = map_file(argv[1], A1FS_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	fs_ctx fs;
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "Failed to initialize the file system context\n");
+		return 1;
+	}
+
+	// an inode of its own, not linked anywhere
+	CHECK(has_n_free_blk(&fs, 1, LOOKUP_IB));
+	a1fs_ino_t inum = find_free_blk_near(&fs, LOOKUP_IB, 0);
+	mask(&fs, inum, LOOKUP_IB, true);
+	init_inode(image, inum, S_IFREG | 0666, 1, 0);
+	a1fs_inode *ino = get_inode_by_inumber(image, inum);
+	uint32_t free_blks = fs.s->s_num_free_blocks;
+
+	// every other block, so that no two extents merge, until there are at
+	// least three leaves
+	present = calloc(fs.s->s_num_blocks, sizeof(bool));
+	if (present == NULL) return 1;
+	for (num_blks = 0; extent_tree_depth(image, ino) < 2 || ino->i_extents < 5 * A1FS_EXTENTS_PER_BLOCK / 2;
+	     num_blks += 2) {
+		CHECK(alloc_file_range(&fs, ino, num_blks, 1, false) == 0);
+		a1fs_blk_t blk = find_blk_given_offset(image, ino, num_blks);
+		*(uint32_t *)jump_to(image, blk, A1FS_BLOCK_SIZE) = num_blks + 1;
+		present[num_blks] = true;
+	}
+	num_blks--;
+	ino->size = (uint64_t) num_blks * A1FS_BLOCK_SIZE;
+	check_file(&fs, ino);
+	printf("%u extents, depth %u\n", ino->i_extents, extent_tree_depth(image, ino));
+
+	// the first block of each leaf, found before any of them is punched
+	a1fs_blk_t *firsts = malloc(num_blks * sizeof(a1fs_blk_t));
+	if (firsts == NULL) return 1;
+	uint32_t num_leaves = 0;
+	a1fs_extent *prev = extent_tree_first(image, ino);
+	for (a1fs_extent *ext = extent_tree_next(image, ino, prev); ext != NULL;
+	     prev = ext, ext = extent_tree_next(image, ino, ext)) {
+		if (((unsigned char *)prev - (unsigned char *)image) / A1FS_BLOCK_SIZE !=
+		    ((unsigned char *)ext - (unsigned char *)image) / A1FS_BLOCK_SIZE) {
+			firsts[num_leaves++] = ext->logical;
+		}
+	}
+	CHECK(num_leaves > 1);
+	for (uint32_t i = 0; i < num_leaves; i++) {
+		punch(&fs, ino, (uint64_t) firsts[i] * A1FS_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+	}
+	free(firsts);
+
+	// the middle third, from inside a block up to a hole
+	a1fs_blk_t from = (num_blks / 3) & ~1u, to = (2 * num_blks / 3) | 1u;
+	punch(&fs, ino, (uint64_t) from * A1FS_BLOCK_SIZE + 100, (uint64_t) (to - from) * A1FS_BLOCK_SIZE - 100);
+	CHECK(present[from]);
+
+	// punching everything leaves an empty root and no blocks
+	punch(&fs, ino, 0, ino->size);
+	CHECK(extent_tree_depth(image, ino) == 0);
+	CHECK(fs.s->s_num_free_blocks == free_blks);
+
+	mask(&fs, inum, LOOKUP_IB, false);
+	free(present);
+	fs_ctx_destroy(&fs);
+	printf("Punch hole test passed\n");
+	return 0;
+}
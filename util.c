@@ -7,10 +7,21 @@
 
 #include "util.h"
 #include "fs_ctx.h"
+#include "bitmap.h"
+#include "dir_compact.h"
+#include "dir_index.h"
+#include "extent_tree.h"
 
 #ifndef HELPERS_INCLUDED
 #define HELPERS_INCLUDED
 
+/** Number of inodes in an inode table block. */
+#define INODES_PER_BLOCK(image) (A1FS_BLOCK_SIZE / get_superblock(image)->s_inode_size)
+
+/** How many more directories than average a group may have before new
+ * subdirectories are placed in the next group (Orlov). */
+#define ORLOV_MAX_DIR_DEBT 16
+
 /** Get address of block at the given block number. */
 void *jump_to(void *image, uint32_t idx, size_t unit)
 {
@@ -43,6 +54,58 @@ unsigned char *get_first_data_bitmap(void *image)
     return (unsigned char *)jump_to(image, s->s_data_bitmap, A1FS_BLOCK_SIZE);
 }
 
+/** Get the descriptor of the given allocation group. */
+a1fs_group_desc *get_group_desc(void *image, uint32_t group)
+{
+    a1fs_superblock *s = get_superblock(image);
+    a1fs_group_desc *gdt = (a1fs_group_desc *)jump_to(image, s->s_group_desc, A1FS_BLOCK_SIZE);
+    return gdt + group;
+}
+
+/** Get the allocation group of the bit in the bitmap indicated by lookup. */
+uint32_t get_group_of(void *image, uint32_t bit, uint32_t lookup)
+{
+    a1fs_superblock *s = get_superblock(image);
+    uint32_t per_group = (lookup == LOOKUP_DB) ? s->s_blocks_per_group : s->s_inodes_per_group;
+    uint32_t group = bit / per_group;
+    // the last group also holds the blocks that do not make up a whole group
+    return group < s->s_num_groups ? group : s->s_num_groups - 1;
+}
+
+/** Get the first bit of the group in the bitmap indicated by lookup. */
+uint32_t get_group_first_bit(void *image, uint32_t group, uint32_t lookup)
+{
+    a1fs_superblock *s = get_superblock(image);
+    return group * ((lookup == LOOKUP_DB) ? s->s_blocks_per_group : s->s_inodes_per_group);
+}
+
+/** Get the end (exclusive) of the group in the bitmap indicated by lookup. */
+uint32_t get_group_end_bit(void *image, uint32_t group, uint32_t lookup)
+{
+    a1fs_superblock *s = get_superblock(image);
+    if (group + 1 == s->s_num_groups)
+        return (lookup == LOOKUP_DB) ? s->s_num_blocks : s->s_num_inodes;
+    return get_group_first_bit(image, group + 1, lookup);
+}
+
+/** Get the bitmap block that holds the bit of the bitmap indicated by lookup.
+ * The block holds bits [*first_bit, *first_bit + *num_bits). */
+unsigned char *get_bitmap_blk(void *image, uint32_t lookup, uint32_t bit,
+                              uint32_t *first_bit, uint32_t *num_bits)
+{
+    uint32_t group = get_group_of(image, bit, lookup);
+    a1fs_group_desc *gd = get_group_desc(image, group);
+    uint32_t group_start = get_group_first_bit(image, group, lookup);
+    uint32_t group_end = get_group_end_bit(image, group, lookup);
+    uint32_t idx = (bit - group_start) / BITS_PER_BITMAP_BLK;
+    *first_bit = group_start + idx * BITS_PER_BITMAP_BLK;
+    *num_bits = group_end - *first_bit;
+    if (*num_bits > BITS_PER_BITMAP_BLK)
+        *num_bits = BITS_PER_BITMAP_BLK;
+    a1fs_blk_t first = (lookup == LOOKUP_DB) ? gd->g_data_bitmap : gd->g_inode_bitmap;
+    return (unsigned char *)jump_to(image, first + idx, A1FS_BLOCK_SIZE);
+}
+
 // locate which bitmap stores this bit
 a1fs_blk_t get_block_offset(uint32_t bit)
 {
@@ -66,7 +129,8 @@ bool is_used_bit(void *image, uint32_t bit, uint32_t lookup)
 {
     a1fs_superblock *s = get_superblock(image);
     // choose which bitmap
-    unsigned char *bitmap;
+    unsigned char *bitmap = NULL;
+    uint32_t first_bit, num_bits;
     if (lookup == LOOKUP_DB)
     {
         if (s->s_num_free_blocks <= 0)
@@ -78,7 +142,7 @@ bool is_used_bit(void *image, uint32_t bit, uint32_t lookup)
         }
         else
         {
-            bitmap = (unsigned char *)jump_to(image, s->s_data_bitmap + get_block_offset(bit), A1FS_BLOCK_SIZE);
+            bitmap = get_bitmap_blk(image, lookup, bit, &first_bit, &num_bits);
         }
     }
     else if (lookup == LOOKUP_IB)
@@ -92,13 +156,17 @@ bool is_used_bit(void *image, uint32_t bit, uint32_t lookup)
         }
         else
         {
-            bitmap = (unsigned char *)jump_to(image, s->s_inode_bitmap + get_block_offset(bit), A1FS_BLOCK_SIZE);
+            bitmap = get_bitmap_blk(image, lookup, bit, &first_bit, &num_bits);
         }
     }
     else
     {
         perror("Invalid lookup flag.\n");
     }
+    // report bits outside of the bitmap as used so that nobody allocates them
+    if (bitmap == NULL)
+        return true;
+    bit -= first_bit;
     return (bitmap[get_byte_offset(bit)] & (1 << get_bit_offset(bit))) != 0;
 }
 
@@ -110,62 +178,166 @@ static void _mask(unsigned char *bitmap, uint32_t bit, bool on)
         bitmap[get_byte_offset(bit)] &= ~(1 << get_bit_offset(bit));
 }
 
-/** Set the bit to 1 in the bitmap indicated by lookup. */
-void mask(void *image, uint32_t bit, uint32_t lookup, bool on)
+/** Add delta to the superblock and group free counters of the bitmap
+ * indicated by lookup, for bits in the group of bit. */
+static void add_free_count(void *image, uint32_t bit, uint32_t lookup, int32_t delta)
 {
     a1fs_superblock *s = get_superblock(image);
-    if (on && is_used_bit(image, bit, lookup))
-    {
-        fprintf(stderr, "Cannot mask used bit at %d.\n", bit);
-        return;
-    }
-    // find the correct bitmap that contains this bit and mark to 1.
-    unsigned char *bitmap;
+    a1fs_group_desc *gd = get_group_desc(image, get_group_of(image, bit, lookup));
     if (lookup == LOOKUP_DB)
     {
-        bitmap = (unsigned char *)jump_to(image, s->s_data_bitmap + get_block_offset(bit), A1FS_BLOCK_SIZE);
-        _mask(bitmap, bit, on);
-        if (on)
-            s->s_num_free_blocks--;
-        else
-            s->s_num_free_blocks++;
+        s->s_num_free_blocks += delta;
+        gd->g_num_free_blocks += delta;
     }
     else if (lookup == LOOKUP_IB)
     {
-        bitmap = (unsigned char *)jump_to(image, s->s_inode_bitmap + get_block_offset(bit), A1FS_BLOCK_SIZE);
-        _mask(bitmap, bit, on);
+        s->s_num_free_inodes += delta;
+        gd->g_num_free_inodes += delta;
+    }
+}
+
+/** Set the bit in the bitmap indicated by lookup and update the free counters.
+ * Return false if the bit was already set to on. */
+static bool mask_bit(void *image, uint32_t bit, uint32_t lookup, bool on)
+{
+    if (is_used_bit(image, bit, lookup) == on)
+    {
         if (on)
-            s->s_num_free_inodes--;
-        else
-            s->s_num_free_inodes++;
+            fprintf(stderr, "Cannot mask used bit at %d.\n", bit);
+        return false;
+    }
+    // find the correct bitmap that contains this bit and mark to 1.
+    uint32_t first_bit, num_bits;
+    unsigned char *bitmap = get_bitmap_blk(image, lookup, bit, &first_bit, &num_bits);
+    _mask(bitmap, bit - first_bit, on);
+    add_free_count(image, bit, lookup, on ? -1 : 1);
+    return true;
+}
+
+/** Tell the free block index that bits [start, end) of the bitmap changed. */
+static void update_free_index(fs_ctx *fs, uint32_t start, uint32_t end, uint32_t lookup, bool on)
+{
+    if (lookup != LOOKUP_DB || fs->free_blks == NULL || start == end)
+        return;
+    bool ok;
+    if (on)
+        ok = free_index_remove(fs->free_blks, start, end - start);
+    else
+        ok = free_index_insert(fs->free_blks, start, end - start);
+    if (!ok)
+    {
+        // a stale index could hand out used blocks; scan the bitmap instead
+        fprintf(stderr, "Free block index is out of sync, disabling it.\n");
+        free_index_destroy(fs->free_blks);
+        fs->free_blks = NULL;
     }
 }
 
+/** Set the bit to 1 in the bitmap indicated by lookup. */
+void mask(fs_ctx *fs, uint32_t bit, uint32_t lookup, bool on)
+{
+    mask_range(fs, bit, bit + 1, lookup, on);
+}
+
 /** Mask from start to end (exclusive) in bitmap. */
-void mask_range(void *image, uint32_t offset_start, uint32_t offset_end, uint32_t lookup, bool on)
+void mask_range(fs_ctx *fs, uint32_t offset_start, uint32_t offset_end, uint32_t lookup, bool on)
 {
-    for (uint32_t offset = offset_start; offset < offset_end; offset++)
+    void *image = fs->image;
+    uint32_t num_bits = (lookup == LOOKUP_DB) ? fs->s->s_num_blocks : fs->s->s_num_inodes;
+    if (offset_start >= offset_end)
+        return;
+    if (offset_end > num_bits)
+    {
+        fprintf(stderr, "Invalid mask of bits %u to %u\n", offset_start, offset_end);
+        return;
+    }
+    // bits that are already set to on are skipped, so the index is updated
+    // once for each run of bits that actually changed
+    uint32_t run_start = offset_start;
+    for (uint32_t bit = offset_start; bit < offset_end;)
     {
-        mask(image, offset, lookup, on);
+        // one bitmap block (and so one group) at a time
+        uint32_t first_bit, blk_bits;
+        unsigned char *bitmap = get_bitmap_blk(image, lookup, bit, &first_bit, &blk_bits);
+        uint32_t end = first_bit + blk_bits < offset_end ? first_bit + blk_bits : offset_end;
+        if (bitmap_find(image, lookup, bit, end, on) == BITMAP_NONE)
+        {
+            // every bit changes: fill whole words and count them at once
+            bitmap_fill(bitmap, bit - first_bit, end - first_bit, on);
+            add_free_count(image, bit, lookup, on ? -(int32_t)(end - bit) : (int32_t)(end - bit));
+        }
+        else
+        {
+            for (uint32_t offset = bit; offset < end; offset++)
+            {
+                if (!mask_bit(image, offset, lookup, on))
+                {
+                    update_free_index(fs, run_start, offset, lookup, on);
+                    run_start = offset + 1;
+                }
+            }
+        }
+        bit = end;
     }
+    update_free_index(fs, run_start, offset_end, lookup, on);
+    // freed blocks must not be reached through cached extents
+    if (!on && lookup == LOOKUP_DB)
+        __atomic_add_fetch(&fs->ext_gen, 1, __ATOMIC_RELAXED);
+    if (lookup == LOOKUP_IB && fs->free_inodes != NULL)
+        bitmap_summary_update(fs->free_inodes, offset_start, offset_end);
+    // the next-fit search continues after the last allocation
+    if (on && lookup == LOOKUP_DB)
+        fs->s->s_next_block = offset_end;
+    else if (on && lookup == LOOKUP_IB)
+        fs->s->s_next_inode = offset_end;
+}
+
+/** Pick where to start searching the bitmap indicated by lookup, given the
+ * caller's locality goal and the allocation policy. */
+static uint32_t alloc_goal(fs_ctx *fs, uint32_t lookup, uint32_t goal)
+{
+    if (fs->alloc_policy == A1FS_ALLOC_NEXT_FIT)
+        goal = (lookup == LOOKUP_DB) ? fs->s->s_next_block : fs->s->s_next_inode;
+    uint32_t end = (lookup == LOOKUP_DB) ? fs->s->s_num_blocks : fs->s->s_num_inodes;
+    return goal < end ? goal : 0;
 }
 
 /** Find the first unused bit. Return -1 if no free block found. */
-int find_first_free_blk_num(void *image, uint32_t lookup)
+int find_first_free_blk_num(fs_ctx *fs, uint32_t lookup)
+{
+    return find_free_blk_near(fs, lookup, 0);
+}
+
+/** Find the first unused bit at or after goal, wrapping around to the start
+ * of the bitmap. Return -1 if no free block found. */
+int find_free_blk_near(fs_ctx *fs, uint32_t lookup, uint32_t goal)
 {
+    void *image = fs->image;
     a1fs_superblock *s = get_superblock(image);
+    uint32_t bit = BITMAP_NONE;
+    goal = alloc_goal(fs, lookup, goal);
     if (lookup == LOOKUP_DB)
     {
         if (s->s_num_free_blocks <= 0)
         {
             return -1;
         }
-        for (uint32_t bit = 0; bit < s->s_num_blocks; bit++)
+        if (fs->free_blks != NULL && fs->alloc_policy == A1FS_ALLOC_BEST_FIT)
         {
-            if (!is_used_bit(image, bit, lookup))
-            {
-                return bit;
-            }
+            // fill the smallest hole first
+            bit = free_index_best_fit(fs->free_blks, 1);
+        }
+        else if (fs->free_blks != NULL)
+        {
+            bit = free_index_first_fit(fs->free_blks, 1, goal);
+            if (bit == BITMAP_NONE)
+                bit = free_index_first_fit(fs->free_blks, 1, 0);
+        }
+        else
+        {
+            bit = bitmap_find_zero(image, lookup, goal, s->s_num_blocks);
+            if (bit == BITMAP_NONE)
+                bit = bitmap_find_zero(image, lookup, 0, goal);
         }
     }
     else if (lookup == LOOKUP_IB)
@@ -174,55 +346,40 @@ int find_first_free_blk_num(void *image, uint32_t lookup)
         {
             return -1;
         }
-        for (uint32_t bit = 0; bit < s->s_num_inodes; bit++)
+        if (fs->free_inodes != NULL)
         {
-            if (!is_used_bit(image, bit, lookup))
-            {
-                return bit;
-            }
+            bit = bitmap_summary_find_zero(fs->free_inodes, goal);
+            if (bit == BITMAP_NONE)
+                bit = bitmap_summary_find_zero(fs->free_inodes, 0);
+        }
+        else
+        {
+            bit = bitmap_find_zero(image, lookup, goal, s->s_num_inodes);
+            if (bit == BITMAP_NONE)
+                bit = bitmap_find_zero(image, lookup, 0, goal);
         }
     }
     else
     {
         perror("Invalid lookup.");
     }
-    return -1;
+    return bit == BITMAP_NONE ? -1 : (int)bit;
 }
 
 /** Initialize empty directory block. */
 void init_directory_blk(void *image, a1fs_blk_t blk_num)
 {
-    a1fs_dentry *dir = (a1fs_dentry *)jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-    for (uint32_t idx = 0; idx < A1FS_BLOCK_SIZE / sizeof(a1fs_dentry); idx++)
-    {
-        (dir + idx)->ino = (a1fs_ino_t) -1;
-    }
-}
-
-/** Find first unused directory entry in the block given its block number. 
- * return the offset of the directory, -1 for excess the max: 512.
-*/
-int find_first_empty_direntry_offset(void *image, a1fs_blk_t blk_num)
-{
-    a1fs_dentry *dir = (a1fs_dentry *)jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-    for (uint32_t offset = 0; offset < A1FS_BLOCK_SIZE / sizeof(a1fs_dentry); offset++)
-    {
-        if ((dir + offset)->ino == (a1fs_ino_t) -1)
-        {
-            return offset;
-        }
-    }
-    return -1;
+    dentries_init(image, jump_to(image, blk_num, A1FS_BLOCK_SIZE), A1FS_BLOCK_SIZE);
 }
 
-uint32_t get_itable_block_offset(a1fs_ino_t inum)
+uint32_t get_itable_block_offset(void *image, a1fs_ino_t inum)
 {
-    return inum / (A1FS_BLOCK_SIZE / sizeof(a1fs_inode));
+    return inum / INODES_PER_BLOCK(image);
 }
 
-uint32_t get_itable_offset(a1fs_ino_t inum)
+uint32_t get_itable_offset(void *image, a1fs_ino_t inum)
 {
-    return inum % (A1FS_BLOCK_SIZE / sizeof(a1fs_inode));
+    return inum % INODES_PER_BLOCK(image);
 }
 
 /** Get inode by inum. */
@@ -235,101 +392,179 @@ a1fs_inode *get_inode_by_inumber(void *image, a1fs_ino_t inum)
         fprintf(stderr, "Invalid inumber %d", inum);
         return NULL;
     }
-    uint32_t itable_blk_offset = get_itable_block_offset(inum) + s->s_inode_table;
-    uint32_t itable_offset = get_itable_offset(inum);
+    // each group has its own slice of the inode table
+    uint32_t group = get_group_of(image, inum, LOOKUP_IB);
+    a1fs_ino_t group_inum = inum - get_group_first_bit(image, group, LOOKUP_IB);
+    uint32_t itable_blk_offset = get_itable_block_offset(image, group_inum) + get_group_desc(image, group)->g_inode_table;
+    uint32_t itable_offset = get_itable_offset(image, group_inum);
 
-    a1fs_inode *itable = (a1fs_inode *)jump_to(image, itable_blk_offset, A1FS_BLOCK_SIZE);
-    return (itable + itable_offset);
+    unsigned char *itable = (unsigned char *)jump_to(image, itable_blk_offset, A1FS_BLOCK_SIZE);
+    return (a1fs_inode *)(itable + itable_offset * s->s_inode_size);
 }
 
-/** Format the block to empty extents. */
-void init_extent_blk(void *image, a1fs_blk_t blk_num) {
-    a1fs_extent *extent_start = (a1fs_extent *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-    for (uint32_t offset = 0; offset < A1FS_BLOCK_SIZE / sizeof(a1fs_extent); offset++) {
-        // set the start of the extent to -1, indicating unused
-        (extent_start + offset)->start = (a1fs_blk_t) -1;
-    }
+/** Get the first data block of the group holding the inode. */
+static a1fs_blk_t inode_goal(fs_ctx *fs, a1fs_inode *ino) {
+    a1fs_blk_t itable_blk = ((unsigned char *)ino - (unsigned char *)fs->image) / A1FS_BLOCK_SIZE;
+    return get_group_desc(fs->image, get_group_of(fs->image, itable_blk, LOOKUP_DB))->g_first_block;
 }
 
-/* Find the first empty extent. Return the offset to the extent that is not used. If 
- * no empty extent found, return -1.
-*/
-int find_first_empty_extent_offset(void *image, a1fs_blk_t blk_num) {
-    a1fs_extent *extent_start = (a1fs_extent *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-    for (uint32_t offset = 0; offset < A1FS_BLOCK_SIZE / sizeof(a1fs_extent); offset++) {
-        // unused if the start is -1
-        if ((extent_start + offset)->start == (a1fs_blk_t) -1) {
-            return offset;
-        }
+/** Add an extent of count blocks starting at block start to the end of the
+ * file. Return 0 on success, -ENOSPC if out of space for the extent tree. */
+int append_extent(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t start, a1fs_blk_t count) {
+    a1fs_extent *last = find_last_used_ext(fs->image, ino);
+    a1fs_extent ext = {
+        .logical = last != NULL ? last->logical + ext_len(last) : 0,
+        .start = start,
+        .count = count,
+    };
+    return extent_tree_insert(fs, ino, &ext);
+}
+
+/** Find a free entry for the name in the directory, adding a dentry block if
+ * all entries are used, as long as num_blk more blocks stay free for the
+ * caller. Return NULL if there is no space. */
+a1fs_dentry *alloc_dentry(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, a1fs_blk_t num_blk) {
+    a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+    if (is_indexed(dir_ino))
+        return dir_index_alloc(fs, dir_ino, name, num_blk);
+    if (!has_n_free_blk(fs, num_blk, LOOKUP_DB))
+        return NULL;
+    a1fs_dentry *dentry = add_dentry_in_dir(fs, dir_inum, name);
+    if (dentry != NULL)
+        return dentry;
+    if (is_inline(dir_ino)) {
+        // the dentries move to a block, which has room for more unless the
+        // inode is nearly as large
+        if (!has_n_free_blk(fs, num_blk + 1, LOOKUP_DB) || uninline_file(fs, dir_ino) != 0)
+            return NULL;
+        dentry = add_dentry_in_dir(fs, dir_inum, name);
+        if (dentry != NULL)
+            return dentry;
     }
-    return -1;
+    // a directory outgrowing its block gets an index, so that finding a
+    // name does not scan every block; without memory for building it, the
+    // directory just grows by a block
+    if (dir_index_build(fs, dir_ino) == 0) {
+        dir_hint_set(&fs->dh, dir_inum, 0);
+        return dir_index_alloc(fs, dir_ino, name, num_blk);
+    }
+    if (!has_n_free_blk(fs, num_blk + 1, LOOKUP_DB))
+        return NULL;
+    // init new dentry block, after the last one
+    a1fs_extent *last = find_last_used_ext(fs->image, dir_ino);
+    a1fs_blk_t blk_num = find_free_blk_near(fs, LOOKUP_DB, last->start + ext_len(last));
+    init_directory_blk(fs->image, blk_num);
+    mask(fs, blk_num, LOOKUP_DB, true);
+    // record new dentry block
+    if (append_extent(fs, dir_ino, blk_num, 1) != 0) {
+        mask(fs, blk_num, LOOKUP_DB, false);
+        return NULL;
+    }
+    return dentries_add(fs->image, jump_to(fs->image, blk_num, A1FS_BLOCK_SIZE), A1FS_BLOCK_SIZE, name);
 }
 
 /** Find the inumber of the file given its name, starting from dir. 
  * Return -1 if not found.
  */
 int find_file_ino_in_dir(void *image, a1fs_inode *dir_ino, char *name) {
-    a1fs_extent *this_extent = (a1fs_extent *) jump_to(image, dir_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t extent_offset = 0; extent_offset < 512; extent_offset++) {
-        if ((this_extent + extent_offset)->start == (a1fs_blk_t) -1) continue;
-        a1fs_dentry *this_dentry;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < (this_extent + extent_offset)->count; blk_offset++) {
-            uint32_t blk_num = (this_extent + extent_offset)->start + blk_offset;
-            this_dentry = (a1fs_dentry *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-            for (uint32_t dentry_offset = 0; dentry_offset < 16; dentry_offset++ ) {
-                if ((this_dentry + dentry_offset)->ino == (a1fs_ino_t) -1) continue;
-                int err = strcmp(name, (this_dentry + dentry_offset)->name);
-                if (err == 0) {
-                    return (this_dentry + dentry_offset)->ino;
-                }
-            }
-        }
+    a1fs_dentry *this_dentry = find_dentry_in_dir(image, dir_ino, name);
+    return this_dentry != NULL ? (int) this_dentry->ino : -1;
+}
+
+/** Find the inumber of the name in the directory, through the lookup cache.
+ * Return -ENOENT if not found, -ENOTDIR if dir_inum is not a directory.
+ */
+int dir_lookup(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name) {
+    a1fs_inode *this_inode = get_inode_by_inumber(fs->image, dir_inum);
+    if (!S_ISDIR(this_inode->mode)) {
+        // Bad path: a component is not a directory
+        return -ENOTDIR;
     }
-    return -1;
+    a1fs_ino_t ino;
+    if (!dcache_lookup(&fs->dc, dir_inum, name, &ino)) {
+        a1fs_dentry *this_dentry = find_dentry_in_dir(fs->image, this_inode, name);
+        ino = this_dentry != NULL ? this_dentry->ino : (a1fs_ino_t) -1;
+        dcache_insert(&fs->dc, dir_inum, name, ino);
+    }
+    // file is not in directory
+    return ino == (a1fs_ino_t) -1 ? -ENOENT : (int) ino;
 }
 
 /** Recursion helper for path traversal. */
 static int path_lookup_helper(char *path, a1fs_ino_t inumber, fs_ctx *fs) {
-    a1fs_inode *this_inode = get_inode_by_inumber(fs->image, inumber);
-    if (this_inode == NULL) perror("Invalid inode");
-    if (S_ISREG(this_inode->mode) != 0) {
-        // Bad path: a component is not a directory
-        return -ENOTDIR;
-    } else {
-        char *filename = strsep(&path, "/");
-        int err = find_file_ino_in_dir(fs->image, this_inode, filename);
-        // file is not in directory
-        if (err == -1) {
-            return -ENOENT;
-        } else if (path == NULL || strcmp(path, "") == 0) {
-            // here, we have reached to the end
-            return err;
-        } else {
-            return path_lookup_helper(path, err, fs);
-        }
+    char *filename = strsep(&path, "/");
+    int err = dir_lookup(fs, inumber, filename);
+    if (err < 0 || path == NULL || strcmp(path, "") == 0) {
+        // here, we have reached to the end
+        return err;
     }
+    return path_lookup_helper(path, err, fs);
 }
 
-/** Find first usable directory entry. Return NULL if no empty dentry => either abort or extend
- * existing extent.
-*/
-a1fs_dentry *find_first_free_dentry(void *image, a1fs_ino_t inum) {
-    a1fs_inode *ino = get_inode_by_inumber(image, inum);
-    a1fs_extent *start_extent = (a1fs_extent *) jump_to(image, ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_extent *this_extent = start_extent; this_extent - start_extent < 512; this_extent++) {
-        if (this_extent->start == (a1fs_blk_t) -1) continue;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < this_extent->count; blk_offset++) {
-            int dentry_offset = find_first_empty_direntry_offset(image, this_extent->start + blk_offset);
-            // no available dentry in this block
-            if (dentry_offset == -1) continue;
-            // else
-            a1fs_dentry *res = (a1fs_dentry *) jump_to(image, this_extent->start + blk_offset, A1FS_BLOCK_SIZE);
-            return res + dentry_offset;
+/** Add an entry for the name in the first dentry area of the unindexed
+ * directory with room for it, unused for the caller to set, starting from the
+ * hint of the directory. Return NULL if there is none. */
+a1fs_dentry *add_dentry_in_dir(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name) {
+    void *image = fs->image;
+    a1fs_inode *dir_ino = get_inode_by_inumber(image, dir_inum);
+    dir_iter it;
+    dir_iter_init(&it, dir_ino);
+    size_t size = 0;
+    void *area;
+    a1fs_blk_t first = is_inline(dir_ino) ? 0 : dir_hint_get(&fs->dh, dir_inum);
+    if (first > 0) {
+        // the blocks before the hint are full
+        dir_iter_seek(image, &it, (uint64_t) first * A1FS_BLOCK_SIZE);
+        area = it.area;
+        size = it.size;
+    } else {
+        area = dir_iter_next_area(image, &it, &size);
+    }
+    a1fs_blk_t end = first;
+    for (; area != NULL; area = dir_iter_next_area(image, &it, &size)) {
+        a1fs_blk_t lblk = dir_iter_tell(&it) / A1FS_BLOCK_SIZE;
+        a1fs_dentry *dentry = dentries_add(image, area, size, name);
+        if (dentry != NULL) {
+            if (!is_inline(dir_ino)) dir_hint_set(&fs->dh, dir_inum, lblk);
+            return dentry;
         }
+        end = lblk + 1;
     }
+    // every block is full; the next one added goes after them
+    if (!is_inline(dir_ino)) dir_hint_set(&fs->dh, dir_inum, end);
     return NULL;
 }
 
+/** Return the offset within the directory of the dentry block holding the
+ * entry, found from the extents of the directory. */
+static a1fs_blk_t dentry_blk_of(void *image, a1fs_inode *dir_ino, a1fs_dentry *d) {
+    a1fs_blk_t blk_num = ((unsigned char *) d - (unsigned char *) image) / A1FS_BLOCK_SIZE;
+    for (a1fs_extent *ext = extent_tree_first(image, dir_ino); ext != NULL;
+         ext = extent_tree_next(image, dir_ino, ext)) {
+        if (blk_num >= ext->start && blk_num < ext->start + ext_len(ext))
+            return ext->logical + (blk_num - ext->start);
+    }
+    assert(false);
+    return 0;
+}
+
+/** Free the entry of the directory, moving the hint of the directory back to
+ * its block, and compact the directory if it is left mostly empty. */
+void free_dentry(fs_ctx *fs, a1fs_ino_t dir_inum, a1fs_dentry *d) {
+    a1fs_inode *dir_ino = get_inode_by_inumber(fs->image, dir_inum);
+    // the size of a directory made by an older version is 0 until compacted
+    size_t bytes = dentry_size(fs->image, dentry_name(fs->image, d));
+    dir_ino->size = dir_ino->size > bytes ? dir_ino->size - bytes : 0;
+    d->ino = (a1fs_ino_t) -1;
+    a1fs_blk_t hint = dir_hint_get(&fs->dh, dir_inum);
+    if (hint != 0 && !is_inline(dir_ino) && !is_indexed(dir_ino)) {
+        a1fs_blk_t lblk = dentry_blk_of(fs->image, dir_ino, d);
+        if (lblk < hint)
+            dir_hint_set(&fs->dh, dir_inum, lblk);
+    }
+    dir_compact_maybe(fs, dir_inum);
+}
+
 /* Returns the inode number for the element at the end of the path
  * if it exists.  If there is any error, return -1.
  * Possible errors include:
@@ -357,146 +592,327 @@ int path_lookup(const char *path, fs_ctx *fs) {
     return err;
 }
 
-/** Initialize inode. */
-void init_inode(void *image, a1fs_ino_t inum, mode_t mode, 
-uint32_t links, uint64_t size, uint32_t extents, a1fs_blk_t ptr_extent) {
+/** Initialize inode with an empty extent tree. */
+void init_inode(void *image, a1fs_ino_t inum, mode_t mode, uint32_t links, uint64_t size) {
     a1fs_inode *this_node = get_inode_by_inumber(image, inum);
+    memset(this_node, 0, get_superblock(image)->s_inode_size);
     this_node->mode = mode;
     this_node->links = links;
     this_node->size = size;
     clock_gettime(CLOCK_REALTIME, &(this_node->mtime));
-    this_node->i_extents = extents;
-    this_node->i_ptr_extent = ptr_extent;
-}
-
-/** Create new dir in dentry. */
-void create_new_dir_in_dentry(void *image, a1fs_dentry *parent_dir, const char *name, mode_t mode) {
-	a1fs_ino_t inum = find_first_free_blk_num(image, LOOKUP_IB);
-    // init new extent block for new dir
-    a1fs_blk_t ext_blk_num = find_first_free_blk_num(image, LOOKUP_DB);
-    init_extent_blk(image, ext_blk_num);
-    mask(image, ext_blk_num, LOOKUP_DB, true);
-    // init new dentry block for new dir
-    a1fs_blk_t dentry_blk_num = find_first_free_blk_num(image, LOOKUP_DB);
-    init_directory_blk(image, dentry_blk_num);
-    mask(image, dentry_blk_num, LOOKUP_DB, true);
-    // set the first extent to the dentry block
-    a1fs_extent *ext_new_dir = (a1fs_extent *) jump_to(image, ext_blk_num, A1FS_BLOCK_SIZE);
-    ext_new_dir->start = dentry_blk_num;
-    ext_new_dir->count = 1;
-    // init new dir's inode
-    init_inode(image, inum, mode, 1, 0, 1, ext_blk_num);
-    mask(image, inum, LOOKUP_IB, true);
+    this_node->i_extents = 0;
+    extent_tree_init(this_node);
+}
+
+/** Initialize an inode whose data is stored inline, empty for now. */
+void init_inline_inode(void *image, a1fs_ino_t inum, mode_t mode, uint32_t links) {
+    init_inode(image, inum, mode, links, 0);
+    a1fs_inode *this_node = get_inode_by_inumber(image, inum);
+    this_node->i_flags = A1FS_INODE_INLINE;
+    if (S_ISDIR(mode))
+        dentries_init(image, inline_data(this_node), inline_capacity(image));
+}
+
+/** Move to the next dentry area of the directory - its inode or its next
+ * dentry block - and return it, storing its size in size. Return NULL after
+ * the last one. */
+void *dir_iter_next_area(void *image, dir_iter *it, size_t *size) {
+    it->off = 0;
+    if (is_inline(it->dir)) {
+        it->area = NULL;
+        if (it->started) return NULL;
+        it->started = true;
+        it->area = inline_data(it->dir);
+        it->size = *size = inline_capacity(image);
+        return it->area;
+    }
+    if (!it->started) {
+        it->started = true;
+        it->ext = extent_tree_first(image, it->dir);
+    } else if (it->ext != NULL && ++it->blk == ext_len(it->ext)) {
+        it->ext = extent_tree_next(image, it->dir, it->ext);
+        it->blk = 0;
+    }
+    // the blocks of the index come after the dentry blocks
+    if (it->ext == NULL || it->ext->logical >= A1FS_DIR_INDEX_BLK) {
+        it->area = NULL;
+        return NULL;
+    }
+    it->area = jump_to(image, it->ext->start + it->blk, A1FS_BLOCK_SIZE);
+    it->size = *size = A1FS_BLOCK_SIZE;
+    return it->area;
+}
+
+/** Return the next entry of the directory, used or not. Return NULL after the
+ * last one. */
+a1fs_dentry *dir_iter_next(void *image, dir_iter *it) {
+    for (;;) {
+        if (it->area != NULL) {
+            a1fs_dentry *dentry = dentries_next(image, it->area, it->size, &it->off);
+            if (dentry != NULL)
+                return dentry;
+        } else if (it->started) {
+            // past the last area
+            return NULL;
+        }
+        size_t size;
+        if (dir_iter_next_area(image, it, &size) == NULL)
+            return NULL;
+    }
+}
+
+/** Move a new iterator to a position returned by dir_iter_tell(). */
+void dir_iter_seek(void *image, dir_iter *it, uint64_t pos) {
+    a1fs_blk_t lblk = pos / A1FS_BLOCK_SIZE;
+    size_t off = pos % A1FS_BLOCK_SIZE;
+    it->started = true;
+    if (is_inline(it->dir)) {
+        if (lblk > 0) return;
+        it->area = inline_data(it->dir);
+        it->size = inline_capacity(image);
+    } else {
+        it->ext = extent_tree_find(image, it->dir, lblk);
+        if (it->ext != NULL && lblk < it->ext->logical + ext_len(it->ext)) {
+            it->blk = lblk - it->ext->logical;
+        } else {
+            // the block is gone; go on from the next one
+            it->ext = it->ext != NULL ? extent_tree_next(image, it->dir, it->ext)
+                                      : extent_tree_first(image, it->dir);
+            it->blk = 0;
+            off = 0;
+        }
+        if (it->ext == NULL || it->ext->logical >= A1FS_DIR_INDEX_BLK) return;
+        it->area = jump_to(image, it->ext->start + it->blk, A1FS_BLOCK_SIZE);
+        it->size = A1FS_BLOCK_SIZE;
+    }
+    // walk from the start of the area, as the records at off may have been
+    // merged into another one since
+    it->off = 0;
+    while (it->off < off && dentries_next(image, it->area, it->size, &it->off) != NULL)
+        ;
+}
+
+/** Move the inline data of the file or directory to a block, giving it an
+ * extent tree. Return 0 on success, -ENOSPC if out of space. */
+int uninline_file(fs_ctx *fs, a1fs_inode *ino) {
+    void *image = fs->image;
+    if (!is_inline(ino)) return 0;
+    bool is_dir = S_ISDIR(ino->mode);
+    // an empty file only needs the tree, which lives in the inode
+    a1fs_blk_t num_blk = is_dir || ino->size > 0 ? 1 : 0;
+    if (!has_n_free_blk(fs, num_blk, LOOKUP_DB)) return -ENOSPC;
+    size_t capacity = inline_capacity(image);
+    unsigned char data[A1FS_BLOCK_SIZE];
+    memcpy(data, inline_data(ino), capacity);
+    memset(inline_data(ino), 0, capacity);
+    ino->i_flags &= ~A1FS_INODE_INLINE;
+    ino->i_extents = 0;
+    extent_tree_init(ino);
+    if (num_blk == 0) return 0;
+    // copy the data to its block; the root of the tree has room for it
+    a1fs_blk_t blk_num = find_free_blk_near(fs, LOOKUP_DB, inode_goal(fs, ino));
+    unsigned char *blk = (unsigned char *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
+    if (is_dir) {
+        init_directory_blk(image, blk_num);
+        size_t off = 0;
+        for (a1fs_dentry *d; (d = dentries_next(image, data, capacity, &off)) != NULL;) {
+            if (d->ino == (a1fs_ino_t) -1) continue;
+            dentries_add(image, blk, A1FS_BLOCK_SIZE, dentry_name(image, d))->ino = d->ino;
+        }
+    } else {
+        memset(blk, 0, A1FS_BLOCK_SIZE);
+        memcpy(blk, data, ino->size);
+    }
+    mask(fs, blk_num, LOOKUP_DB, true);
+    append_extent(fs, ino, blk_num, 1);
+    return 0;
+}
+
+/** Pick the group of a new directory, Orlov style. Directories in the root go
+ * to the group with the fewest directories among those with more free inodes
+ * and blocks than average. Other directories stay in the group of their
+ * parent, or the next one, unless it is short of space or crowded. */
+static uint32_t find_dir_group(fs_ctx *fs, a1fs_ino_t parent_inum) {
+    void *image = fs->image;
+    uint32_t num_groups = fs->s->s_num_groups;
+    uint32_t parent_group = get_group_of(image, parent_inum, LOOKUP_IB);
+    uint32_t avg_free_inodes = fs->s->s_num_free_inodes / num_groups;
+    uint32_t avg_free_blocks = fs->s->s_num_free_blocks / num_groups;
+    uint64_t num_dirs = 0;
+    for (uint32_t group = 0; group < num_groups; group++)
+        num_dirs += get_group_desc(image, group)->g_num_dirs;
+    uint32_t avg_dirs = num_dirs / num_groups;
+    uint32_t best = (uint32_t) -1;
+    if (parent_inum == fs->root_inum) {
+        for (uint32_t group = 0; group < num_groups; group++) {
+            a1fs_group_desc *gd = get_group_desc(image, group);
+            if (gd->g_num_free_inodes == 0 || gd->g_num_free_inodes < avg_free_inodes
+                || gd->g_num_free_blocks < avg_free_blocks)
+                continue;
+            if (best == (uint32_t) -1 || gd->g_num_dirs < get_group_desc(image, best)->g_num_dirs)
+                best = group;
+        }
+    } else {
+        uint32_t min_inodes = avg_free_inodes / 4 > 0 ? avg_free_inodes / 4 : 1;
+        uint32_t min_blocks = avg_free_blocks / 4;
+        for (uint32_t i = 0; i < num_groups; i++) {
+            uint32_t group = (parent_group + i) % num_groups;
+            a1fs_group_desc *gd = get_group_desc(image, group);
+            if (gd->g_num_dirs <= avg_dirs + ORLOV_MAX_DIR_DEBT && gd->g_num_free_inodes >= min_inodes
+                && gd->g_num_free_blocks >= min_blocks) {
+                best = group;
+                break;
+            }
+        }
+    }
+    if (best == (uint32_t) -1) {
+        // every group is short of something; take the one with most inodes
+        for (uint32_t group = 0; group < num_groups; group++) {
+            if (best == (uint32_t) -1 || get_group_desc(image, group)->g_num_free_inodes
+                > get_group_desc(image, best)->g_num_free_inodes)
+                best = group;
+        }
+    }
+    return best;
+}
+
+/** Pick the inode for a new file or directory in the parent directory.
+ * Return -1 if no inode is free. */
+static a1fs_ino_t find_new_inode(fs_ctx *fs, a1fs_ino_t parent_inum, bool is_dir) {
+    void *image = fs->image;
+    uint32_t parent_group = get_group_of(image, parent_inum, LOOKUP_IB);
+    if (fs->inode_placement == A1FS_PLACE_LINEAR || fs->alloc_policy == A1FS_ALLOC_NEXT_FIT)
+        return find_free_blk_near(fs, LOOKUP_IB, get_group_first_bit(image, parent_group, LOOKUP_IB));
+    if (!is_dir) {
+        // the inode table block of the parent, or the closest one after it
+        return find_free_blk_near(fs, LOOKUP_IB, parent_inum - parent_inum % INODES_PER_BLOCK(image));
+    }
+    // directories start an unused inode table block when there is one, so
+    // that their files can be placed next to them
+    uint32_t group = find_dir_group(fs, parent_inum);
+    uint32_t start = get_group_first_bit(image, group, LOOKUP_IB);
+    uint32_t end = get_group_end_bit(image, group, LOOKUP_IB);
+    uint32_t goal = group == parent_group ? parent_inum : start;
+    uint32_t per_blk = INODES_PER_BLOCK(image);
+    uint32_t inum = bitmap_find_zero_chunk(image, LOOKUP_IB, per_blk, goal, end);
+    if (inum == BITMAP_NONE)
+        inum = bitmap_find_zero_chunk(image, LOOKUP_IB, per_blk, start, goal);
+    if (inum != BITMAP_NONE)
+        return inum;
+    return find_free_blk_near(fs, LOOKUP_IB, start);
+}
+
+void create_new_dir_in_dentry(fs_ctx *fs, a1fs_ino_t parent_inum, a1fs_dentry *parent_dir,
+mode_t mode) {
+    void *image = fs->image;
+    a1fs_ino_t inum = find_new_inode(fs, parent_inum, true);
+    a1fs_group_desc *gd = get_group_desc(image, get_group_of(image, inum, LOOKUP_IB));
+    gd->g_num_dirs++;
+    if (inline_capacity(image) >= dentry_size(image, "")) {
+        // the first dentries fit in the inode
+        init_inline_inode(image, inum, mode, 1);
+    } else {
+        // init new dentry block for new dir
+        a1fs_blk_t dentry_blk_num = find_free_blk_near(fs, LOOKUP_DB, gd->g_first_block);
+        init_directory_blk(image, dentry_blk_num);
+        mask(fs, dentry_blk_num, LOOKUP_DB, true);
+        // init new dir's inode and set the first extent to the dentry block;
+        // the root of the tree has room for it
+        init_inode(image, inum, mode, 1, 0);
+        append_extent(fs, get_inode_by_inumber(image, inum), dentry_blk_num, 1);
+    }
+    mask(fs, inum, LOOKUP_IB, true);
     // record in parent dentry
     parent_dir->ino = inum;
-    strncpy(parent_dir->name, name, A1FS_NAME_MAX);
-    int len = strlen(name);
-    if (len < A1FS_NAME_MAX)
-        parent_dir->name[strlen(name)] = '\0';
-    else
-        parent_dir->name[A1FS_NAME_MAX - 1] = '\0';
+    get_inode_by_inumber(image, parent_inum)->size += dentry_size(image, dentry_name(image, parent_dir));
 }
 
-/** Traverse all extent of dir_ino to find name; return the inum of the file. */
+/** Find the entry of the directory with the given name, through its index if
+ * it has one. Return NULL if there is none. */
 a1fs_dentry *find_dentry_in_dir(void *image, a1fs_inode *dir_ino, const char *name) {
-    a1fs_extent *this_extent = (a1fs_extent *) jump_to(image, dir_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t extent_offset = 0; extent_offset < 512; extent_offset++) {
-        if ((this_extent + extent_offset)->start == (a1fs_blk_t) -1) continue;
-        a1fs_dentry *this_dentry;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < (this_extent + extent_offset)->count; blk_offset++) {
-            uint32_t blk_num = (this_extent + extent_offset)->start + blk_offset;
-            this_dentry = (a1fs_dentry *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-            for (uint32_t dentry_offset = 0; dentry_offset < 16; dentry_offset++ ) {
-                if ((this_dentry + dentry_offset)->ino == (a1fs_ino_t) -1) continue;
-                int err = strcmp(name, (this_dentry + dentry_offset)->name);
-                if (err == 0) {
-                    return this_dentry + dentry_offset;
-                }
-            }
-        }
+    if (is_indexed(dir_ino))
+        return dir_index_find(image, dir_ino, name);
+    dir_iter it;
+    dir_iter_init(&it, dir_ino);
+    for (a1fs_dentry *this_dentry; (this_dentry = dir_iter_next(image, &it)) != NULL;) {
+        if (this_dentry->ino == (a1fs_ino_t) -1) continue;
+        if (strcmp(name, dentry_name(image, this_dentry)) == 0)
+            return this_dentry;
     }
     return NULL;
 }
 
 /** Return true if all associated dentry is empty, else false. */
 bool is_empty_dir(void *image, a1fs_inode *dir_ino) {
-    a1fs_extent *this_extent = (a1fs_extent *) jump_to(image, dir_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t extent_offset = 0; extent_offset < 512; extent_offset++) {
-        if ((this_extent + extent_offset)->start == (a1fs_blk_t) -1) continue;
-        a1fs_dentry *this_dentry;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < (this_extent + extent_offset)->count; blk_offset++) {
-            uint32_t blk_num = (this_extent + extent_offset)->start + blk_offset;
-            this_dentry = (a1fs_dentry *) jump_to(image, blk_num, A1FS_BLOCK_SIZE);
-            for (uint32_t dentry_offset = 0; dentry_offset < 16; dentry_offset++ ) {
-                if ((this_dentry + dentry_offset)->ino != (a1fs_ino_t) -1) {
-                    return false;
-                }
-            }
-        }
+    dir_iter it;
+    dir_iter_init(&it, dir_ino);
+    for (a1fs_dentry *this_dentry; (this_dentry = dir_iter_next(image, &it)) != NULL;) {
+        if (this_dentry->ino != (a1fs_ino_t) -1)
+            return false;
     }
     return true;
 }
 
 /** Find all blk num of dentry blk associated with ino, mask the blk in bitmap as 0. */
-void free_dentry_blks(void *image, a1fs_inode *dir_ino) {
-    a1fs_extent *this_extent = (a1fs_extent *) jump_to(image, dir_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t extent_offset = 0; extent_offset < 512; extent_offset++) {
-        if ((this_extent + extent_offset)->start == (a1fs_blk_t) -1) continue;
-        for (a1fs_blk_t blk_offset = 0; blk_offset < (this_extent + extent_offset)->count; blk_offset++) {
-            uint32_t blk_num = (this_extent + extent_offset)->start + blk_offset;
-            mask(image, blk_num, LOOKUP_DB, false); 
-        }
+void free_dentry_blks(fs_ctx *fs, a1fs_inode *dir_ino) {
+    // inline data has no blocks
+    if (is_inline(dir_ino)) return;
+    for (a1fs_extent *this_extent = extent_tree_first(fs->image, dir_ino); this_extent != NULL;
+         this_extent = extent_tree_next(fs->image, dir_ino, this_extent)) {
+        a1fs_blk_t start = this_extent->start;
+        mask_range(fs, start, start + ext_len(this_extent), LOOKUP_DB, false);
     }
 }
 
+/** Mask 0 the blocks of the extent tree. */
+void free_extent_blk(fs_ctx *fs, a1fs_inode *ino_rm) {
+    if (is_inline(ino_rm)) return;
+    extent_tree_free(fs, ino_rm);
+}
+
 /** Create an empty file inside the directory. */
-void create_new_file_in_dentry(void *image, a1fs_dentry *dir, const char *name, mode_t mode) {
-    a1fs_ino_t new_file_inum = find_first_free_blk_num(image, LOOKUP_IB);
-    a1fs_blk_t new_file_ext_bnum = find_first_free_blk_num(image, LOOKUP_DB);
-    init_extent_blk(image, new_file_ext_bnum);
-    mask(image, new_file_ext_bnum, LOOKUP_DB, true);
-    init_inode(image, new_file_inum, mode, 1, 0, 0, new_file_ext_bnum);
-    mask(image, new_file_inum, LOOKUP_IB, true);
+void create_new_file_in_dentry(fs_ctx *fs, a1fs_ino_t parent_inum, a1fs_dentry *dir,
+mode_t mode) {
+    void *image = fs->image;
+    a1fs_ino_t new_file_inum = find_new_inode(fs, parent_inum, false);
+    // the file gets blocks once its data outgrows the inode
+    init_inline_inode(image, new_file_inum, mode, 1);
+    mask(fs, new_file_inum, LOOKUP_IB, true);
     dir->ino = new_file_inum;
-    strncpy(dir->name, name, A1FS_NAME_MAX);
-    dir->name[strlen(name)] = '\0';
+    get_inode_by_inumber(image, parent_inum)->size += dentry_size(image, dentry_name(image, dir));
 }
 
-/** Find the last used extent. */
+/** Find the last used extent, NULL if the file has none. */
 a1fs_extent *find_last_used_ext(void *image, a1fs_inode *ino) {
-    a1fs_extent *last_used = NULL;
-    a1fs_extent *this = (a1fs_extent *)jump_to(image, ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    for (a1fs_blk_t offset = 0; offset < 512; offset++) {
-        if ((this + offset)->start != (a1fs_blk_t) -1) {
-            last_used = (this + offset);
-        }
-    }
-    return last_used;
+    return extent_tree_last(image, ino);
 }
 
-/** Shrink the extent by n block. Mask off blocks and unset extent if 
+/** Shrink the extent by n block. Mask off blocks and remove the extent if
  * the extent is empty. Return the number of extent reduced. */
-int shrink_ext_by_num_blk(void *image, a1fs_extent *ext, a1fs_blk_t *num) {
-    a1fs_blk_t ext_size = ext->count;
+int shrink_ext_by_num_blk(fs_ctx *fs, a1fs_inode *ino, a1fs_extent *ext, a1fs_blk_t *num) {
+    a1fs_blk_t ext_size = ext_len(ext);
+    // unwritten blocks were never written, there is nothing to erase
+    bool erase = !ext_is_unwritten(ext);
     if (*num >= ext_size) {
         // delete whole extent and free blocks
-        for (a1fs_blk_t offset = 0; offset < ext_size; offset++) {
-            void *blk = jump_to(image, ext->start + offset, A1FS_BLOCK_SIZE);
+        for (a1fs_blk_t offset = 0; erase && offset < ext_size; offset++) {
+            void *blk = jump_to(fs->image, ext->start + offset, A1FS_BLOCK_SIZE);
             // erase block
             memset(blk, 0, A1FS_BLOCK_SIZE);
-            // mask block to unused
-            mask(image, ext->start + offset, LOOKUP_DB, false);
         }
-        ext->start = (a1fs_blk_t) -1;
+        // mask blocks to unused
+        mask_range(fs, ext->start, ext->start + ext_size, LOOKUP_DB, false);
+        extent_tree_remove(fs, ino, ext);
         *num -= ext_size;
         return 1;
     } else {
         // shrink by num
-        for (a1fs_blk_t offset = 1; offset < *num + 1; offset++) {
-            void *blk = jump_to(image, ext->start + ext->count - offset, A1FS_BLOCK_SIZE);
+        for (a1fs_blk_t offset = 1; erase && offset < *num + 1; offset++) {
+            void *blk = jump_to(fs->image, ext->start + ext_size - offset, A1FS_BLOCK_SIZE);
             memset(blk, 0, A1FS_BLOCK_SIZE);
-            mask(image, ext->start + ext->count - offset, LOOKUP_DB, false);
         }
+        ext->count -= *num;
+        mask_range(fs, ext->start + ext_size - *num, ext->start + ext_size, LOOKUP_DB, false);
         *num = 0;
         return 0;
     }
@@ -510,150 +926,480 @@ void shrink_blk_to_size(void *image, a1fs_blk_t blk_num, size_t size) {
 };
 
 /** Shrink the file by num of block. */
-void shrink_by_num_blk(void *image, a1fs_inode *ino, a1fs_blk_t num_blk) {
+void shrink_by_num_blk(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t num_blk) {
     a1fs_extent *last_ext;
     while (num_blk > 0) {
-        last_ext = find_last_used_ext(image, ino);
-        ino->i_extents -= shrink_ext_by_num_blk(image, last_ext, &num_blk);
+        last_ext = find_last_used_ext(fs->image, ino);
+        shrink_ext_by_num_blk(fs, ino, last_ext, &num_blk);
     }
 };
 
 /** Shrink amount of bytes specified in size. */
-int shrink_by_amount(void *image, a1fs_inode *ino, size_t size) {
-    // remove the non-block ending of the file
-    size_t tailing = ino->size % A1FS_BLOCK_SIZE;
-    a1fs_extent *last_extent = find_last_used_ext(image, ino);
-    if (tailing != 0) {
-        a1fs_blk_t last_blk = last_extent->start + last_extent->count - 1;
-        if (tailing > size) {
-            // shrink in tailing block
-            shrink_blk_to_size(image, last_blk, tailing - size);
-            size = 0;
-        } else {
-            // remove tailing block
-            shrink_blk_to_size(image, last_blk, 0);
-            last_extent->count--;
-            // remove extent if empty
-            if (last_extent->count == 0) {
-                last_extent->start = (a1fs_blk_t) -1;
-                ino->i_extents--;
-            }
-            // update the amount
-            size -= tailing;
-        }
+int shrink_by_amount(fs_ctx *fs, a1fs_inode *ino, size_t size) {
+    uint64_t new_size = ino->size - size;
+    // inline data past the end of the file is kept zeroed
+    if (is_inline(ino)) {
+        memset(inline_data(ino) + new_size, 0, size);
+        return 0;
+    }
+    // free the blocks past the new end of the file, preallocated ones
+    // included; there may be holes between them
+    a1fs_blk_t new_num_blk = CEIL_DIV(new_size, A1FS_BLOCK_SIZE);
+    a1fs_extent *last_ext;
+    while ((last_ext = find_last_used_ext(fs->image, ino)) != NULL
+           && last_ext->logical + ext_len(last_ext) > new_num_blk) {
+        a1fs_blk_t num = last_ext->logical >= new_num_blk ? ext_len(last_ext)
+                         : last_ext->logical + ext_len(last_ext) - new_num_blk;
+        shrink_ext_by_num_blk(fs, ino, last_ext, &num);
     }
-    a1fs_blk_t shrink_blk = size / A1FS_BLOCK_SIZE;
-    size_t shrink_to_bytes = A1FS_BLOCK_SIZE - size % A1FS_BLOCK_SIZE;
-    // shrink by blocks
-    if (shrink_blk != 0)
-        shrink_by_num_blk(image, ino, shrink_blk);
-    // now shrink within one block
-    if (shrink_to_bytes != 0) {
-        last_extent = find_last_used_ext(image, ino);
-        shrink_blk_to_size(image, last_extent->start + last_extent->count - 1, shrink_to_bytes);
+    // now shrink within the new last block, unless it is a hole
+    size_t tailing = new_size % A1FS_BLOCK_SIZE;
+    if (tailing != 0) {
+        a1fs_blk_t ext_offset;
+        a1fs_extent *ext = find_ext_given_offset(fs->image, ino, new_size / A1FS_BLOCK_SIZE, &ext_offset);
+        if (ext != NULL && !ext_is_unwritten(ext))
+            shrink_blk_to_size(fs->image, ext->start + ext_offset, tailing);
     }
     return 0;
 }
 
-/** Find the starting block num for consecutive n. Return -1 is unfound. */
-static a1fs_blk_t window_slide(fs_ctx *fs, a1fs_blk_t n) {
-    a1fs_blk_t max = fs->s->s_num_blocks;
-    bool valid;
-    for (a1fs_blk_t this_blk = 0; this_blk <= max - n; this_blk++) {
-        valid = true;
-        for (a1fs_blk_t offset = 0; offset < n; offset++) {
-            if (is_used_bit(fs->image, this_blk + offset, LOOKUP_DB)) {
-                valid = false; break;
-            }
+/** Find a run of up to *n free blocks, preferring exactly *n at or after goal.
+ * Set *n to the length of the run found. Return the starting block num, -1 if
+ * unfound. */
+static a1fs_blk_t find_free_run(fs_ctx *fs, a1fs_blk_t *n, a1fs_blk_t goal) {
+    goal = alloc_goal(fs, LOOKUP_DB, goal);
+    if (fs->free_blks != NULL) {
+        a1fs_blk_t start;
+        if (fs->alloc_policy == A1FS_ALLOC_BEST_FIT) {
+            start = free_index_best_fit(fs->free_blks, *n);
+        } else {
+            start = free_index_first_fit(fs->free_blks, *n, goal);
+            if (start == BITMAP_NONE)
+                start = free_index_first_fit(fs->free_blks, *n, 0);
         }
-        if (valid)
-            return this_blk;
+        if (start != BITMAP_NONE) return start;
+        // no run is long enough, take the largest one there is
+        a1fs_blk_t len;
+        start = free_index_largest(fs->free_blks, &len);
+        if (len < *n) *n = len;
+        return start;
+    }
+    // without the index, try shorter and shorter runs; best-fit then
+    // degrades to first-fit
+    for (; *n > 0; (*n)--) {
+        a1fs_blk_t start = bitmap_find_zero_run(fs->image, LOOKUP_DB, *n, goal, fs->s->s_num_blocks);
+        if (start == BITMAP_NONE)
+            start = bitmap_find_zero_run(fs->image, LOOKUP_DB, *n, 0, fs->s->s_num_blocks);
+        if (start != BITMAP_NONE) return start;
     }
     return -1;
 }
 
-/** Extend the file by specified bytes. */
-int extend_by_amount(fs_ctx *fs, a1fs_inode *ino, size_t size) {
-    size_t num_tailing_data_byte = ino->size % A1FS_BLOCK_SIZE;
-    size_t num_tailing_blank_byte;
-    if (num_tailing_data_byte == 0) {
-        num_tailing_blank_byte = 0;
-    } else {
-        num_tailing_blank_byte = A1FS_BLOCK_SIZE - num_tailing_data_byte;
-    }
-    // make use of the trailing blank bytes
-    a1fs_extent *last_ext = find_last_used_ext(fs->image, ino);
-    if (num_tailing_blank_byte != 0) {
-        a1fs_blk_t last_blk = last_ext->start + last_ext->count - 1;
-        unsigned char *tailing_blank_start = (unsigned char *)jump_to(fs->image, last_blk, A1FS_BLOCK_SIZE);
-        tailing_blank_start += num_tailing_data_byte;
-        // format tailing blank to use
-        memset(tailing_blank_start, 0, num_tailing_blank_byte);
-    }
-    // if the extending size is less or equal to the tailing blank, then we are done
-    if (num_tailing_blank_byte >= size) return 0;
-    // ------------- new blocks need to be assigned ----------------
-    // calculate the number of new blocks needed after making use of tailing blanks
-    a1fs_blk_t num_extend_blk = CEIL_DIV(size - num_tailing_blank_byte, A1FS_BLOCK_SIZE);
-    // if the system can't store, return nospc
-    if (!has_n_free_blk(fs, num_extend_blk, LOOKUP_DB)) return -ENOSPC;
-    // in a loop, we store all blocks, i.e. num_extend_blk = 0
-    a1fs_blk_t n = num_extend_blk;
-    while (num_extend_blk) {
-        // use window sliding to find the largest possible consecutive blocks
-        a1fs_blk_t extent_start = window_slide(fs, n);
+/** Get the block offset past the last extent of the file, i.e. its size in
+ * blocks including the ones preallocated past its end. */
+a1fs_blk_t count_file_blks(void *image, a1fs_inode *ino) {
+    if (is_inline(ino)) return 0;
+    a1fs_extent *last = find_last_used_ext(image, ino);
+    return last != NULL ? last->logical + ext_len(last) : 0;
+}
+
+/** Get the number of blocks allocated to the file; holes have none. */
+a1fs_blk_t count_alloc_blks(void *image, a1fs_inode *ino) {
+    if (is_inline(ino)) return 0;
+    a1fs_blk_t num = 0;
+    for (a1fs_extent *ext = extent_tree_first(image, ino); ext != NULL; ext = extent_tree_next(image, ino, ext))
+        num += ext_len(ext);
+    return num;
+}
+
+/** Return the first extent of the file that ends after block b, NULL if
+ * there is none. */
+static a1fs_extent *find_ext_from(void *image, a1fs_inode *ino, a1fs_blk_t b) {
+    a1fs_extent *ext = extent_tree_find(image, ino, b);
+    if (ext != NULL) return b - ext->logical < ext_len(ext) ? ext : extent_tree_next(image, ino, ext);
+    // nothing starts at or before b, so the first extent is the one, unless
+    // it does start before b; never hand out an extent that ends by b
+    ext = extent_tree_first(image, ino);
+    while (ext != NULL && ext->logical + ext_len(ext) <= b) ext = extent_tree_next(image, ino, ext);
+    return ext;
+}
+
+/** Give blocks [first, first + num) of the file, which must be a hole, new
+ * blocks, marked unwritten if unwritten is true, else zeroed. Return 0 on
+ * success, -ENOSPC if out of space. */
+static int alloc_blks_at(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t first, a1fs_blk_t num, bool unwritten) {
+    a1fs_blk_t flag = unwritten ? A1FS_EXTENT_UNWRITTEN : 0;
+    // the extent right before the hole, if it ends where the hole starts
+    a1fs_extent *prev_ext = first > 0 ? extent_tree_find(fs->image, ino, first - 1) : NULL;
+    if (prev_ext != NULL && prev_ext->logical + ext_len(prev_ext) != first) prev_ext = NULL;
+    // in a loop, we store all blocks, i.e. num = 0
+    while (num) {
+        // find the largest possible consecutive blocks
+        // place the data right after the previous extent if possible
+        a1fs_blk_t goal = prev_ext != NULL ? prev_ext->start + ext_len(prev_ext) : inode_goal(fs, ino);
+        a1fs_blk_t n = num;
+        a1fs_blk_t extent_start = find_free_run(fs, &n, goal);
         if (extent_start == (a1fs_blk_t) -1) {
-            // extent of this length cannot be found, try a smaller one
-            n--;
-            continue;
+            return -ENOSPC;
         } else {
-            // we have found an extent of length n, starting at extent_start
-            if (last_ext->start + last_ext->count == extent_start) {
-                // extend last extent
-                last_ext->count += n;
+            // we have found an extent of length n, starting at extent_start;
+            // mask it used first so that the extent tree can't take it
+            mask_range(fs, extent_start, extent_start + n, LOOKUP_DB, true);
+            if (prev_ext != NULL && prev_ext->start + ext_len(prev_ext) == extent_start
+                && ext_is_unwritten(prev_ext) == unwritten) {
+                // extend previous extent
+                prev_ext->count += n;
             } else {
                 // ------------- need a new extent --------------
-                a1fs_blk_t ext_offset = find_first_empty_extent_offset(fs->image, ino->i_ptr_extent);
-                if (ext_offset == (a1fs_blk_t) -1) {
+                a1fs_extent ext = { .logical = first, .start = extent_start, .count = n | flag };
+                if (extent_tree_insert(fs, ino, &ext) != 0) {
+                    mask_range(fs, extent_start, extent_start + n, LOOKUP_DB, false);
                     return -ENOSPC;
-                } else {
-                    // store block info in the new extent
-                    a1fs_extent *new_ext = (a1fs_extent *)jump_to(fs->image, ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-                    new_ext += ext_offset;
-                    new_ext->start = extent_start;
-                    new_ext->count = n;
-                    // update number of extents
-                    ino->i_extents++;
-                }   
+                }
+            }
+            prev_ext = extent_tree_find(fs->image, ino, first);
+            // format new space; unwritten blocks read as zeros without it
+            if (!unwritten) {
+                void *start_blk = jump_to(fs->image, extent_start, A1FS_BLOCK_SIZE);
+                memset(start_blk, 0, (size_t) n * A1FS_BLOCK_SIZE);
             }
-            // format new space
-            void *start_blk = jump_to(fs->image, extent_start, A1FS_BLOCK_SIZE);
-            memset(start_blk, 0, n * A1FS_BLOCK_SIZE);
-            // mask used
-            mask_range(fs->image, extent_start, extent_start + n, LOOKUP_DB, true);
             // update number of blocks to find
-            num_extend_blk -= n;
+            first += n;
+            num -= n;
+        }
+    }
+    return 0;
+}
+
+/** Give the holes among blocks [first, first + num) of the file new blocks,
+ * marked unwritten if unwritten is true, else zeroed. Return 0 on success,
+ * -ENOSPC if out of space. */
+int alloc_file_range(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t first, a1fs_blk_t num, bool unwritten) {
+    assert(!is_inline(ino));
+    a1fs_blk_t end = first + num;
+    a1fs_blk_t b = first;
+    while (b < end) {
+        a1fs_extent *ext = find_ext_from(fs->image, ino, b);
+        if (ext != NULL && ext->logical <= b) {
+            b = ext->logical + ext_len(ext);
+            continue;
+        }
+        // a hole up to the next extent
+        a1fs_blk_t hole_end = ext != NULL && ext->logical < end ? ext->logical : end;
+        // if the system can't store, return nospc
+        if (!has_n_free_blk(fs, hole_end - b, LOOKUP_DB)) return -ENOSPC;
+        int err = alloc_blks_at(fs, ino, b, hole_end - b, unwritten);
+        if (err != 0) return err;
+        b = hole_end;
+    }
+    return 0;
+}
+
+/** Append num new blocks to the file, marked unwritten if unwritten is true,
+ * else zeroed. Return 0 on success, -ENOSPC if out of space. */
+int alloc_file_blks(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t num, bool unwritten) {
+    return alloc_file_range(fs, ino, count_file_blks(fs->image, ino), num, unwritten);
+}
+
+/** Extend the file by specified bytes. The new range past the last block is
+ * left as a hole, which reads as zeros and has no blocks. */
+int extend_by_amount(fs_ctx *fs, a1fs_inode *ino, size_t size) {
+    if (is_inline(ino)) {
+        // the bytes past the end of the file are zeros already
+        if (ino->size + size <= inline_capacity(fs->image)) return 0;
+        int err = uninline_file(fs, ino);
+        if (err != 0) return err;
+    }
+    size_t num_tailing_data_byte = ino->size % A1FS_BLOCK_SIZE;
+    // make use of the trailing blank bytes
+    if (num_tailing_data_byte != 0) {
+        a1fs_blk_t ext_offset;
+        a1fs_extent *ext = find_ext_given_offset(fs->image, ino, ino->size / A1FS_BLOCK_SIZE, &ext_offset);
+        if (ext != NULL && !ext_is_unwritten(ext)) {
+            unsigned char *tailing_blank_start = (unsigned char *)jump_to(fs->image, ext->start + ext_offset, A1FS_BLOCK_SIZE);
+            tailing_blank_start += num_tailing_data_byte;
+            // format tailing blank to use
+            memset(tailing_blank_start, 0, A1FS_BLOCK_SIZE - num_tailing_data_byte);
+        }
+    }
+    // the rest of the new range is a hole until it is written
+    return 0;
+}
+
+/** Return true if block b of the file is inside, but not at the start of, an
+ * extent whose unwritten flag is not flag. */
+static bool must_split_at(void *image, a1fs_inode *ino, a1fs_blk_t b, a1fs_blk_t flag) {
+    a1fs_extent *ext = extent_tree_find(image, ino, b);
+    return ext != NULL && b != ext->logical && b - ext->logical < ext_len(ext)
+        && (ext->count & A1FS_EXTENT_UNWRITTEN) != flag;
+}
+
+/** Split the extent holding block b of the file, if any, so that b starts an
+ * extent. Return 0 on success, -ENOSPC if out of space. */
+static int split_ext(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t b) {
+    a1fs_extent *ext = extent_tree_find(fs->image, ino, b);
+    if (ext == NULL || b == ext->logical || b - ext->logical >= ext_len(ext)) return 0;
+    a1fs_blk_t cut = b - ext->logical;
+    a1fs_extent tail = {
+        .logical = b,
+        .start = ext->start + cut,
+        .count = (ext_len(ext) - cut) | (ext->count & A1FS_EXTENT_UNWRITTEN),
+    };
+    // insert first, so that nothing is lost if it fails
+    int err = extent_tree_insert(fs, ino, &tail);
+    if (err != 0) return err;
+    ext = extent_tree_find(fs->image, ino, b - 1);
+    ext->count -= tail.count & ~A1FS_EXTENT_UNWRITTEN;
+    return 0;
+}
+
+/** Split the extent holding block b of the file so that b starts an extent,
+ * if must_split_at() says so. Return 0 on success, -ENOSPC if out of space. */
+static int split_ext_at(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t b, a1fs_blk_t flag) {
+    if (!must_split_at(fs->image, ino, b, flag)) return 0;
+    return split_ext(fs, ino, b);
+}
+
+/** Mark blocks [first, first + num) of the file as unwritten or written,
+ * splitting and merging extents as needed. Return 0 on success, -ENOSPC if
+ * out of space for the extent tree (nothing is changed then). */
+int set_blks_unwritten(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t first, a1fs_blk_t num, bool unwritten) {
+    void *image = fs->image;
+    a1fs_blk_t flag = unwritten ? A1FS_EXTENT_UNWRITTEN : 0;
+    a1fs_blk_t end = first + num;
+    // cutting the extents at both ends of the range adds at most two, each
+    // of which may split a block on every level of the tree and the root
+    int splits = must_split_at(image, ino, first, flag) + must_split_at(image, ino, end, flag);
+    if (splits > 0 && !has_n_free_blk(fs, splits * (extent_tree_depth(image, ino) + 2), LOOKUP_DB))
+        return -ENOSPC;
+    split_ext_at(fs, ino, end, flag);
+    split_ext_at(fs, ino, first, flag);
+    __atomic_add_fetch(&fs->ext_gen, 1, __ATOMIC_RELAXED);
+
+    // every extent in the range now lies entirely inside it
+    a1fs_extent *ext = find_ext_from(image, ino, first);
+    for (; ext != NULL && ext->logical < end; ext = extent_tree_next(image, ino, ext)) {
+        ext->count = ext_len(ext) | flag;
+    }
+
+    // merge neighbours that became alike; extents in different leaves of the
+    // tree are left apart
+    ext = find_ext_from(image, ino, first > 0 ? first - 1 : 0);
+    while (ext != NULL && ext->logical <= end) {
+        a1fs_extent *next = extent_tree_next(image, ino, ext);
+        if (next == ext + 1 && next->logical == ext->logical + ext_len(ext)
+            && next->start == ext->start + ext_len(ext)
+            && (next->count & A1FS_EXTENT_UNWRITTEN) == (ext->count & A1FS_EXTENT_UNWRITTEN)) {
+            a1fs_blk_t logical = ext->logical;
+            ext->count += ext_len(next);
+            extent_tree_remove(fs, ino, next);
+            ext = extent_tree_find(image, ino, logical);
+        } else {
+            ext = next;
         }
     }
     return 0;
 }
 
+/** Zero bytes [offset, end) of the file if they are written. */
+static void zero_file_range(void *image, a1fs_inode *ino, uint64_t offset, uint64_t end) {
+    while (offset < end) {
+        a1fs_blk_t ext_offset;
+        a1fs_extent *ext = find_ext_given_offset(image, ino, offset / A1FS_BLOCK_SIZE, &ext_offset);
+        size_t byte_start = offset % A1FS_BLOCK_SIZE;
+        size_t n = A1FS_BLOCK_SIZE - byte_start < end - offset ? A1FS_BLOCK_SIZE - byte_start : end - offset;
+        if (ext != NULL && !ext_is_unwritten(ext)) {
+            unsigned char *blk = (unsigned char *)jump_to(image, ext->start + ext_offset, A1FS_BLOCK_SIZE);
+            memset(blk + byte_start, 0, n);
+        }
+        offset += n;
+    }
+}
+
+/** Return true if block b of the file is inside, but not at the start of, an
+ * extent. */
+static bool inside_ext(void *image, a1fs_inode *ino, a1fs_blk_t b) {
+    a1fs_extent *ext = extent_tree_find(image, ino, b);
+    return ext != NULL && b != ext->logical && b - ext->logical < ext_len(ext);
+}
+
+/** Make bytes [offset, offset + len) of the file read as zeros. Whole blocks
+ * in the range are taken out of the file and freed, leaving a hole; the
+ * partial blocks at its ends are zeroed. */
+void punch_hole(fs_ctx *fs, a1fs_inode *ino, uint64_t offset, uint64_t len) {
+    void *image = fs->image;
+    uint64_t end = offset + len;
+    if (is_inline(ino)) {
+        if (end > ino->size) end = ino->size;
+        if (offset < end) memset(inline_data(ino) + offset, 0, end - offset);
+        return;
+    }
+    uint64_t alloc_end = (uint64_t) count_file_blks(image, ino) * A1FS_BLOCK_SIZE;
+    if (end > alloc_end) end = alloc_end;
+    if (offset >= end) return;
+    // whole blocks in the range
+    a1fs_blk_t first = CEIL_DIV(offset, A1FS_BLOCK_SIZE);
+    a1fs_blk_t last = end / A1FS_BLOCK_SIZE;
+    if (first >= last) {
+        zero_file_range(image, ino, offset, end);
+        return;
+    }
+    zero_file_range(image, ino, offset, (uint64_t) first * A1FS_BLOCK_SIZE);
+    zero_file_range(image, ino, (uint64_t) last * A1FS_BLOCK_SIZE, end);
+
+    // cutting the extents at both ends of the range adds at most two, like
+    // in set_blks_unwritten(); without room for them, the blocks are zeroed
+    // instead
+    int splits = inside_ext(image, ino, first) + inside_ext(image, ino, last);
+    if (splits > 0 && !has_n_free_blk(fs, splits * (extent_tree_depth(image, ino) + 2), LOOKUP_DB)) {
+        zero_file_range(image, ino, (uint64_t) first * A1FS_BLOCK_SIZE, (uint64_t) last * A1FS_BLOCK_SIZE);
+        return;
+    }
+    split_ext(fs, ino, last);
+    split_ext(fs, ino, first);
+    __atomic_add_fetch(&fs->ext_gen, 1, __ATOMIC_RELAXED);
+
+    // every extent in the range now lies entirely inside it and goes away
+    // with its blocks
+    a1fs_extent *ext;
+    while ((ext = find_ext_from(image, ino, first)) != NULL && ext->logical < last) {
+        a1fs_blk_t num = ext_len(ext);
+        shrink_ext_by_num_blk(fs, ino, ext, &num);
+    }
+}
+
+/** Find the extent holding block blk_offset of the file and store the offset
+ * of the block within the extent in ext_offset. Return NULL if not found. */
+a1fs_extent *find_ext_given_offset(void *image, a1fs_inode *file_ino, a1fs_blk_t blk_offset,
+                                   a1fs_blk_t *ext_offset) {
+    a1fs_extent *this_ext = extent_tree_find(image, file_ino, blk_offset);
+    if (this_ext == NULL || blk_offset - this_ext->logical >= ext_len(this_ext)) return NULL;
+    *ext_offset = blk_offset - this_ext->logical;
+    return this_ext;
+}
+
 /** Find until reach to the blk_offset. */
 a1fs_blk_t find_blk_given_offset(void *image, a1fs_inode *file_ino, a1fs_blk_t blk_offset) {
-    a1fs_extent *start_ext = (a1fs_extent *)jump_to(image, file_ino->i_ptr_extent, A1FS_BLOCK_SIZE);
-    a1fs_extent *this_ext;
-    // accumulate to blk_offset
-    a1fs_blk_t blk_acc = 0;
-    for (a1fs_blk_t offset = 0; offset < 512; offset++) {
-        this_ext = start_ext + offset;
-        if (this_ext->start == (a1fs_blk_t) -1) continue;
-        if ((blk_acc + this_ext->count) >= blk_offset) {
-            return this_ext->start + (blk_offset - blk_acc);
+    a1fs_blk_t ext_offset;
+    a1fs_extent *ext = find_ext_given_offset(image, file_ino, blk_offset, &ext_offset);
+    return ext != NULL ? ext->start + ext_offset : (a1fs_blk_t) -1;
+}
+
+/** Like find_ext_given_offset(), but try the extent in the cursor first and
+ * remember the extent found in it. Return the copy in the cursor. */
+a1fs_extent *find_ext_cached(fs_ctx *fs, a1fs_inode *file_ino, a1fs_blk_t blk_offset,
+                             ext_cursor *cur, a1fs_blk_t *ext_offset) {
+    a1fs_extent *ext = &cur->ext;
+    uint64_t gen = __atomic_load_n(&fs->ext_gen, __ATOMIC_RELAXED);
+    if (!cur->valid || cur->gen != gen || blk_offset < ext->logical
+        || blk_offset - ext->logical >= ext_len(ext)) {
+        ext = find_ext_given_offset(fs->image, file_ino, blk_offset, ext_offset);
+        if (ext == NULL) return NULL;
+        cur->ext = *ext;
+        cur->gen = gen;
+        cur->valid = true;
+    }
+    *ext_offset = blk_offset - cur->ext.logical;
+    return &cur->ext;
+}
+
+/** Call fn for each run of the len bytes at byte offset of the file that is
+ * contiguous in the image: the rest of an extent, or a hole up to the next
+ * one. */
+int walk_file_blks(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, size_t len, ext_cursor *cur,
+                   int (*fn)(void *arg, const void *data, size_t len), void *arg) {
+    void *image = fs->image;
+    if (is_inline(file_ino)) return fn(arg, inline_data(file_ino) + offset, len);
+    ext_cursor local = { .valid = false };
+    if (cur == NULL) cur = &local;
+    while (len > 0) {
+        a1fs_blk_t ext_offset;
+        a1fs_blk_t blk_offset = offset / A1FS_BLOCK_SIZE;
+        a1fs_extent *ext = find_ext_cached(fs, file_ino, blk_offset, cur, &ext_offset);
+        size_t byte_start = offset % A1FS_BLOCK_SIZE;
+        uint64_t run = len;
+        if (ext != NULL) {
+            run = (uint64_t) (ext_len(ext) - ext_offset) * A1FS_BLOCK_SIZE - byte_start;
         } else {
-            blk_acc += this_ext->count;
+            a1fs_extent *next = find_ext_from(image, file_ino, blk_offset);
+            if (next != NULL) run = (uint64_t) (next->logical - blk_offset) * A1FS_BLOCK_SIZE - byte_start;
         }
+        size_t n = run < len ? run : len;
+        const void *data = NULL;
+        if (ext != NULL && !ext_is_unwritten(ext))
+            data = (unsigned char *)jump_to(image, ext->start + ext_offset, A1FS_BLOCK_SIZE) + byte_start;
+        int ret = fn(arg, data, n);
+        if (ret != 0) return ret;
+        offset += n;
+        len -= n;
     }
-    return -1;
+    return 0;
+}
+
+/** Return true if bytes [offset, offset + len) of the file are all in written
+ * extents (or in the inode), so that writing them allocates nothing. */
+bool file_range_written(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, size_t len, ext_cursor *cur) {
+    if (is_inline(file_ino)) return true;
+    ext_cursor local = { .valid = false };
+    if (cur == NULL) cur = &local;
+    a1fs_blk_t blk_offset = offset / A1FS_BLOCK_SIZE;
+    a1fs_blk_t end = CEIL_DIV(offset + len, A1FS_BLOCK_SIZE);
+    while (blk_offset < end) {
+        a1fs_blk_t ext_offset;
+        a1fs_extent *ext = find_ext_cached(fs, file_ino, blk_offset, cur, &ext_offset);
+        if (ext == NULL || ext_is_unwritten(ext)) return false;
+        blk_offset += ext_len(ext) - ext_offset;
+    }
+    return true;
+}
+
+/** Copy len bytes from buf to byte offset of the file, one memcpy() per
+ * extent. Blocks are given to the holes written. With buf NULL nothing is
+ * copied, only the range is made written. Return 0 on success, -ENOSPC if out
+ * of space. */
+int write_file_blks(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, const void *buf, size_t len,
+                    ext_cursor *cur) {
+    void *image = fs->image;
+    if (is_inline(file_ino)) {
+        memcpy(inline_data(file_ino) + offset, buf, len);
+        return 0;
+    }
+    ext_cursor local = { .valid = false };
+    if (cur == NULL) cur = &local;
+    const unsigned char *src = (const unsigned char *)buf;
+    while (len > 0) {
+        a1fs_blk_t ext_offset;
+        a1fs_blk_t blk_offset = offset / A1FS_BLOCK_SIZE;
+        a1fs_extent *ext = find_ext_cached(fs, file_ino, blk_offset, cur, &ext_offset);
+        size_t byte_start = offset % A1FS_BLOCK_SIZE;
+        if (ext == NULL) {
+            // fill the hole up to the end of the write or the next extent
+            a1fs_blk_t num = CEIL_DIV(offset + len, A1FS_BLOCK_SIZE) - blk_offset;
+            a1fs_extent *next = find_ext_from(image, file_ino, blk_offset);
+            if (next != NULL && next->logical - blk_offset < num) num = next->logical - blk_offset;
+            if (alloc_file_range(fs, file_ino, blk_offset, num, false) != 0) return -ENOSPC;
+            ext = find_ext_cached(fs, file_ino, blk_offset, cur, &ext_offset);
+        }
+        uint64_t run = (uint64_t) (ext_len(ext) - ext_offset) * A1FS_BLOCK_SIZE - byte_start;
+        size_t n = run < len ? run : len;
+        unsigned char *dst = (unsigned char *)jump_to(image, ext->start + ext_offset, A1FS_BLOCK_SIZE) + byte_start;
+        if (ext_is_unwritten(ext)) {
+            // the blocks get real data; the parts of the first and the last
+            // one outside the write must read as zeros
+            size_t end = byte_start + n;
+            if (set_blks_unwritten(fs, file_ino, blk_offset, CEIL_DIV(end, A1FS_BLOCK_SIZE), false) != 0)
+                return -ENOSPC;
+            memset(dst - byte_start, 0, byte_start);
+            if (end % A1FS_BLOCK_SIZE != 0) memset(dst + n, 0, A1FS_BLOCK_SIZE - end % A1FS_BLOCK_SIZE);
+        }
+        if (src != NULL) {
+            memcpy(dst, src, n);
+            src += n;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
 }
 
 #endif
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <stddef.h>
 #include "a1fs.h"
+#include "dentry.h"
 #include "fs_ctx.h"
 
 #ifndef DEBUG
@@ -71,6 +72,23 @@ unsigned char *get_first_inode_bitmap(void *image);
 /** Get the first data bitmap. */
 unsigned char *get_first_data_bitmap(void *image);
 
+/** Get the descriptor of the given allocation group. */
+a1fs_group_desc *get_group_desc(void *image, uint32_t group);
+
+/** Get the allocation group of the bit in the bitmap indicated by lookup. */
+uint32_t get_group_of(void *image, uint32_t bit, uint32_t lookup);
+
+/** Get the first bit of the group in the bitmap indicated by lookup. */
+uint32_t get_group_first_bit(void *image, uint32_t group, uint32_t lookup);
+
+/** Get the end (exclusive) of the group in the bitmap indicated by lookup. */
+uint32_t get_group_end_bit(void *image, uint32_t group, uint32_t lookup);
+
+/** Get the bitmap block that holds the bit of the bitmap indicated by lookup.
+ * The block holds bits [*first_bit, *first_bit + *num_bits). */
+unsigned char *get_bitmap_blk(void *image, uint32_t lookup, uint32_t bit,
+                              uint32_t *first_bit, uint32_t *num_bits);
+
 // locate which bitmap stores this bit
 a1fs_blk_t get_block_offset(uint32_t bit);
 
@@ -84,42 +102,82 @@ uint32_t get_bit_offset(uint32_t bit);
 bool is_used_bit(void *image, uint32_t bit, uint32_t lookup);
 
 /** Set the bit to on in the bitmap indicated by lookup. */
-void mask(void *image, uint32_t bit, uint32_t lookup, bool on);
+void mask(fs_ctx *fs, uint32_t bit, uint32_t lookup, bool on);
 
 /** Mask from start to end (exclusive) in bitmap. */
-void mask_range(void *image, uint32_t offset_start, uint32_t offset_end, uint32_t lookup, bool on);
+void mask_range(fs_ctx *fs, uint32_t offset_start, uint32_t offset_end, uint32_t lookup, bool on);
 
 /** Find the first unused bit. Return -1 if no free block found. */
-int find_first_free_blk_num(void *image, uint32_t lookup);
+int find_first_free_blk_num(fs_ctx *fs, uint32_t lookup);
+
+/** Find the first unused bit at or after goal, wrapping around to the start
+ * of the bitmap. Return -1 if no free block found. */
+int find_free_blk_near(fs_ctx *fs, uint32_t lookup, uint32_t goal);
 
 /** Initialize empty directory block. */
 void init_directory_blk(void *image, a1fs_blk_t blk_num);
 
-/** Find first unused directory entry in the block given its block number. 
- * return the offset of the directory, -1 for excess the max: 512.
- */
-int find_first_empty_direntry_offset(void *image, a1fs_blk_t blk_num);
-
-uint32_t get_itable_block_offset(a1fs_ino_t inum);
+uint32_t get_itable_block_offset(void *image, a1fs_ino_t inum);
 
-uint32_t get_itable_offset(a1fs_ino_t inum);
+uint32_t get_itable_offset(void *image, a1fs_ino_t inum);
 
 /** Get inode by inum. */
 a1fs_inode *get_inode_by_inumber(void *image, a1fs_ino_t inum);
 
-/** Format the block to empty extents. */
-void init_extent_blk(void *image, a1fs_blk_t blk_num);
+/** Check if the data of the file is stored in its inode. */
+static inline bool is_inline(const a1fs_inode *ino)
+{
+	return (ino->i_flags & A1FS_INODE_INLINE) != 0;
+}
+
+/** Check if the directory has a hashed index. */
+static inline bool is_indexed(const a1fs_inode *ino)
+{
+	return (ino->i_flags & A1FS_INODE_INDEXED) != 0;
+}
+
+/** Get the inline data of the inode. */
+static inline unsigned char *inline_data(a1fs_inode *ino)
+{
+	return (unsigned char *)&ino->i_extents;
+}
+
+/** Get the number of bytes of data an inode can hold inline. */
+static inline size_t inline_capacity(void *image)
+{
+	return get_superblock(image)->s_inode_size - offsetof(a1fs_inode, i_extents);
+}
+
+/** Move the inline data of the file or directory to a block, giving it an
+ * extent tree. Return 0 on success, -ENOSPC if out of space. */
+int uninline_file(fs_ctx *fs, a1fs_inode *ino);
+
+/** Get the number of blocks in the extent. */
+static inline a1fs_blk_t ext_len(const a1fs_extent *ext)
+{
+	return ext->count & ~A1FS_EXTENT_UNWRITTEN;
+}
+
+/** Check if the blocks of the extent are preallocated and never written. */
+static inline bool ext_is_unwritten(const a1fs_extent *ext)
+{
+	return (ext->count & A1FS_EXTENT_UNWRITTEN) != 0;
+}
 
-/* Find the first empty extent. Return the offset to the extent that is not used. If 
- * no empty extent found, return -1.
-*/
-int find_first_empty_extent_offset(void *image, a1fs_blk_t blk_num);
+/** Add an extent of count blocks starting at block start to the end of the
+ * file. Return 0 on success, -ENOSPC if out of space for the extent tree. */
+int append_extent(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t start, a1fs_blk_t count);
 
 /** Find the inumber of the file given its name, starting from dir. 
  * Return -1 if not found.
  */
 int find_file_ino_in_dir(void *image, a1fs_inode *dir_ino, char *name);
 
+/** Find the inumber of the name in the directory, through the lookup cache.
+ * Return -ENOENT if not found, -ENOTDIR if dir_inum is not a directory.
+ */
+int dir_lookup(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name);
+
 /* Returns the inode number for the element at the end of the path
  * if it exists.  If there is any error, return -1.
  * Possible errors include:
@@ -128,67 +186,204 @@ int find_file_ino_in_dir(void *image, a1fs_inode *dir_ino, char *name);
  */
 int path_lookup(const char *path, fs_ctx *fs);
 
-/** Find first usable directory entry. Return NULL if no empty dentry => either abort or extend
- * existing extent.
-*/
-a1fs_dentry *find_first_free_dentry(void *image, a1fs_ino_t inum);
+/** Add an entry for the name in the first dentry area of the unindexed
+ * directory with room for it, unused for the caller to set, starting from the
+ * hint of the directory. Return NULL if there is none. */
+a1fs_dentry *add_dentry_in_dir(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name);
+
+/** Free the entry of the directory, moving the hint of the directory back to
+ * its block, and compact the directory if it is left mostly empty. The
+ * entries of the directory may move. */
+void free_dentry(fs_ctx *fs, a1fs_ino_t dir_inum, a1fs_dentry *d);
+
+/** Find a free entry for the name in the directory, adding a dentry block if
+ * all entries are used, as long as num_blk more blocks stay free for the
+ * caller. Return NULL if there is no space. */
+a1fs_dentry *alloc_dentry(fs_ctx *fs, a1fs_ino_t dir_inum, const char *name, a1fs_blk_t num_blk);
+
+/** Initialize inode with an empty extent tree. */
+void init_inode(void *image, a1fs_ino_t inum, mode_t mode, uint32_t links, uint64_t size);
+
+/** Initialize an inode whose data is stored inline, empty for now. */
+void init_inline_inode(void *image, a1fs_ino_t inum, mode_t mode, uint32_t links);
+
+/** Position in the dentries of a directory. */
+typedef struct dir_iter {
+	/** The directory. */
+	a1fs_inode *dir;
+	/** Extent of the current dentry block. */
+	a1fs_extent *ext;
+	/** Offset of the current dentry block within the extent. */
+	a1fs_blk_t blk;
+	/** Whether any dentries have been returned yet. */
+	bool started;
+	/** The current dentry area, NULL before the first and after the last. */
+	void *area;
+	/** Size of the current dentry area in bytes. */
+	size_t size;
+	/** Offset of the next entry within the current dentry area. */
+	size_t off;
+} dir_iter;
+
+/** Start iterating over the dentries of the directory. */
+static inline void dir_iter_init(dir_iter *it, a1fs_inode *dir)
+{
+	it->dir = dir;
+	it->ext = NULL;
+	it->blk = 0;
+	it->started = false;
+	it->area = NULL;
+	it->size = 0;
+	it->off = 0;
+}
+
+/** Move to the next dentry area of the directory - its inode or its next
+ * dentry block - and return it, storing its size in size. Return NULL after
+ * the last one. */
+void *dir_iter_next_area(void *image, dir_iter *it, size_t *size);
+
+/** Return the next entry of the directory, used or not. Return NULL after the
+ * last one. */
+a1fs_dentry *dir_iter_next(void *image, dir_iter *it);
 
-/** Initialize inode. */
-void init_inode(void *image, a1fs_ino_t inum, mode_t mode, 
-uint32_t links, uint64_t size, uint32_t extents, a1fs_blk_t ptr_extent);
+/** Return the position in the directory of the entry after the last one
+ * returned: its dentry block offset times the block size plus its byte offset
+ * in the block. */
+static inline uint64_t dir_iter_tell(const dir_iter *it)
+{
+	a1fs_blk_t lblk = it->ext != NULL ? it->ext->logical + it->blk : 0;
+	return (uint64_t) lblk * A1FS_BLOCK_SIZE + it->off;
+}
+
+/**
+ * Move a new iterator to a position returned by dir_iter_tell(), so that
+ * dir_iter_next() returns the first entry at or after it. Entries moved
+ * within the directory since, as when a dentry block of an indexed directory
+ * is split, may be skipped or returned again.
+ */
+void dir_iter_seek(void *image, dir_iter *it, uint64_t pos);
 
 /** Create new dir in dentry. */
-void create_new_dir_in_dentry(void *image, a1fs_dentry *parent_dir, 
-const char *name, mode_t mode);
+void create_new_dir_in_dentry(fs_ctx *fs, a1fs_ino_t parent_inum, a1fs_dentry *parent_dir,
+mode_t mode);
 
 static inline bool has_n_free_blk(fs_ctx *fs, a1fs_blk_t n, uint32_t lookup) {
 	if (lookup == LOOKUP_DB) {
-		return (bool) (fs->s->s_num_free_blocks >= n);
+		// blocks reserved for delayed allocation are not available
+		return (bool) (fs->s->s_num_free_blocks - fs->da.reserved >= n);
 	} else {
 		return (bool) (fs->s->s_num_free_inodes >= n);
 	}
 	return false;
 }
 
-/** Traverse all extent of dir_ino to find name; return the inum of the file. */
+/** Find the entry of the directory with the given name, through its index if
+ * it has one. Return NULL if there is none. */
 a1fs_dentry *find_dentry_in_dir(void *image, a1fs_inode *dir_ino, const char *name);
 
 /** Return true if all associated dentry is empty, else false. */
 bool is_empty_dir(void *image, a1fs_inode *dir_ino);
 
 /** Find all blk num of dentry blk associated with ino, mask the blk in bitmap as 0. */
-void free_dentry_blks(void *image, a1fs_inode *dir_ino);
+void free_dentry_blks(fs_ctx *fs, a1fs_inode *dir_ino);
 
-/** Mask 0 the extent block. */
-static inline void free_extent_blk(void *image, a1fs_inode *ino_rm) {
-	mask(image, ino_rm->i_ptr_extent, LOOKUP_DB, false);
-}
+/** Mask 0 the blocks of the extent tree. */
+void free_extent_blk(fs_ctx *fs, a1fs_inode *ino_rm);
 
 /** Create an empty file inside the directory. */
-void create_new_file_in_dentry(void *image, a1fs_dentry *dir, const char *name, mode_t mode);
+void create_new_file_in_dentry(fs_ctx *fs, a1fs_ino_t parent_inum, a1fs_dentry *dir,
+mode_t mode);
 
 /** Find the last used extent. */
 a1fs_extent *find_last_used_ext(void *image, a1fs_inode *ino);
 
 /** Shrink the extent by n block. Mask off blocks and unset extent if 
  * the extent is empty. Return the number of extent reduced. */
-int shrink_ext_by_num_blk(void *image, a1fs_extent *ext, a1fs_blk_t *num);
+int shrink_ext_by_num_blk(fs_ctx *fs, a1fs_inode *ino, a1fs_extent *ext, a1fs_blk_t *num);
 
 /** Shrink the block to the given size in byte. */
 void shrink_blk_to_size(void *image, a1fs_blk_t blk_num, size_t size);
 
 /** Shrink the file by num of block. */
-void shrink_by_num_blk(void *image, a1fs_inode *ino, a1fs_blk_t num_blk);
+void shrink_by_num_blk(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t num_blk);
 
 /** Shrink amount of bytes specified in size. */
-int shrink_by_amount(void *image, a1fs_inode *ino, size_t size);
+int shrink_by_amount(fs_ctx *fs, a1fs_inode *ino, size_t size);
 
-/** Extend the file by specified bytes. */
+/** Extend the file by specified bytes. The new range past the last block is
+ * left as a hole, which reads as zeros and has no blocks. */
 int extend_by_amount(fs_ctx *fs, a1fs_inode *ino, size_t size);
 
+/** Get the block offset past the last extent of the file, i.e. its size in
+ * blocks including the ones preallocated past its end. */
+a1fs_blk_t count_file_blks(void *image, a1fs_inode *ino);
+
+/** Get the number of blocks allocated to the file; holes have none. */
+a1fs_blk_t count_alloc_blks(void *image, a1fs_inode *ino);
+
+/** Give the holes among blocks [first, first + num) of the file new blocks,
+ * marked unwritten if unwritten is true, else zeroed. Return 0 on success,
+ * -ENOSPC if out of space. */
+int alloc_file_range(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t first, a1fs_blk_t num, bool unwritten);
+
+/** Append num new blocks to the file, marked unwritten if unwritten is true,
+ * else zeroed. Return 0 on success, -ENOSPC if out of space. */
+int alloc_file_blks(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t num, bool unwritten);
+
+/** Mark blocks [first, first + num) of the file as unwritten or written,
+ * splitting and merging extents as needed. Return 0 on success, -ENOSPC if
+ * out of space for the extent tree (nothing is changed then). */
+int set_blks_unwritten(fs_ctx *fs, a1fs_inode *ino, a1fs_blk_t first, a1fs_blk_t num, bool unwritten);
+
+/** Make bytes [offset, offset + len) of the file read as zeros. Whole blocks
+ * in the range are taken out of the file and freed, leaving a hole; the
+ * partial blocks at its ends are zeroed. */
+void punch_hole(fs_ctx *fs, a1fs_inode *ino, uint64_t offset, uint64_t len);
+
+/** Find the extent holding block blk_offset of the file and store the offset
+ * of the block within the extent in ext_offset. Return NULL if not found. */
+a1fs_extent *find_ext_given_offset(void *image, a1fs_inode *file_ino, a1fs_blk_t blk_offset,
+                                   a1fs_blk_t *ext_offset);
+
 /** Find until reach to the blk_offset. */
 a1fs_blk_t find_blk_given_offset(void *image, a1fs_inode *file_ino, a1fs_blk_t blk_offset);
 
+/** Copy of the extent that mapped the last block of a file looked up with it,
+ * so that looking up the next blocks does not go through the extent tree. */
+typedef struct ext_cursor {
+	/** Whether ext holds an extent. */
+	bool valid;
+	/** Value of fs->ext_gen when ext was copied; stale if it changed. */
+	uint64_t gen;
+	/** Copy of the extent. */
+	a1fs_extent ext;
+} ext_cursor;
+
+/** Like find_ext_given_offset(), but try the extent in the cursor first and
+ * remember the extent found in it. Return the copy in the cursor. */
+a1fs_extent *find_ext_cached(fs_ctx *fs, a1fs_inode *file_ino, a1fs_blk_t blk_offset,
+                             ext_cursor *cur, a1fs_blk_t *ext_offset);
+
+/** Call fn for each run of the len bytes at byte offset of the file that is
+ * contiguous in the image, in order, with a pointer to the run, or NULL for
+ * holes and unwritten extents, which read as zeros. The cursor may be NULL.
+ * Stop at the first nonzero value fn returns and return it; 0 otherwise. */
+int walk_file_blks(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, size_t len, ext_cursor *cur,
+                   int (*fn)(void *arg, const void *data, size_t len), void *arg);
+
+/** Return true if bytes [offset, offset + len) of the file are all in written
+ * extents (or in the inode), so that writing them allocates nothing. The
+ * cursor may be NULL. */
+bool file_range_written(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, size_t len, ext_cursor *cur);
+
+/** Copy len bytes from buf to byte offset of the file. Blocks are given to the
+ * holes written. With buf NULL nothing is copied, only the range is made
+ * written: holes get zeroed blocks, and unwritten extents are zeroed outside
+ * the range. The cursor may be NULL. Return 0 on success, -ENOSPC if out of
+ * space for them or an unwritten extent cannot be split. */
+int write_file_blks(fs_ctx *fs, a1fs_inode *file_ino, uint64_t offset, const void *buf, size_t len,
+                    ext_cursor *cur);
+
 #ifdef DEBUG
 
 #include <stdio.h>